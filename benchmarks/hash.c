@@ -0,0 +1,86 @@
+// hashString() against the FNV-1a it replaced, `make hashbench` builds and
+// runs it. Each distribution hashes the same pile of random strings with both
+// and prints the time per string and the throughput
+#include "../include/datastructures/hash.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static uint32_t fnv1a(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef struct {
+  const char *name;
+  int minLength;
+  int maxLength;
+  int count;
+} Distribution;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(uint32_t (*hash)(const char *, int), char *buffer,
+                  int *offsets, int *lengths, int count, int rounds,
+                  uint32_t *sink) {
+  double start = now();
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < count; i++) {
+      *sink ^= hash(buffer + offsets[i], lengths[i]);
+    }
+  }
+  return now() - start;
+}
+
+int main() {
+  Distribution distributions[] = {
+      {"identifiers (3-12)", 3, 12, 100000},
+      {"short strings (16-128)", 16, 128, 50000},
+      {"lines (128-1K)", 128, 1024, 10000},
+      {"documents (4K-64K)", 4096, 65536, 200},
+  };
+  srand(42);
+  uint32_t sink = 0;
+  printf("%-24s %14s %14s %10s %10s\n", "", "fnv ns/str", "new ns/str",
+         "fnv MB/s", "new MB/s");
+  for (size_t d = 0; d < sizeof(distributions) / sizeof(Distribution); d++) {
+    Distribution *dist = &distributions[d];
+    int *offsets = malloc(sizeof(int) * dist->count);
+    int *lengths = malloc(sizeof(int) * dist->count);
+    long total = 0;
+    for (int i = 0; i < dist->count; i++) {
+      lengths[i] =
+          dist->minLength + rand() % (dist->maxLength - dist->minLength + 1);
+      offsets[i] = total;
+      total += lengths[i];
+    }
+    char *buffer = malloc(total);
+    for (long i = 0; i < total; i++) {
+      buffer[i] = 'a' + rand() % 26;
+    }
+    // about 256MB of hashing per function
+    int rounds = (int)(256L * 1024 * 1024 / total) + 1;
+    double fnv = run(fnv1a, buffer, offsets, lengths, dist->count, rounds,
+                     &sink);
+    double fast = run(hashString, buffer, offsets, lengths, dist->count,
+                      rounds, &sink);
+    double strings = (double)dist->count * rounds;
+    double megabytes = (double)total * rounds / (1024 * 1024);
+    printf("%-24s %14.1f %14.1f %10.0f %10.0f\n", dist->name,
+           fnv / strings * 1e9, fast / strings * 1e9, megabytes / fnv,
+           megabytes / fast);
+    free(buffer);
+    free(offsets);
+    free(lengths);
+  }
+  return sink == 42; // keeps the hashing from being optimized away
+}
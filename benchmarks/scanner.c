@@ -0,0 +1,85 @@
+// tokenizer throughput, `make scanbench` builds and runs it. Generates a few
+// megabytes of script (indented blocks, long and short names, keywords,
+// numbers, strings, comments) and times scanToken() over all of it
+#include "../include/compiler/scanner.h"
+#include "../include/common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+
+static const char *names[] = {"i", "total", "customerLifetimeValue", "x2",
+                              "monthly_recurring_revenue", "churn", "acc",
+                              "synergyScore"};
+static const char *statements[] = {
+    "%sbootstrap %s = %s + %d.%d;\n",
+    "%sdisrupt (%s < %d) { %s = %s * 2; } pivot { leverage(%s); }\n",
+    "%s# %s is the number of seats we've sold this quarter, %d of them\n",
+    "%sleverage(\"%s has churned, %d accounts to win back\");\n",
+    "%sagentic (bootstrap %s = 0; %s < %d; %s = %s + 1) {\n",
+    "%ssaas %s;\n",
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int name() { return rand() % (sizeof(names) / sizeof(names[0])); }
+
+int main() {
+  char *source = malloc(SOURCE_SIZE + 256);
+  int length = 0;
+  srand(7);
+  while (length < SOURCE_SIZE) {
+    const char *indent = "            " + 12 - 4 * (rand() % 4);
+    const char *a = names[name()], *b = names[name()];
+    switch (rand() % 6) {
+    case 0:
+      length += sprintf(source + length, statements[0], indent, a, b,
+                        rand() % 1000, rand() % 100);
+      break;
+    case 1:
+      length += sprintf(source + length, statements[1], indent, a,
+                        rand() % 100, b, b, a);
+      break;
+    case 2:
+      length += sprintf(source + length, statements[2], indent, a, rand());
+      break;
+    case 3:
+      length += sprintf(source + length, statements[3], indent, a, rand());
+      break;
+    case 4:
+      length += sprintf(source + length, statements[4], indent, a, a,
+                        rand() % 100, a, a);
+      break;
+    case 5:
+      length += sprintf(source + length, statements[5], indent, b);
+      break;
+    }
+  }
+
+  int rounds = 10;
+  long tokens = 0;
+  double best = 1e9;
+  for (int round = 0; round < rounds; round++) {
+    double start = now();
+    initScanner(source);
+    long count = 0;
+    for (Token token = scanToken(); token.type != TOKEN_EOF;
+         token = scanToken()) {
+      count++;
+    }
+    double elapsed = now() - start;
+    best = elapsed < best ? elapsed : best;
+    tokens = count;
+  }
+  printf("%.1f MB, %ld tokens: %.1f ms, %.0f MB/s, %.1f ns/token\n",
+         length / (1024.0 * 1024), tokens, best * 1e3,
+         length / (1024.0 * 1024) / best, best / tokens * 1e9);
+  free(source);
+  return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef bryte_aot_h
+#define bryte_aot_h
+#include "../bytecode/chunk.h"
+#include "../bytecode/object.h"
+#include "../common.h"
+#include "../datastructures/hashmap.h"
+#include "../output.h"
+#include "../vm/vm.h"
+#include <stdio.h>
+
+// runtime side of `saas --emit-c`. The generated C file includes this and gets
+// linked against build/libsaas.a, so values, objects, globals, natives and the
+// slow paths in vm.c are the same code the interpreter uses. Only the dispatch
+// loop is gone: every function becomes one C function with gotos for jumps
+
+// what a compiled function is, it runs its frame until OP_RETURN and returns
+// false after a runtime error
+typedef bool (*AotFunction)(CallFrame *frame);
+
+// the generated code keeps the stack top in a local `sp`, these hand it over
+// to the vm.c helpers and take it back afterwards. `at` is the offset of the
+// next instruction so runtimeError() can find the line
+#define AOT_SYNC(at) (vm->stackTop = sp, frame->ip = code + (at))
+#define AOT_RELOAD() (sp = vm->stackTop)
+// a vm.c helper that returns false after a runtime error
+#define AOT_TRY(at, call)                                                      \
+  do {                                                                         \
+    AOT_SYNC(at);                                                              \
+    if (!(call))                                                               \
+      return false;                                                            \
+    AOT_RELOAD();                                                              \
+  } while (false)
+
+// same as BINARY_OP in run()
+#define AOT_BINARY(at, valueType, op)                                          \
+  do {                                                                         \
+    if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) {                            \
+      AOT_SYNC(at);                                                            \
+      runtimeError("Operands have to be numbers.");                            \
+      return false;                                                            \
+    }                                                                          \
+    sp[-2] = valueType(PAYLOAD_NUMBER(sp[-2]) op PAYLOAD_NUMBER(sp[-1]));      \
+    sp--;                                                                      \
+  } while (false)
+
+#define AOT_ADD(at)                                                            \
+  do {                                                                         \
+    if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {                              \
+      sp[-2] = NUMBER_VAL(PAYLOAD_NUMBER(sp[-2]) + PAYLOAD_NUMBER(sp[-1]));    \
+      sp--;                                                                    \
+    } else if (IS_STRING(sp[-1]) && IS_STRING(sp[-2])) {                       \
+      AOT_SYNC(at);                                                            \
+      concatenate();                                                           \
+      AOT_RELOAD();                                                            \
+    } else {                                                                   \
+      AOT_SYNC(at);                                                            \
+      runtimeError("Operands must be two numbers (addition) or two strings "   \
+                   "(concatenation)");                                         \
+      return false;                                                            \
+    }                                                                          \
+  } while (false)
+
+#define AOT_NEGATE(at)                                                         \
+  do {                                                                         \
+    if (!IS_NUMBER(sp[-1])) {                                                  \
+      AOT_SYNC(at);                                                            \
+      runtimeError("Operand must be a number.");                               \
+      return false;                                                            \
+    }                                                                          \
+    sp[-1].payload.number *= -1;                                               \
+  } while (false)
+
+// OP_CALL. A closure's frame gets run right away through runFrame(), which
+// picks up its aotCode
+#define AOT_CALL(at, argCount)                                                 \
+  do {                                                                         \
+    AOT_SYNC(at);                                                              \
+    if (!callOperand(argCount))                                                \
+      return false;                                                            \
+    if (vm->frameCount > frameCount && !runFrame())                             \
+      return false;                                                            \
+    AOT_RELOAD();                                                              \
+  } while (false)
+// same, when the emitter knows which function gets called here (a global
+// that's only ever defined once) it calls its C function directly
+#define AOT_CALL_DIRECT(at, argCount, expected, direct)                        \
+  do {                                                                         \
+    AOT_SYNC(at);                                                              \
+    if (!callOperand(argCount))                                                \
+      return false;                                                            \
+    if (vm->frameCount > frameCount) {                                          \
+      CallFrame *callee = &vm->frames[vm->frameCount - 1];                       \
+      if (!(callee->closure->function == (expected) ? direct(callee)           \
+                                                    : runFrame()))             \
+        return false;                                                          \
+    }                                                                          \
+    AOT_RELOAD();                                                              \
+  } while (false)
+
+// points a chunk at the code and line tables in the generated file
+void aotLoadChunk(ObjFunction *function, const uint8_t *code, int count,
+                  const uint8_t *lines, int lineCount);
+// runs the script and returns the exit code saas would have used
+int aotRun(VM *machine, ObjFunction *script);
+
+#endif
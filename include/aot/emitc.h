@@ -0,0 +1,12 @@
+#ifndef bryte_emitc_h
+#define bryte_emitc_h
+#include "../common.h"
+#include <stdio.h>
+
+// saas --emit-c: compiles the script and writes a C translation unit with one
+// C function per SaaScript function to `out`. Build it with
+//   gcc -I include out.c build/libsaas.a -lm
+// false if the script didn't compile
+bool emitC(const char *source, const char *path, FILE *out);
+
+#endif
@@ -38,17 +38,54 @@ typedef enum {
   OP_SET_INDEX,
   OP_ARRAY,
   OP_GET_PROPERTY,
+  // register forms, only emitted when built with REGISTER_VM (see
+  // compiler/registers.c). Laid out as op, kinds, dst, a, b where dst, a and b
+  // are frame slots, unless kinds says a/b are constant indexes or that the
+  // result gets pushed instead of stored in dst
+  OP_ADD_R,
+  OP_SUBSTRACT_R,
+  OP_MULITPLY_R,
+  OP_DIVIDE_R,
+  OP_EQUAL_R,
+  OP_GREATER_R,
+  OP_LESS_R,
+  OP_MOVE_R, // op, kinds, dst, a
 } OpCode;
 
+// bits of the kinds byte
+#define REG_A_CONSTANT 1
+#define REG_B_CONSTANT 2
+#define REG_PUSH 4
+
 typedef struct {
   int count;
   int capacity;
-  int *lines;
+  // which line every byte of code came from, as runs: a count byte then how
+  // far the line moved since the last run as a zigzag varint. Only ever
+  // decoded for an error or the disassembler, see getLine()
+  uint8_t *lines;
+  int lineCount;
+  int lineCapacity;
+  int lastLine; // the line of the run writeChunk() is adding to
+  int lastRun;  // where that run's count is, -1 before the first one
   ValueArray constants;
   uint8_t *code;
   bool cooked;
+  struct Instruction *decoded; // built by run() the first time, see vm/decode.h
+  uint32_t *decodedIndex; // code offset -> index into decoded
+  // code and lines point into a mapped .saasc image (bytecode/image.h) or
+  // an --emit-c program's tables, so they aren't ours to free
+  bool mapped;
 } Chunk;
 
+// walks the line table from the start, for going through a chunk in order
+typedef struct {
+  Chunk *chunk;
+  int at;      // next run in chunk->lines
+  int covered; // bytes of code the runs read so far cover
+  int line;
+} LineReader;
+
 void initChunk(Chunk *chunk);
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
@@ -56,4 +93,12 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line);
 void freeChunk(Chunk *chunk);
 
 int addConstant(Chunk *, Value value);
+// size of the instruction at offset, operands included
+int instructionLength(Chunk *chunk, int offset);
+
+// the line of the byte at offset, decoding the table from the start
+int getLine(Chunk *chunk, int offset);
+void initLineReader(LineReader *reader, Chunk *chunk);
+// same, carrying on from where the reader is, offsets can't go backwards
+int readLine(LineReader *reader, int offset);
 #endif
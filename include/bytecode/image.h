@@ -0,0 +1,166 @@
+#ifndef bryte_image_h
+#define bryte_image_h
+#include "../common.h"
+#include "object.h"
+#include <stddef.h>
+
+// a compiled script saved to disk (script.saas -> script.saasc) so the next
+// run can skip the scanner and compiler. `saas --compile-only` writes one,
+// running the script picks it up whenever it was compiled from the exact same
+// source. The file gets mapped and each function's code and line table are
+// used right where they are, only the constants (strings, nested functions)
+// get rebuilt as objects
+//
+// layout, everything 4 byte aligned and in the machine's own byte order:
+//   ImageHeader
+//   strings:   uint32 length, chars, '\0', padding
+//   functions: ImageFunction, code[codeCount], padding, lines[lineCount]
+//              (the chunk's run-length line table), padding,
+//              ImageConstant[constantCount]
+// function 0 is the script, the rest come in the order they're reached
+
+#define IMAGE_MAGIC "SaaC"
+#define IMAGE_VERSION 2
+// bytecode from a -DREGISTER_VM build has instructions the other one doesn't
+#define IMAGE_REGISTER_VM 1
+
+// what images and snapshots both start with
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t flags;
+  uint32_t byteOrder; // 0x01020304 as the writer saw it
+  uint32_t size;      // of the whole file
+  uint32_t checksum;  // hashString() of everything after the header
+} ImageStamp;
+
+typedef struct {
+  ImageStamp stamp;
+  uint32_t sourceLength;
+  uint32_t sourceHash; // hashString() of the source it was compiled from
+  uint32_t stringCount;
+  uint32_t functionCount;
+} ImageHeader;
+
+typedef struct {
+  int32_t arity;
+  int32_t upvalueCount;
+  int32_t name; // string index, -1 for the script
+  int32_t codeCount;
+  int32_t lineCount;
+  int32_t constantCount;
+} ImageFunction;
+
+// the compiler only makes number, string and function constants, the rest
+// only turn up in snapshots
+typedef enum {
+  IMAGE_NUMBER,
+  IMAGE_STRING,
+  IMAGE_FUNCTION,
+  IMAGE_NULL,
+  IMAGE_BOOL, // index is 0 or 1
+  IMAGE_NATIVE,
+  IMAGE_CLOSURE,
+  IMAGE_ARRAY,
+} ImageConstantType;
+
+// any value, not just constants
+typedef struct {
+  uint32_t type;
+  uint32_t index;  // into the strings, functions... of its type
+  uint32_t number[2]; // the double's bits, split so it stays 4 byte aligned
+} ImageConstant;
+
+// a heap snapshot (`saas --snapshot file prelude.saas`): the globals a
+// prelude left behind and everything they reach, so another run can start
+// from there (`saas --from-snapshot file script.saas`) instead of running
+// the prelude again. Same idea as an image, functions are laid out the same
+// way and their code stays in the mapping. Strings come back interned if
+// they were. Natives get saved by name and bound to the ones the loading VM
+// defines. The prelude has to be done with everything: upvalues still open or natives
+// holding state (a method bound to its array, an open file) can't be saved
+//
+// layout, same rules as an image:
+//   SnapshotHeader
+//   strings:   as in an image but with a uint32 interned after the length
+//   functions: as in an image
+//   natives:   uint32 name
+//   closures:  uint32 function, uint32 upvalueCount, uint32 upvalue[]
+//   upvalues:  ImageConstant closed
+//   arrays:    uint32 count, ImageConstant elements[count]
+//   globals:   uint32 name, ImageConstant value
+
+#define SNAPSHOT_MAGIC "SaaS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  ImageStamp stamp;
+  uint32_t stringCount;
+  uint32_t functionCount;
+  uint32_t nativeCount;
+  uint32_t closureCount;
+  uint32_t upvalueCount;
+  uint32_t arrayCount;
+  uint32_t globalCount;
+} SnapshotHeader;
+
+// a loaded image, it has to stay mapped for as long as its functions exist.
+// Programs (below) are images too, just not in a file
+typedef struct {
+  char *bytes;
+  size_t size;
+  // a package's holds on the state of natives it shares (see packValues())
+  ObjNative *shared;
+  int sharedCount;
+} Image;
+
+// where the image for the script at path goes, malloc'd
+char *imagePath(const char *path);
+// the compiled script and everything it reaches, false if it couldn't be
+// written. Goes through a temporary file and a rename so a script that's
+// starting up never sees half an image
+bool writeImage(ObjFunction *script, const char *source, size_t sourceLength,
+                const char *path);
+// the script from the image at path, or NULL when there's none or it's stale
+// (different source, different version or build) or damaged
+ObjFunction *loadImage(Image *image, const char *path, const char *source,
+                       size_t sourceLength);
+// vm->globals and everything they reach, false if something in there can't
+// be saved or the file couldn't be written
+bool writeSnapshot(const char *path);
+// puts the snapshot's globals into vm->globals, false (and nothing changed)
+// if it's missing, from another version or build, or damaged. The functions'
+// code lives in the mapping, so it stays open like a loaded image
+bool loadSnapshot(Image *image, const char *path);
+// after freeVM(), the functions' code lives in the mapping
+void closeImage(Image *image);
+
+// compile once, run in many VMs: an image kept in memory (malloc'd, the
+// source hash left at 0) that nothing writes to once it's built. Each VM
+// that instantiates it gets its own functions, constants and strings
+// (interned in its own table) around the one copy of the code and line
+// tables, so VMs on any number of threads can run it at once. It has to
+// outlive every VM that did
+bool buildProgram(ObjFunction *script, Image *program);
+// the program's script function in the current VM, verified like a loaded
+// image's
+ObjFunction *instantiateProgram(const Image *program);
+// a program, or a package
+void freeProgram(Image *program);
+
+// values handed from one VM to another (parallelMap(), spawn()), as a snapshot kept
+// in memory: everything they reach, plus the globals the functions in there
+// use and everything those reach. Open upvalues go in as they are right now,
+// --lazy bodies get compiled first. Natives whose state can be shared
+// (channels) aren't copied, the package holds on to the same state and so
+// does every VM that unpacks it. dataOnly leaves out anything but numbers,
+// booleans, null, strings, arrays and those, so nothing loaded from it
+// points into it. False if something can't be copied (a native holding
+// state, a function that doesn't compile). Built in the VM that owns the
+// values, freed with freeProgram()
+bool packValues(Value *values, int count, bool dataOnly, Image *package);
+// count copies in the current VM, with the globals set. The functions' code
+// stays in the package, so it has to outlive the VM
+bool unpackValues(const Image *package, Value *values, int count);
+
+#endif
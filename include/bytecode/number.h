@@ -0,0 +1,18 @@
+#ifndef bryte_number_h
+#define bryte_number_h
+#include "../common.h"
+
+// enough for any double formatNumber() writes, sign and exponent included
+#define NUMBER_BUFFER_SIZE 32
+
+// writes the shortest digits that read back as exactly `value` (Ryu),
+// whole numbers go straight through an integer path. Plain decimals from
+// 1e-6 up to 1e21, `1.5e+21` style outside that. Returns the length, no '\0'
+int formatNumber(double value, char *buffer);
+
+// reads a whole decimal number out of chars[0..length), sign, fraction and
+// exponent optional, no '\0' needed. Same double strtod() would give, false
+// if it isn't a number
+bool parseNumber(const char *chars, int length, double *value);
+
+#endif
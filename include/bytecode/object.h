@@ -28,14 +28,35 @@ struct StringObj {
   type)*/
   int length;
   char *chars;
-  uint32_t hash;
+  uint32_t hash; // only set once it's interned
+  // in vm->strings, so the same text is the same StringObj. Identifiers and
+  // literals are, strings made while the script runs aren't until something
+  // calls internString() on them
+  bool interned;
+  // a long `a + b` nobody has looked at yet is a rope: chars is NULL until
+  // flattenString() copies left and right into it
+  StringObj *left;
+  StringObj *right;
+  // a slice (substring, split...): chars point into parent's and aren't NUL
+  // terminated, so go by length
+  StringObj *parent;
 };
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // stack slots a call to it can use, 0 until it's been verified (see
+  // bytecode/verify.h)
+  int maxStack;
   Chunk chunk;
   StringObj *name;
+  int callCount;  // bumped on every call while --jit is on
+  void *jitCode;  // machine code from jit.c, NULL until the function is hot
+  size_t jitSize;
+  void *aotCode; // AotFunction when running as a --emit-c program
+  // with --lazy, where the body is in the source until its first call
+  // compiles it (see compiler/compiler.h), NULL once it has a chunk
+  struct LazyBody *lazy;
 } ObjFunction;
 
 typedef struct ObjUpvalue {
@@ -58,7 +79,14 @@ typedef Value (*NativeFunction)(int argCount, Value *args);
 typedef struct {
   Obj obj;
   NativeFunction function;
-
+  // what a native made at runtime keeps between calls (readLines()'s open
+  // file), freeState gets called on it when the object goes
+  void *state;
+  void (*freeState)(void *state);
+  // set when other VMs can hold the same state (a channel): another hold on
+  // it for a copy of this native in another VM, freeState lets go of one
+  void *(*shareState)(void *state);
+  StringObj *name; // the global defineNative() made it for, NULL otherwise
 } ObjNative;
 
 typedef struct {
@@ -100,8 +128,21 @@ static inline bool isObjType(Value value, ObjType type) {
 #define PAYLOAD_CLOSURE(value) ((ObjClosure *)PAYLOAD_OBJ(value))
 #define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
 #define PAYLOAD_ARRAY(value) ((ObjArray *)PAYLOAD_OBJ(value))
+// interned copy of chars, for the compiler and natives' names
 StringObj *copyString(const char *chars, int length);
 
+// a transient string that takes ownership of chars (malloc'd, NUL terminated)
 StringObj *makeObjWithString(char *chars, int length);
+// the interned StringObj with the same text, for using a runtime string as a
+// table key (the tables go by hash and keys need to be hashed)
+StringObj *internString(StringObj *string);
+// left + right, a rope when it's long enough for copying to matter
+StringObj *concatStrings(StringObj *left, StringObj *right);
+// the string's chars, building them first if it's a rope
+char *flattenString(StringObj *string);
+// same text, interned or not
+bool stringsEqual(StringObj *a, StringObj *b);
+// length chars of string from start, sharing its memory
+StringObj *sliceString(StringObj *string, int start, int length);
 
 #endif
@@ -0,0 +1,17 @@
+#ifndef bryte_verify_h
+#define bryte_verify_h
+#include "../common.h"
+#include "object.h"
+
+// run() trusts its bytecode: constant indexes, local slots, upvalue indexes
+// and jump targets are used without a check. verifyFunction() proves that's
+// safe for one function's chunk (every operand in range, every jump landing
+// on an instruction, the same stack depth whichever way an instruction is
+// reached, nothing popped from under the frame) and sets function->maxStack,
+// which is what lets call() check for stack overflow once per call instead
+// of on every push. Returns NULL if the chunk is fine, otherwise what's wrong
+// with it. Functions in its constants are only looked at for their
+// upvalueCount, they get verified on their own
+const char *verifyFunction(ObjFunction *function);
+
+#endif
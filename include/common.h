@@ -5,6 +5,7 @@
 #include <stdint.h>
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// #define REGISTER_VM // three address instructions, see compiler/registers.h
 #define UINT8_COUNT                                                            \
   (UINT8_MAX + 1) // since the byte goes from 0 to uintmax so the total amount
 // is uint8max + 1
@@ -4,7 +4,25 @@
 #include "../bytecode/chunk.h"
 #include "../bytecode/object.h"
 #include "../common.h"
+#include "scanner.h"
 
 ObjFunction *compile(const char *source);
 
+// with --lazy, compile() only skims a function's body: it finds the closing
+// brace and captures anything the body names that the enclosing functions
+// have in scope (over-capturing is harmless, missing one isn't). The body
+// gets compiled when the function is first called. Points into the source,
+// which has to stay around until then. One malloc, free() it
+typedef struct LazyBody {
+  const char *start; // the '(' of the parameter list
+  const char *end;   // the end of the whole source
+  int line;
+  int capturedCount;
+  Token captured[]; // the name behind each of the function's upvalues
+} LazyBody;
+
+// compiles a skimmed function's body into its chunk. False (after reporting
+// the compile error) if the body doesn't compile
+bool compileLazy(ObjFunction *function);
+
 #endif
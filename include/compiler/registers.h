@@ -0,0 +1,12 @@
+#ifndef bryte_registers_h
+#define bryte_registers_h
+#include "../bytecode/chunk.h"
+#include "../common.h"
+
+// REGISTER_VM backend: rewrites the stack code the compiler produced into the
+// three address OP_*_R instructions where the operands are locals or
+// constants, so `i = i + 1;` is one OP_ADD_R instead of GET_LOCAL, CONSTANT,
+// ADD, SET_LOCAL, POP. Everything else stays stack code, jumps get fixed up
+void registerize(Chunk *chunk);
+
+#endif
@@ -2,6 +2,8 @@
 #define bryte_scanner_h
 
 void initScanner(const char*source);
+// picks up scanning at `at`, somewhere inside a source that ends at `end`
+void resumeScanner(const char *at, const char *end, int line);
 
 
 typedef enum {
@@ -0,0 +1,19 @@
+#ifndef bryte_tokens_h
+#define bryte_tokens_h
+#include "../common.h"
+#include "scanner.h"
+
+// where the compiler gets its tokens. Normally that's just scanToken(), with
+// --lex-thread the scanner runs ahead on its own thread and hands tokens over
+// through a single producer / single consumer ring, so scanning and parsing
+// overlap instead of taking turns
+void startTokens(const char *source, bool threaded);
+// scans inline from the middle of a source, for compiling a --lazy
+// function's body on its first call
+void resumeTokens(const char *at, const char *end, int line);
+Token nextToken();
+// stops the scanner thread if there is one, the compiler can bail out on an
+// error long before it's read up to the EOF
+void stopTokens();
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef bryte_hash_h
+#define bryte_hash_h
+#include "../common.h"
+
+// the string hash behind StringObj.hash and so every table lookup. Reads 8
+// bytes at a time instead of FNV's one, and strings past 128 bytes go
+// through 32 byte stripes (SSE2 when the compiler has it, the same math in
+// plain C otherwise, so the result never depends on the build)
+uint32_t hashString(const char *key, int length);
+
+#endif
@@ -16,6 +16,7 @@ typedef struct {
     int count;
     int capacity;
     Entry** entries;
+    int generation; // changes whenever Entry pointers into the table go stale
 }Table;
 
 void initTable(Table* table);
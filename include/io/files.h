@@ -0,0 +1,14 @@
+#ifndef bryte_files_h
+#define bryte_files_h
+#include "../common.h"
+#include <stddef.h>
+
+// maps the whole file read only, followed by at least one '\0' so the scanner
+// can read it in place like a string. NULL if it can't be opened
+char *mapFile(const char *path, size_t *size);
+void unmapFile(char *chars, size_t size);
+
+// readAll, readLines, writeFile and appendFile
+void defineFileNatives();
+
+#endif
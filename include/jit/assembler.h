@@ -0,0 +1,49 @@
+#ifndef bryte_assembler_h
+#define bryte_assembler_h
+#include "../common.h"
+
+// tiny x86-64 encoder shared by the baseline jit and the trace compiler.
+// Only the handful of instruction shapes we actually emit
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+} Assembler;
+
+// register numbers as they go in modrm/rex, xmm registers use 0-15 too
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13 };
+
+// condition codes for emitJump, the low nibble of jcc/setcc
+#define CC_ALWAYS -1
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_P 0xA
+#define CC_NP 0xB
+
+void initAssembler(Assembler *as);
+void freeAssembler(Assembler *as);
+void emitArray(Assembler *as, const uint8_t *bytes, int length);
+#define EMIT(as, ...)                                                          \
+  emitArray(as, (uint8_t[]){__VA_ARGS__}, sizeof((uint8_t[]){__VA_ARGS__}))
+void emit32(Assembler *as, uint32_t value);
+void emit64(Assembler *as, uint64_t value);
+
+// [prefix] [rex] [0f] opcode modrm, with rm = [base + disp32]
+void emitMemOp(Assembler *as, uint8_t prefix, bool wide, bool twoByte,
+               uint8_t opcode, int reg, int base, int32_t disp);
+// same with rm a register
+void emitRegOp(Assembler *as, uint8_t prefix, bool wide, bool twoByte,
+               uint8_t opcode, int reg, int rm);
+void emitMovImm64(Assembler *as, int reg, uint64_t value);
+// jmp/jcc rel32, returns the position to hand to patchJump
+int emitJump(Assembler *as, int cc);
+void patchJump(Assembler *as, int at, int target);
+
+// copies the code into executable memory, NULL if the os says no
+void *finalizeCode(Assembler *as);
+void freeCode(void *code, size_t size);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef bryte_jit_h
+#define bryte_jit_h
+#include "../bytecode/object.h"
+#include "../common.h"
+#include "../vm/vm.h"
+
+// baseline jit: once a function has been called JIT_THRESHOLD times its chunk
+// gets stitched into x86-64 machine code, one template per opcode. Values stay
+// on the vm stack and anything non trivial calls back into the C slow paths
+// in vm.c, so jitted and interpreted frames can call each other freely
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 2
+#endif
+
+bool jitAvailable();
+// counts a call and compiles the function once it crosses the threshold,
+// true means there is machine code to jitEnter()
+bool jitHot(ObjFunction *function);
+// runs the frame until it returns, false on runtime error
+bool jitEnter(CallFrame *frame);
+void jitFree(ObjFunction *function);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef bryte_trace_h
+#define bryte_trace_h
+#include "../common.h"
+#include "../vm/vm.h"
+
+// tracing jit for hot loops. Every back edge bumps a counter for its loop
+// header, at TRACE_THRESHOLD the interpreter records one trip around the loop
+// (the opcodes plus the types it saw) and that linear trace is compiled to
+// machine code working on unboxed doubles. Guards side exit back to the
+// interpreter with the stack rebuilt for the ip they exit at
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 40
+#endif
+#define TRACE_MAX_LENGTH 512
+
+// called on back edges with frame->ip at the loop header. Runs the loop's
+// trace or starts recording one, true when frame->ip moved past the loop or
+// recording started, so compiled callers have to continue in the interpreter
+bool traceLoop(CallFrame *frame);
+// run() calls this before every instruction while vm->tracing is set
+void traceRecord(CallFrame *frame);
+// drops the traces of a function that is being freed
+void freeFunctionTraces(ObjFunction *function);
+void freeTraces();
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef bryte_output_h
+#define bryte_output_h
+#include "common.h"
+#include <stdio.h>
+
+// where leverage() output goes: stdout, but through a 64K buffer the vm owns,
+// flushed per line when stdout is a terminal and only when it fills up (or
+// on flush(), an error or exit) when it's piped somewhere. Printing writes
+// straight into it instead of going through printf's formatting
+void initOutput();
+void flushOutput();
+
+static inline void writeOutput(const char *chars, int length) {
+  fwrite(chars, 1, length, stdout);
+}
+// locked like fwrite, vms on other threads print into the same buffer.
+// glibc skips the lock until a second thread exists
+static inline void writeOutputChar(char c) { putc(c, stdout); }
+
+#endif
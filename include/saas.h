@@ -0,0 +1,113 @@
+#ifndef bryte_saas_h
+#define bryte_saas_h
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the embedding API, the only header a program linking build/libsaas.a or
+// build/libsaas.so needs. Nothing in here changes shape when the interpreter
+// does: the VM and compiled scripts are opaque, values get converted on the
+// way in and out.
+//
+// A VM belongs to one thread at a time, any number of them can run side by
+// side on different threads. Every object a VM hands out (strings, whatever
+// a handle points at) lives until saasFreeVM()
+
+typedef struct VM SaasVM;
+typedef struct SaasProgram SaasProgram;
+
+typedef enum {
+  SAAS_OK,
+  SAAS_COMPILE_ERROR,
+  SAAS_RUNTIME_ERROR,
+} SaasResult;
+
+typedef enum {
+  SAAS_NULL,
+  SAAS_BOOL,
+  SAAS_NUMBER,
+  SAAS_STRING,
+  SAAS_OBJECT, // arrays, functions... only good for handing back to the VM
+} SaasType;
+
+typedef struct {
+  SaasType type;
+  union {
+    bool boolean;
+    double number;
+    void *object; // strings too, see saasChars()
+  } as;
+} SaasValue;
+
+// no compound literals, so C++ can use these too
+static inline SaasValue saasNull() {
+  SaasValue value;
+  value.type = SAAS_NULL;
+  value.as.number = 0;
+  return value;
+}
+static inline SaasValue saasBool(bool boolean) {
+  SaasValue value;
+  value.type = SAAS_BOOL;
+  value.as.boolean = boolean;
+  return value;
+}
+static inline SaasValue saasNumber(double number) {
+  SaasValue value;
+  value.type = SAAS_NUMBER;
+  value.as.number = number;
+  return value;
+}
+// a copy of chars as a string in vm
+SaasValue saasString(SaasVM *vm, const char *chars, int length);
+// a SAAS_STRING's text. Substrings share their parent's, so it isn't always
+// NUL terminated: go by saasLength()
+const char *saasChars(SaasValue string);
+int saasLength(SaasValue string);
+
+SaasVM *saasNewVM();
+void saasFreeVM(SaasVM *vm);
+
+// compiles without a VM: a program belongs to none of them and never
+// changes, so one compile can be run by any number of VMs, at the same time
+// on different threads. Each gets its own copy of the strings and constants
+// but they all share the bytecode. Compile errors go to stderr and give NULL
+SaasProgram *saasCompile(const char *source);
+// after every VM that ran it has been freed
+void saasFreeProgram(SaasProgram *program);
+// runs the program's top level in vm, defining its functions and globals.
+// Runtime errors go to stderr
+SaasResult saasRun(SaasVM *vm, const SaasProgram *program);
+
+// a global looked up once. It remembers the table slot it found and only
+// looks again after the globals table moved things around, so calling
+// through one costs no string hashing. Fill one in with saasHandle() and
+// leave the fields alone
+typedef struct {
+  void *name;
+  void *entry;
+  int generation;
+} SaasHandle;
+
+SaasHandle saasHandle(SaasVM *vm, const char *name);
+// the global's value, false if it isn't defined
+bool saasGet(SaasVM *vm, SaasHandle *global, SaasValue *value);
+// calls the function in the global with args, its return value goes in
+// *result. Safe from inside a native
+SaasResult saasCall(SaasVM *vm, SaasHandle *function, int argCount,
+                    const SaasValue *args, SaasValue *result);
+
+// a C function scripts can call like any other. It reports errors with
+// saasError() and returns whatever it likes, the script stops either way
+typedef SaasValue (*SaasNative)(SaasVM *vm, int argCount,
+                                const SaasValue *args);
+void saasDefine(SaasVM *vm, const char *name, SaasNative function);
+void saasError(SaasVM *vm, const char *message);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
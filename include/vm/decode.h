@@ -0,0 +1,29 @@
+#ifndef bryte_decode_h
+#define bryte_decode_h
+#include "../bytecode/chunk.h"
+#include "../bytecode/object.h"
+#include "../common.h"
+#include "../datastructures/hashmap.h"
+
+// what run() actually executes. The first time a chunk gets run it's decoded
+// into one Instruction per bytecode instruction, plus a table from every
+// bytecode offset to the instruction that starts there, so going back and
+// forth with frame->ip is a lookup either way. The jit, the trace recorder
+// and runtimeError() keep seeing plain bytecode
+typedef struct Instruction {
+  const void *handler; // label in run() when it's built with computed gotos
+  union {
+    struct Instruction *target; // jumps, where they land
+    Entry *entry; // OP_GET_GLOBAL, OP_SET_GLOBAL: the global's slot in vm->globals
+  } as;
+  uint32_t offset; // where it starts in the bytecode
+  int generation;  // vm->globals.generation `as.entry` is good for
+  uint8_t op;
+  uint8_t operands[4]; // the raw operand bytes, kinds/dst/a/b for OP_*_R
+} Instruction;
+
+// fills chunk->decoded and chunk->decodedIndex, `handlers` is indexed by opcode (NULL for the switch
+// version of run())
+void decodeChunk(Chunk *chunk, const void *const *handlers);
+
+#endif
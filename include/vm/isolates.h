@@ -0,0 +1,31 @@
+#ifndef bryte_isolates_h
+#define bryte_isolates_h
+#include "../common.h"
+
+// spawn(fn, args): fn called with the array args (optional) in an isolate,
+// a VM of its own on a thread of its own. fn and what it reaches get copied
+// over the same way parallelMap() copies them, so the isolate shares nothing
+// with the script that spawned it but channels. Gives back a channel that
+// gets fn's return value, then closes (closed with nothing in it if fn hit a
+// runtime error)
+//
+// channel(capacity): a queue isolates talk through, capacity 1 if it's left
+// out
+// - send(ch, value) waits while it's full. value gets copied, and has to be
+//   a number, boolean, null, string, array or channel. An array of only
+//   numbers, booleans and null gets handed over instead: the receiver gets
+//   its elements without a copy and the sender's array is left empty
+// - receive(ch) (or ch()) waits while it's empty, blockchain once it's been
+//   closed and emptied
+// - close(ch): no more sends, waiting receivers get blockchain
+// Waiting parks the thread on a condition variable, it doesn't spin
+//
+// A channel lives until every VM holding it is gone and no message has it
+// inside. So send() won't queue a channel on itself, whether it's the value,
+// inside it, or queued on a channel that's in it (and so on): the channel
+// would hold itself and never go. That's a runtime error. Isolates still
+// running when the main script ends just stop
+
+void defineIsolateNatives();
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef bryte_natives_h
+#define bryte_natives_h
+#include "../bytecode/object.h"
+#include "../common.h"
+
+// string natives: len, charAt, indexOf, split, substring, trim, startsWith
+// and replace. Anything that hands back part of a string hands back a slice
+// of it (sliceString()), nothing gets copied
+void defineStringNatives();
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef bryte_parallel_h
+#define bryte_parallel_h
+#include "../common.h"
+
+// parallelMap(array, fn): fn on every element, spread over a pool of
+// threads that each run their own VM, and the results back in order in a new
+// array. The index range gets split between the workers up front, a worker
+// takes small chunks off the front of its share and one that runs out steals
+// the back half of somebody else's. The threads stay around between calls,
+// the VMs get made fresh for every call.
+//
+// The workers share nothing with the script that called it:
+// - fn and whatever it reaches (what it captured, the globals it uses and
+//   their functions) get copied into every worker when the map starts.
+//   Captured variables are copied as they are at that point, anything a
+//   worker changes (captured arrays, globals) stays in the worker. Channels
+//   (vm/isolates.h) are the exception, every worker gets the same one
+// - elements are read in place when they're all numbers, booleans or null,
+//   otherwise the array gets copied too
+// - results have to be numbers, booleans, null, strings, arrays or
+//   channels, each worker's get copied back once it's done
+// A runtime error in any worker stops the others and the script
+#ifndef PARALLEL_WORKERS
+#define PARALLEL_WORKERS 0 // one per core
+#endif
+
+void defineParallelNatives();
+
+#endif
@@ -12,8 +12,13 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
-typedef struct {
+typedef struct VM {
   bool repl;
+  bool jit;       // --jit, compile hot functions to machine code
+  bool lexThread; // --lex-thread, scan on a second thread while compiling
+  bool lazy;      // --lazy, compile function bodies on their first call
+  bool worker;    // runs a parallelMap() share, nested ones stay on one thread
+  bool tracing;   // the trace jit is recording what run() executes
   CallFrame frames[FRAMES_MAX];
   int frameCount;
   Value stack[STACK_MAX];
@@ -22,9 +27,16 @@ typedef struct {
   Table strings; // for string objects to be interned
   Table globals; // for global variables
   ObjUpvalue *openUpvalues;
+  struct Tracer *tracer; // jit/trace.c's, made when the first loop gets hot
 } VM;
 
-extern VM vm;
+// everything a running script touches hangs off its VM, so one process can
+// have as many as it likes, each on whichever thread runs it (one thread per
+// VM at a time). The code in here reaches the VM it's running through `vm`,
+// which is per thread and set by newVM(), useVM() and the interpret
+// functions. Natives and jitted code get to it the same way, so neither
+// needs a VM parameter
+extern _Thread_local VM *vm;
 
 void push(Value value);
 Value pop();
@@ -36,8 +48,37 @@ typedef enum {
 
 } InterpretResult;
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char *source);
+// a fresh VM with the natives defined, and this thread's from now on
+VM *newVM();
+// frees the VM and everything it made
+void freeVM(VM *machine);
+// makes machine this thread's VM, for switching between them
+void useVM(VM *machine);
+InterpretResult interpret(VM *machine, const char *source);
+InterpretResult interpretFunction(VM *machine, ObjFunction *function);
+
+// slow paths shared by run() and the jit, the bool ones return false after
+// reporting a runtime error
+void runtimeError(const char *format, ...);
+bool callOperand(int argCount);
+bool runFrame();
+// callOperand() run to completion, for C code calling into the script: the
+// callee and its arguments get replaced by the result
+bool callNow(int argCount);
+bool resumeFrame();
+void returnFrame();
+void makeClosure(CallFrame *frame, ObjFunction *function, uint8_t *operands);
+void closeTopUpvalue();
+bool getGlobal(StringObj *name);
+bool setGlobal(StringObj *name);
+void makeArray(int elementCount);
+bool getIndex();
+bool setIndex();
+bool getProperty(StringObj *name);
+void concatenate();
+bool binaryOp(uint8_t op, Value a, Value b, Value *result);
+// makes a native callable as a global, for newVM(), vm/natives.c and
+// saasDefine()
+ObjNative *defineNative(const char *name, NativeFunction function);
 
 #endif
@@ -0,0 +1,21 @@
+#include "../../include/aot/aot.h"
+
+void aotLoadChunk(ObjFunction *function, const uint8_t *code, int count,
+                  const uint8_t *lines, int lineCount) {
+  // nothing writes to a chunk once it's compiled, so they get used as is
+  Chunk *chunk = &function->chunk;
+  chunk->code = (uint8_t *)code;
+  chunk->count = count;
+  chunk->capacity = count;
+  chunk->lines = (uint8_t *)lines;
+  chunk->lineCount = lineCount;
+  chunk->lineCapacity = lineCount;
+  chunk->mapped = true;
+}
+
+int aotRun(VM *machine, ObjFunction *script) {
+  InterpretResult result = interpretFunction(machine, script);
+  freeVM(machine);
+  // same exit codes as runFile() in main.c
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
@@ -0,0 +1,537 @@
+#include "../../include/aot/emitc.h"
+#include "../../include/bytecode/chunk.h"
+#include "../../include/bytecode/object.h"
+#include "../../include/compiler/compiler.h"
+#include "../../include/memory.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+The generated file looks like
+
+  static bool fn1(CallFrame *frame) {   <- one per ObjFunction, fn0 = script
+    ...                                 <- one statement per instruction,
+  L12:                                     jump targets become labels
+    ...
+  }
+  static const uint8_t code1[] = ...;   <- the bytecode and line tables, the
+  static const int lines1[] = ...;         vm.c helpers still want frame->ip
+  static ObjFunction *loadProgram()     <- rebuilds the functions + constants
+  int main()
+
+Values still live on the vm stack (slots need real addresses for upvalues
+and the array method calls shuffle the stack at runtime, so stack depths
+aren't known statically), but the stack top and the frame's slots are C
+locals and numbers are done inline.
+*/
+
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+  // globals that are only ever bound once, to a closure of functions[target]
+  StringObj **names;
+  int *targets;
+  int nameCount;
+} Program;
+
+static void addFunction(Program *program, ObjFunction *function) {
+  if (program->capacity < program->count + 1) {
+    int oldCapacity = program->capacity;
+    program->capacity = GROW_CAPACITY(oldCapacity);
+    program->functions =
+        grow_array(sizeof(ObjFunction *), program->functions, oldCapacity,
+                   program->capacity);
+  }
+  program->functions[program->count++] = function;
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i]))
+      addFunction(program, PAYLOAD_FUNCTION(constants->values[i]));
+  }
+}
+
+static int functionIndex(Program *program, ObjFunction *function) {
+  for (int i = 0; i < program->count; i++) {
+    if (program->functions[i] == function)
+      return i;
+  }
+  return -1;
+}
+
+static StringObj *operandString(Chunk *chunk, int offset) {
+  return PAYLOAD_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+}
+
+// `mvp f() {...}` at the top level is OP_CLOSURE f, OP_DEFINE_GLOBAL "f". If
+// nothing else ever writes "f", calls through it always hit that function
+static void findDirectTargets(Program *program) {
+  int capacity = 0;
+  int *defines = NULL;
+  Chunk *script = &program->functions[0]->chunk;
+  for (int offset = 0; offset < script->count;
+       offset += instructionLength(script, offset)) {
+    if (script->code[offset] != OP_CLOSURE)
+      continue;
+    int next = offset + instructionLength(script, offset);
+    if (next >= script->count || script->code[next] != OP_DEFINE_GLOBAL)
+      continue;
+    if (capacity < program->nameCount + 1) {
+      int oldCapacity = capacity;
+      capacity = GROW_CAPACITY(oldCapacity);
+      program->names = grow_array(sizeof(StringObj *), program->names,
+                                  oldCapacity, capacity);
+      program->targets =
+          grow_array(sizeof(int), program->targets, oldCapacity, capacity);
+      defines = grow_array(sizeof(int), defines, oldCapacity, capacity);
+    }
+    Value function = script->constants.values[script->code[offset + 1]];
+    program->names[program->nameCount] = operandString(script, next);
+    program->targets[program->nameCount] =
+        functionIndex(program, PAYLOAD_FUNCTION(function));
+    defines[program->nameCount] = next;
+    program->nameCount++;
+  }
+  for (int i = 0; i < program->count; i++) {
+    Chunk *chunk = &program->functions[i]->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+      uint8_t op = chunk->code[offset];
+      if (op != OP_SET_GLOBAL && op != OP_DEFINE_GLOBAL)
+        continue;
+      StringObj *name = operandString(chunk, offset);
+      for (int n = 0; n < program->nameCount; n++) {
+        if (program->names[n] == name &&
+            (i != 0 || defines[n] != offset)) {
+          program->targets[n] = -1;
+        }
+      }
+    }
+  }
+  free(defines);
+}
+
+static int directTarget(Program *program, StringObj *name) {
+  for (int n = 0; n < program->nameCount; n++) {
+    if (program->names[n] == name)
+      return program->targets[n];
+  }
+  return -1;
+}
+
+// how many values an instruction leaves on the stack minus how many it takes,
+// only used to guess who the callee of an OP_CALL is
+static int stackEffect(Chunk *chunk, int offset) {
+  uint8_t *code = chunk->code + offset;
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_NULL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_UPVALUE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_CLOSURE:
+    return 1;
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBSTRACT:
+  case OP_MULITPLY:
+  case OP_DIVIDE:
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_GET_INDEX:
+    return -1;
+  case OP_SET_INDEX:
+    return -2;
+  case OP_CALL:
+    return -code[1];
+  case OP_ARRAY:
+    return 1 - code[1];
+  case OP_ADD_R:
+  case OP_SUBSTRACT_R:
+  case OP_MULITPLY_R:
+  case OP_DIVIDE_R:
+  case OP_EQUAL_R:
+  case OP_GREATER_R:
+  case OP_LESS_R:
+    return code[1] & REG_PUSH ? 1 : 0;
+  default:
+    return 0;
+  }
+}
+
+static void emitString(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 32 || c >= 127) {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void emitNumber(FILE *out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "NAN");
+  } else if (isinf(number)) {
+    fprintf(out, number > 0 ? "HUGE_VAL" : "-HUGE_VAL");
+  } else {
+    fprintf(out, "%.17g", number);
+  }
+}
+
+static bool emitFunction(Program *program, int index, FILE *out) {
+  ObjFunction *function = program->functions[index];
+  Chunk *chunk = &function->chunk;
+  bool *targets = calloc(chunk->count + 1, sizeof(bool));
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+      targets[offset + 3 + ((code[1] << 8) | code[2])] = true;
+    } else if (code[0] == OP_LOOP) {
+      targets[offset + 3 - ((code[1] << 8) | code[2])] = true;
+    }
+  }
+
+  // body first, the prologue only declares what the body ends up using
+  char *body = NULL;
+  size_t bodySize = 0;
+  FILE *b = open_memstream(&body, &bodySize);
+  bool usesSlots = false, usesConstants = false, usesFrameCount = false;
+  // which global each stack entry was loaded from, for direct calls
+  int *callees = malloc(sizeof(int) * (chunk->count + 1));
+  int depth = 0;
+  bool ok = true;
+  for (int offset = 0; ok && offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    int next = offset + instructionLength(chunk, offset);
+    uint8_t operand = next - offset > 1 ? code[1] : 0;
+    uint16_t jump = next - offset == 3 ? (code[1] << 8) | code[2] : 0;
+    if (targets[offset])
+      fprintf(b, "L%d:\n", offset);
+    switch (code[0]) {
+    case OP_CONSTANT: {
+      Value constant = chunk->constants.values[operand];
+      if (IS_NUMBER(constant)) {
+        fprintf(b, "  *sp++ = NUMBER_VAL(");
+        emitNumber(b, PAYLOAD_NUMBER(constant));
+        fprintf(b, ");\n");
+      } else {
+        fprintf(b, "  *sp++ = constants[%d];\n", operand);
+        usesConstants = true;
+      }
+      break;
+    }
+    case OP_NULL:
+      fprintf(b, "  *sp++ = NULL_VAL;\n");
+      break;
+    case OP_TRUE:
+    case OP_FALSE:
+      fprintf(b, "  *sp++ = BOOL_VAL(%s);\n",
+              code[0] == OP_TRUE ? "true" : "false");
+      break;
+    case OP_POP:
+      fprintf(b, "  sp--;\n");
+      break;
+    case OP_GET_LOCAL:
+      fprintf(b, "  *sp++ = slots[%d];\n", operand);
+      usesSlots = true;
+      break;
+    case OP_SET_LOCAL:
+      fprintf(b, "  slots[%d] = sp[-1];\n", operand);
+      usesSlots = true;
+      break;
+    case OP_GET_UPVALUE:
+      fprintf(b, "  *sp++ = *frame->closure->upvalues[%d]->location;\n",
+              operand);
+      break;
+    case OP_SET_UPVALUE:
+      fprintf(b, "  *frame->closure->upvalues[%d]->location = sp[-1];\n",
+              operand);
+      break;
+    case OP_CLOSE_UPVALUE:
+      fprintf(b, "  AOT_SYNC(%d);\n  closeTopUpvalue();\n  AOT_RELOAD();\n",
+              next);
+      break;
+    case OP_DEFINE_GLOBAL:
+      fprintf(b,
+              "  set(&vm->globals, sp[-1], PAYLOAD_STRING(constants[%d]));\n"
+              "  sp--;\n",
+              operand);
+      usesConstants = true;
+      break;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      fprintf(b, "  AOT_TRY(%d, %s(PAYLOAD_STRING(constants[%d])));\n", next,
+              code[0] == OP_GET_GLOBAL ? "getGlobal" : "setGlobal", operand);
+      usesConstants = true;
+      break;
+    case OP_EQUAL:
+      fprintf(b, "  sp[-2] = BOOL_VAL(isEqual(sp[-2], sp[-1]));\n  sp--;\n");
+      break;
+    case OP_GREATER:
+      fprintf(b, "  AOT_BINARY(%d, BOOL_VAL, >);\n", next);
+      break;
+    case OP_LESS:
+      fprintf(b, "  AOT_BINARY(%d, BOOL_VAL, <);\n", next);
+      break;
+    case OP_ADD:
+      fprintf(b, "  AOT_ADD(%d);\n", next);
+      break;
+    case OP_SUBSTRACT:
+      fprintf(b, "  AOT_BINARY(%d, NUMBER_VAL, -);\n", next);
+      break;
+    case OP_MULITPLY:
+      fprintf(b, "  AOT_BINARY(%d, NUMBER_VAL, *);\n", next);
+      break;
+    case OP_DIVIDE:
+      fprintf(b, "  AOT_BINARY(%d, NUMBER_VAL, /);\n", next);
+      break;
+    case OP_NEGATE:
+      fprintf(b, "  AOT_NEGATE(%d);\n", next);
+      break;
+    case OP_NOT:
+      fprintf(b, "  sp[-1] = BOOL_VAL(MAKE_NOT(sp[-1]));\n");
+      break;
+    case OP_PRINT:
+      fprintf(b, "  printValue(*--sp);\n  writeOutputChar('\\n');\n");
+      break;
+    case OP_JUMP_IF_FALSE:
+      fprintf(b, "  if (MAKE_NOT(sp[-1]))\n    goto L%d;\n", next + jump);
+      break;
+    case OP_JUMP:
+      fprintf(b, "  goto L%d;\n", next + jump);
+      break;
+    case OP_LOOP:
+      fprintf(b, "  goto L%d;\n", next - jump);
+      break;
+    case OP_CALL: {
+      int target = depth - operand - 1 >= 0 && depth - operand - 1 <= offset
+                       ? callees[depth - operand - 1]
+                       : -1;
+      if (target >= 0) {
+        fprintf(b, "  AOT_CALL_DIRECT(%d, %d, functions[%d], fn%d);\n", next,
+                operand, target, target);
+      } else {
+        fprintf(b, "  AOT_CALL(%d, %d);\n", next, operand);
+      }
+      usesFrameCount = true;
+      break;
+    }
+    case OP_CLOSURE:
+      fprintf(b,
+              "  AOT_SYNC(%d);\n"
+              "  makeClosure(frame, PAYLOAD_FUNCTION(constants[%d]), "
+              "code + %d);\n"
+              "  AOT_RELOAD();\n",
+              next, operand, offset + 2);
+      usesConstants = true;
+      break;
+    case OP_RETURN:
+      fprintf(b, "  AOT_SYNC(%d);\n  returnFrame();\n  return true;\n", next);
+      break;
+    case OP_ARRAY:
+      fprintf(b, "  AOT_SYNC(%d);\n  makeArray(%d);\n  AOT_RELOAD();\n", next,
+              operand);
+      break;
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+      fprintf(b, "  AOT_TRY(%d, %s());\n", next,
+              code[0] == OP_GET_INDEX ? "getIndex" : "setIndex");
+      break;
+    case OP_GET_PROPERTY:
+      fprintf(b, "  AOT_TRY(%d, getProperty(PAYLOAD_STRING(constants[%d])));\n",
+              next, operand);
+      usesConstants = true;
+      break;
+    case OP_ADD_R:
+    case OP_SUBSTRACT_R:
+    case OP_MULITPLY_R:
+    case OP_DIVIDE_R:
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:
+    case OP_MOVE_R: {
+      uint8_t kinds = code[1];
+      char left[32], right[32];
+      snprintf(left, sizeof(left),
+               kinds & REG_A_CONSTANT ? "constants[%d]" : "slots[%d]", code[3]);
+      snprintf(right, sizeof(right),
+               kinds & REG_B_CONSTANT ? "constants[%d]" : "slots[%d]",
+               code[0] == OP_MOVE_R ? 0 : code[4]);
+      usesSlots = true;
+      usesConstants = true;
+      if (code[0] == OP_MOVE_R) {
+        fprintf(b, "  slots[%d] = %s;\n", code[2], left);
+        break;
+      }
+      fprintf(b, "  {\n    Value result;\n    AOT_SYNC(%d);\n", next);
+      fprintf(b, "    if (!binaryOp(%d, %s, %s, &result))\n", code[0], left,
+              right);
+      fprintf(b, "      return false;\n");
+      if (kinds & REG_PUSH) {
+        fprintf(b, "    *sp++ = result;\n  }\n");
+      } else {
+        fprintf(b, "    slots[%d] = result;\n  }\n", code[2]);
+      }
+      break;
+    }
+    default:
+      fprintf(stderr, "--emit-c: unknown opcode %d\n", code[0]);
+      ok = false;
+      break;
+    }
+
+    // track the callee guesses, anything confusing just means no guess
+    int effect = stackEffect(chunk, offset);
+    if (depth + effect < 0 || depth + effect > chunk->count) {
+      depth = 0;
+      continue;
+    }
+    int from = code[0] == OP_CALL ? depth - operand - 1 : depth;
+    depth += effect;
+    for (int i = from < 0 ? 0 : from; i < depth; i++) {
+      callees[i] = -1;
+    }
+    if (code[0] == OP_GET_GLOBAL)
+      callees[depth - 1] = directTarget(program, operandString(chunk, offset));
+  }
+  fclose(b);
+
+  if (ok) {
+    if (function->name != NULL) {
+      fprintf(out, "// mvp %s\n", function->name->chars);
+    } else {
+      fprintf(out, "// <script>\n");
+    }
+    fprintf(out, "static bool fn%d(CallFrame *frame) {\n", index);
+    fprintf(out, "  uint8_t *code = frame->closure->function->chunk.code;\n");
+    if (usesConstants)
+      fprintf(out, "  Value *constants = "
+                   "frame->closure->function->chunk.constants.values;\n");
+    if (usesSlots)
+      fprintf(out, "  Value *slots = frame->slots;\n");
+    if (usesFrameCount)
+      fprintf(out, "  int frameCount = vm->frameCount;\n");
+    fprintf(out, "  Value *sp = vm->stackTop;\n");
+    fwrite(body, 1, bodySize, out);
+    // the compiler always ends a function with OP_RETURN, this is only
+    // needed when something jumps past it
+    if (targets[chunk->count])
+      fprintf(out, "L%d:\n  AOT_SYNC(%d);\n  returnFrame();\n  return true;\n",
+              chunk->count, chunk->count);
+    fprintf(out, "}\n\n");
+  }
+  free(body);
+  free(callees);
+  free(targets);
+  return ok;
+}
+
+static void emitTables(Program *program, int index, FILE *out) {
+  Chunk *chunk = &program->functions[index]->chunk;
+  fprintf(out, "static const uint8_t code%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++) {
+    fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+  }
+  fprintf(out, "\n};\nstatic const uint8_t lines%d[] = {", index);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->lines[i]);
+  }
+  fprintf(out, "\n};\n");
+}
+
+static void emitLoader(Program *program, FILE *out) {
+  fprintf(out, "static ObjFunction *loadProgram() {\n");
+  fprintf(out, "  for (int i = 0; i < %d; i++) {\n", program->count);
+  fprintf(out, "    functions[i] = newFunction();\n  }\n");
+  for (int i = 0; i < program->count; i++) {
+    ObjFunction *function = program->functions[i];
+    Chunk *chunk = &function->chunk;
+    fprintf(out, "\n  functions[%d]->arity = %d;\n", i, function->arity);
+    fprintf(out, "  functions[%d]->upvalueCount = %d;\n", i,
+            function->upvalueCount);
+    fprintf(out, "  functions[%d]->maxStack = %d;\n", i, function->maxStack);
+    if (function->name != NULL) {
+      fprintf(out, "  functions[%d]->name = copyString(", i);
+      emitString(out, function->name->chars, function->name->length);
+      fprintf(out, ", %d);\n", function->name->length);
+    }
+    fprintf(out, "  aotLoadChunk(functions[%d], code%d, %d, lines%d, %d);\n", i,
+            i, chunk->count, i, chunk->lineCount);
+    for (int c = 0; c < chunk->constants.count; c++) {
+      Value constant = chunk->constants.values[c];
+      fprintf(out, "  addConstant(&functions[%d]->chunk, ", i);
+      if (IS_NUMBER(constant)) {
+        fprintf(out, "NUMBER_VAL(");
+        emitNumber(out, PAYLOAD_NUMBER(constant));
+        fprintf(out, ")");
+      } else if (IS_STRING(constant)) {
+        StringObj *string = PAYLOAD_STRING(constant);
+        fprintf(out, "OBJ_VAL(copyString(");
+        emitString(out, string->chars, string->length);
+        fprintf(out, ", %d))", string->length);
+      } else if (IS_FUNCTION(constant)) {
+        fprintf(out, "OBJ_VAL(functions[%d])",
+                functionIndex(program, PAYLOAD_FUNCTION(constant)));
+      } else if (IS_BOOL(constant)) {
+        fprintf(out, "BOOL_VAL(%s)",
+                PAYLOAD_BOOL(constant) ? "true" : "false");
+      } else {
+        fprintf(out, "NULL_VAL");
+      }
+      fprintf(out, ");\n");
+    }
+    fprintf(out, "  functions[%d]->aotCode = fn%d;\n", i, i);
+  }
+  fprintf(out, "  return functions[0];\n}\n\n");
+}
+
+bool emitC(const char *source, const char *path, FILE *out) {
+  ObjFunction *script = compile(source);
+  if (script == NULL)
+    return false;
+  Program program = {NULL, 0, 0, NULL, NULL, 0};
+  addFunction(&program, script);
+  findDirectTargets(&program);
+
+  fprintf(out, "// generated by saas --emit-c from %s\n", path);
+  fprintf(out, "#include \"aot/aot.h\"\n#include <math.h>\n\n");
+  fprintf(out, "static ObjFunction *functions[%d];\n", program.count);
+  for (int i = 0; i < program.count; i++) {
+    fprintf(out, "static bool fn%d(CallFrame *frame);\n", i);
+  }
+  fprintf(out, "\n");
+  bool ok = true;
+  for (int i = 0; ok && i < program.count; i++) {
+    ok = emitFunction(&program, i, out);
+  }
+  if (ok) {
+    for (int i = 0; i < program.count; i++) {
+      emitTables(&program, i, out);
+    }
+    fprintf(out, "\n");
+    emitLoader(&program, out);
+    fprintf(out, "int main() {\n  VM *machine = newVM();\n"
+                 "  return aotRun(machine, loadProgram());\n}\n");
+  }
+  free(program.functions);
+  free(program.names);
+  free(program.targets);
+  return ok;
+}
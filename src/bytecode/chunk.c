@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include "../../include/bytecode/chunk.h"
+#include "../../include/bytecode/object.h"
 #include "../../include/memory.h"
 
 
@@ -11,8 +12,15 @@ void initChunk(Chunk* chunk){
     chunk->count = 0;
     chunk -> capacity = 0;
     chunk -> lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->lastLine = 0;
+    chunk->lastRun = -1;
     initValueArray(&chunk->constants);
     chunk ->code = NULL;
+    chunk->decoded = NULL;
+    chunk->decodedIndex = NULL;
+    chunk->mapped = false;
 }
 
 void * grow_array(size_t size_of_type, void * pointer, int oldCount, int newCount){
@@ -29,9 +37,13 @@ void * grow_array(size_t size_of_type, void * pointer, int oldCount, int newCoun
 
 }
 void freeChunk(Chunk*chunk){
-    free(chunk->code);
+    if (!chunk->mapped){
+        free(chunk->code);
+        free(chunk->lines);
+    }
     free(chunk->constants.values);
-    free(chunk->lines);
+    free(chunk->decoded);
+    free(chunk->decodedIndex);
     initChunk(chunk);
     
 }
@@ -41,18 +53,112 @@ int addConstant(Chunk* chunk, Value value){
     return chunk->constants.count -1; // the index in the constant array
 }
 
-void writeChunk(Chunk* chunk, u_int8_t byte, int line){
+// one more byte of code on `line`, which is nearly always the run that's
+// already open
+static void writeLine(Chunk* chunk, int line){
+    if (chunk->lastRun >= 0 && line == chunk->lastLine &&
+        chunk->lines[chunk->lastRun] < UINT8_MAX){
+        chunk->lines[chunk->lastRun]++;
+        return;
+    }
+    // a count byte and up to 5 for the varint
+    if (chunk->lineCapacity < chunk->lineCount + 6){
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = grow_array(sizeof(uint8_t), chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    int32_t moved = line - chunk->lastLine;
+    uint32_t delta = ((uint32_t)moved << 1) ^ (uint32_t)(moved >> 31); // zigzag
+    chunk->lastRun = chunk->lineCount;
+    chunk->lines[chunk->lineCount++] = 1;
+    while (delta >= 0x80){
+        chunk->lines[chunk->lineCount++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    chunk->lines[chunk->lineCount++] = delta;
+    chunk->lastLine = line;
+}
+
+void writeChunk(Chunk* chunk, uint8_t byte, int line){
     // grow everything
     
     if (chunk->capacity < chunk->count +1){
         int oldCapacity = chunk->capacity;
         chunk -> capacity = GROW_CAPACITY(oldCapacity);
-        chunk-> code = grow_array(sizeof(u_int8_t), chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = grow_array(sizeof(int), chunk->lines, oldCapacity, chunk->capacity);
+        chunk-> code = grow_array(sizeof(uint8_t), chunk->code, oldCapacity, chunk->capacity);
         // chunk->code is a pointer to an array of int
     }
-    chunk->lines[chunk->count] = line;
+    writeLine(chunk, line);
     chunk->code[chunk->count] = byte;
     chunk->count ++;
 
 }
+
+void initLineReader(LineReader* reader, Chunk* chunk){
+    reader->chunk = chunk;
+    reader->at = 0;
+    reader->covered = 0;
+    reader->line = 0;
+}
+
+int readLine(LineReader* reader, int offset){
+    Chunk* chunk = reader->chunk;
+    // the table can come from a file, so nothing gets read past its end
+    while (offset >= reader->covered && reader->at < chunk->lineCount){
+        reader->covered += chunk->lines[reader->at++];
+        uint32_t delta = 0;
+        int shift = 0;
+        uint8_t byte = 0x80;
+        while ((byte & 0x80) && reader->at < chunk->lineCount && shift < 32){
+            byte = chunk->lines[reader->at++];
+            delta |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+        }
+        reader->line += (int32_t)(delta >> 1) ^ -(int32_t)(delta & 1);
+    }
+    return reader->line;
+}
+
+int getLine(Chunk* chunk, int offset){
+    LineReader reader;
+    initLineReader(&reader, chunk);
+    return readLine(&reader, offset);
+}
+
+int instructionLength(Chunk* chunk, int offset){
+    switch (chunk->code[offset]){
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_ARRAY:
+    case OP_GET_PROPERTY:
+        return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        return 3;
+    case OP_MOVE_R:
+        return 4;
+    case OP_ADD_R:
+    case OP_SUBSTRACT_R:
+    case OP_MULITPLY_R:
+    case OP_DIVIDE_R:
+    case OP_EQUAL_R:
+    case OP_GREATER_R:
+    case OP_LESS_R:
+        return 5;
+    case OP_CLOSURE: {
+        // the (isLocal, index) pair of every upvalue follows
+        Value constant = chunk->constants.values[chunk->code[offset + 1]];
+        return 2 + PAYLOAD_FUNCTION(constant)->upvalueCount * 2;
+    }
+    default:
+        return 1;
+    }
+}
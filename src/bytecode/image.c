@@ -0,0 +1,1120 @@
+#include "../../include/bytecode/image.h"
+#include "../../include/bytecode/verify.h"
+#include "../../include/compiler/compiler.h"
+#include "../../include/datastructures/hash.h"
+#include "../../include/io/files.h"
+#include "../../include/memory.h"
+#include "../../include/vm/vm.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BYTE_ORDER_MARK 0x01020304u
+#define KINDS (OBJ_ARRAY + 1)
+
+// the bytes being written, grows like the other dynamic arrays
+typedef struct {
+  char *bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+static void reserve(Buffer *buffer, size_t size) {
+  if (buffer->count + size > buffer->capacity) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+    while (capacity < buffer->count + size) {
+      capacity *= 2;
+    }
+    buffer->bytes = realloc(buffer->bytes, capacity);
+    buffer->capacity = capacity;
+  }
+}
+
+static void append(Buffer *buffer, const void *bytes, size_t size) {
+  reserve(buffer, size);
+  memcpy(buffer->bytes + buffer->count, bytes, size);
+  buffer->count += size;
+}
+
+static void appendIndex(Buffer *buffer, uint32_t index) {
+  append(buffer, &index, sizeof(index));
+}
+
+static void pad(Buffer *buffer) {
+  static const char zeros[4] = {0};
+  append(buffer, zeros, (4 - buffer->count % 4) % 4);
+}
+
+// everything reachable from where collecting started, numbered in the order
+// it's found within its own kind: objects[OBJ_STRING] are the strings and so
+// on. `seen` maps an object to that number (open addressing on the pointer,
+// a snapshot can have a lot of objects) and `queue` is what still has to be
+// looked inside
+typedef struct {
+  Obj *object;
+  int index;
+} Numbered;
+
+typedef struct {
+  Obj **objects[KINDS];
+  int counts[KINDS];
+  int capacities[KINDS];
+  Numbered *seen;
+  int seenCount;
+  int seenCapacity;
+  Obj **queue;
+  int queued;
+  int queueCapacity;
+  int scanned;
+} Collected;
+
+static Numbered *findSeen(Collected *collected, Obj *object) {
+  size_t mask = collected->seenCapacity - 1;
+  size_t at = (((uintptr_t)object >> 4) * 0x9e3779b97f4a7c15ull >> 32) & mask;
+  while (collected->seen[at].object != NULL &&
+         collected->seen[at].object != object) {
+    at = (at + 1) & mask;
+  }
+  return &collected->seen[at];
+}
+
+static void growSeen(Collected *collected) {
+  Numbered *old = collected->seen;
+  int oldCapacity = collected->seenCapacity;
+  collected->seenCapacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+  collected->seen = calloc(collected->seenCapacity, sizeof(Numbered));
+  for (int i = 0; i < oldCapacity; i++) {
+    if (old[i].object != NULL) {
+      *findSeen(collected, old[i].object) = old[i];
+    }
+  }
+  free(old);
+}
+
+static void *growList(void *list, int count, int *capacity, size_t size) {
+  if (count < *capacity) {
+    return list;
+  }
+  int oldCapacity = *capacity;
+  *capacity = GROW_CAPACITY(oldCapacity);
+  return grow_array(size, list, oldCapacity, *capacity);
+}
+
+// the object's number, numbering it the first time it turns up
+static int numberOf(Collected *collected, Obj *object) {
+  if ((collected->seenCount + 1) * 2 > collected->seenCapacity) {
+    growSeen(collected);
+  }
+  Numbered *seen = findSeen(collected, object);
+  if (seen->object == NULL) {
+    ObjType type = object->type;
+    seen->object = object;
+    seen->index = collected->counts[type];
+    collected->seenCount++;
+    collected->objects[type] =
+        growList(collected->objects[type], collected->counts[type],
+                 &collected->capacities[type], sizeof(Obj *));
+    collected->objects[type][collected->counts[type]++] = object;
+    collected->queue = growList(collected->queue, collected->queued,
+                                &collected->queueCapacity, sizeof(Obj *));
+    collected->queue[collected->queued++] = object;
+  }
+  return seen->index;
+}
+
+static void collectValue(Collected *collected, Value value) {
+  if (IS_OBJ(value)) {
+    numberOf(collected, PAYLOAD_OBJ(value));
+  }
+}
+
+// numbers everything the queued objects point at, and everything that
+// points at, until there's nothing new
+static void collectQueued(Collected *collected) {
+  while (collected->scanned < collected->queued) {
+    Obj *object = collected->queue[collected->scanned++];
+    switch (object->type) {
+    case OBJ_FUNCTION: {
+      ObjFunction *function = (ObjFunction *)object;
+      // a --lazy body is still only in the source, writeFunction() refuses
+      // it if it doesn't compile
+      if (function->lazy != NULL) {
+        compileLazy(function);
+      }
+      if (function->name != NULL) {
+        numberOf(collected, (Obj *)function->name);
+      }
+      ValueArray *constants = &function->chunk.constants;
+      for (int i = 0; i < constants->count; i++) {
+        collectValue(collected, constants->values[i]);
+      }
+      break;
+    }
+    case OBJ_NATIVE: {
+      ObjNative *native = (ObjNative *)object;
+      if (native->name != NULL) {
+        numberOf(collected, (Obj *)native->name);
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      ObjClosure *closure = (ObjClosure *)object;
+      numberOf(collected, (Obj *)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        numberOf(collected, (Obj *)closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_UPVALUE:
+      // closed ones point at their own `closed`
+      collectValue(collected, *((ObjUpvalue *)object)->location);
+      break;
+    case OBJ_ARRAY: {
+      ValueArray *elements = &((ObjArray *)object)->elements;
+      for (int i = 0; i < elements->count; i++) {
+        collectValue(collected, elements->values[i]);
+      }
+      break;
+    }
+    case OBJ_STRING:
+      break;
+    }
+  }
+}
+
+static void freeCollected(Collected *collected) {
+  for (int kind = 0; kind < KINDS; kind++) {
+    free(collected->objects[kind]);
+  }
+  free(collected->seen);
+  free(collected->queue);
+}
+
+static int indexOf(Collected *collected, Obj *object) {
+  return findSeen(collected, object)->index;
+}
+
+// false for anything that can't be written
+static bool encodeValue(Collected *collected, Value value,
+                        ImageConstant *constant) {
+  memset(constant, 0, sizeof(ImageConstant));
+  if (IS_NUMBER(value)) {
+    double number = PAYLOAD_NUMBER(value);
+    constant->type = IMAGE_NUMBER;
+    memcpy(constant->number, &number, sizeof(number));
+    return true;
+  }
+  if (IS_NULL(value)) {
+    constant->type = IMAGE_NULL;
+    return true;
+  }
+  if (IS_BOOL(value)) {
+    constant->type = IMAGE_BOOL;
+    constant->index = PAYLOAD_BOOL(value) ? 1 : 0;
+    return true;
+  }
+  switch (OBJ_TYPE(value)) {
+  case OBJ_STRING:
+    constant->type = IMAGE_STRING;
+    break;
+  case OBJ_FUNCTION:
+    constant->type = IMAGE_FUNCTION;
+    break;
+  case OBJ_NATIVE:
+    constant->type = IMAGE_NATIVE;
+    break;
+  case OBJ_CLOSURE:
+    constant->type = IMAGE_CLOSURE;
+    break;
+  case OBJ_ARRAY:
+    constant->type = IMAGE_ARRAY;
+    break;
+  default:
+    return false;
+  }
+  constant->index = indexOf(collected, PAYLOAD_OBJ(value));
+  return true;
+}
+
+// a snapshot also says which strings were interned, an image's always are
+static void writeStrings(Buffer *buffer, Collected *collected,
+                         bool withInterned) {
+  for (int i = 0; i < collected->counts[OBJ_STRING]; i++) {
+    StringObj *string = (StringObj *)collected->objects[OBJ_STRING][i];
+    uint32_t length = string->length;
+    append(buffer, &length, sizeof(length));
+    if (withInterned) {
+      appendIndex(buffer, string->interned ? 1 : 0);
+    }
+    append(buffer, flattenString(string), length);
+    append(buffer, "", 1);
+    pad(buffer);
+  }
+}
+
+static bool writeFunction(Buffer *buffer, Collected *collected,
+                          ObjFunction *function) {
+  if (function->lazy != NULL) {
+    return false;
+  }
+  Chunk *chunk = &function->chunk;
+  ImageFunction header = {
+      .arity = function->arity,
+      .upvalueCount = function->upvalueCount,
+      .name = function->name == NULL
+                  ? -1
+                  : indexOf(collected, (Obj *)function->name),
+      .codeCount = chunk->count,
+      .lineCount = chunk->lineCount,
+      .constantCount = chunk->constants.count,
+  };
+  append(buffer, &header, sizeof(header));
+  append(buffer, chunk->code, chunk->count);
+  pad(buffer);
+  append(buffer, chunk->lines, chunk->lineCount);
+  pad(buffer);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    ImageConstant constant;
+    if (!encodeValue(collected, chunk->constants.values[i], &constant)) {
+      return false;
+    }
+    append(buffer, &constant, sizeof(constant));
+  }
+  return true;
+}
+
+static bool writeFunctions(Buffer *buffer, Collected *collected) {
+  for (int i = 0; i < collected->counts[OBJ_FUNCTION]; i++) {
+    if (!writeFunction(buffer, collected,
+                       (ObjFunction *)collected->objects[OBJ_FUNCTION][i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void stamp(ImageStamp *stamp, const char *magic, uint16_t version) {
+  memcpy(stamp->magic, magic, 4);
+  stamp->version = version;
+#ifdef REGISTER_VM
+  stamp->flags = IMAGE_REGISTER_VM;
+#else
+  stamp->flags = 0;
+#endif
+  stamp->byteOrder = BYTE_ORDER_MARK;
+}
+
+// fills in the size and checksum of the header at the front of the buffer
+static void seal(Buffer *buffer, size_t headerSize) {
+  ImageStamp *written = (ImageStamp *)buffer->bytes;
+  written->size = (uint32_t)buffer->count;
+  written->checksum = hashString(buffer->bytes + headerSize,
+                                 (int)(buffer->count - headerSize));
+}
+
+// seals the buffer and writes it out. Goes through a temporary file and a
+// rename so nobody starting up ever sees half a file
+static bool writeStamped(Buffer *buffer, size_t headerSize, const char *path) {
+  seal(buffer, headerSize);
+  char *temporary = malloc(strlen(path) + 32);
+  sprintf(temporary, "%s.%d.tmp", path, (int)getpid());
+  FILE *file = fopen(temporary, "wb");
+  bool ok = file != NULL;
+  if (ok) {
+    ok = fwrite(buffer->bytes, 1, buffer->count, file) == buffer->count;
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temporary, path) == 0;
+    if (!ok) {
+      remove(temporary);
+    }
+  }
+  free(temporary);
+  return ok;
+}
+
+// the header's everything but the size and checksum, for whole-file checks
+static bool stamped(const char *bytes, size_t size, const char *magic,
+                    uint16_t version, size_t headerSize) {
+  const ImageStamp *stamp = (const ImageStamp *)bytes;
+  return size >= headerSize && memcmp(stamp->magic, magic, 4) == 0 &&
+         stamp->version == version &&
+#ifdef REGISTER_VM
+         stamp->flags == IMAGE_REGISTER_VM &&
+#else
+         stamp->flags == 0 &&
+#endif
+         stamp->byteOrder == BYTE_ORDER_MARK && stamp->size == size &&
+         stamp->checksum ==
+             hashString(bytes + headerSize, (int)(size - headerSize));
+}
+
+char *imagePath(const char *path) {
+  size_t length = strlen(path);
+  char *image = malloc(length + 2);
+  memcpy(image, path, length);
+  image[length] = 'c'; // script.saas -> script.saasc
+  image[length + 1] = '\0';
+  return image;
+}
+
+// the whole image, sealed, for a file or for memory
+static bool buildImage(ObjFunction *script, const char *source,
+                       size_t sourceLength, Buffer *image) {
+  // the script first, then the rest in the order they're reached
+  Collected collected = {0};
+  numberOf(&collected, (Obj *)script);
+  collectQueued(&collected);
+
+  ImageHeader header = {
+      .sourceLength = (uint32_t)sourceLength,
+      .sourceHash = hashString(source, (int)sourceLength),
+      .stringCount = collected.counts[OBJ_STRING],
+      .functionCount = collected.counts[OBJ_FUNCTION],
+  };
+  stamp(&header.stamp, IMAGE_MAGIC, IMAGE_VERSION);
+  append(image, &header, sizeof(header));
+  writeStrings(image, &collected, false);
+  // a script's constants are only ever numbers, strings and functions
+  bool ok = collected.counts[OBJ_FUNCTION] + collected.counts[OBJ_STRING] ==
+                collected.seenCount &&
+            writeFunctions(image, &collected);
+  if (ok) {
+    seal(image, sizeof(header));
+  }
+  freeCollected(&collected);
+  return ok;
+}
+
+bool writeImage(ObjFunction *script, const char *source, size_t sourceLength,
+                const char *path) {
+  Buffer image = {0};
+  bool ok = buildImage(script, source, sourceLength, &image) &&
+            writeStamped(&image, sizeof(ImageHeader), path);
+  free(image.bytes);
+  return ok;
+}
+
+bool buildProgram(ObjFunction *script, Image *program) {
+  Buffer image = {0};
+  // there's no source to go stale against
+  if (!buildImage(script, "", 0, &image)) {
+    free(image.bytes);
+    return false;
+  }
+  program->bytes = image.bytes;
+  program->size = image.count;
+  program->shared = NULL;
+  program->sharedCount = 0;
+  return true;
+}
+
+// reading goes through this so a short or damaged file can't send anything
+// past the end of the mapping
+typedef struct {
+  const char *at;
+  const char *end;
+} Reader;
+
+static const void *take(Reader *reader, size_t size) {
+  size_t padded = (size + 3) & ~(size_t)3; // everything's 4 byte aligned
+  if ((size_t)(reader->end - reader->at) < padded) {
+    return NULL;
+  }
+  const void *at = reader->at;
+  reader->at += padded;
+  return at;
+}
+
+static bool takeIndex(Reader *reader, uint32_t *index) {
+  const uint32_t *at = take(reader, sizeof(uint32_t));
+  if (at == NULL) {
+    return false;
+  }
+  *index = *at;
+  return true;
+}
+
+// what's been made from the file so far, by kind. Every object exists
+// before anything gets filled in, a constant or an element can point
+// further down
+typedef struct {
+  StringObj **strings;
+  int stringCount;
+  ObjFunction **functions;
+  const ImageFunction **records;
+  const ImageConstant **constants;
+  int functionCount;
+  ObjNative **natives;
+  int nativeCount;
+  ObjClosure **closures;
+  int closureCount;
+  ObjUpvalue **upvalues;
+  int upvalueCount;
+  ObjArray **arrays;
+  int arrayCount;
+} Loaded;
+
+static bool decodeValue(Loaded *loaded, const ImageConstant *constant,
+                        Value *value) {
+  uint32_t index = constant->index;
+  switch (constant->type) {
+  case IMAGE_NUMBER: {
+    double number;
+    memcpy(&number, constant->number, sizeof(number));
+    *value = NUMBER_VAL(number);
+    return true;
+  }
+  case IMAGE_NULL:
+    *value = NULL_VAL;
+    return true;
+  case IMAGE_BOOL:
+    *value = BOOL_VAL(index != 0);
+    return index <= 1;
+  case IMAGE_STRING:
+    if (index >= (uint32_t)loaded->stringCount) {
+      return false;
+    }
+    *value = OBJ_VAL(loaded->strings[index]);
+    return true;
+  case IMAGE_FUNCTION:
+    if (index >= (uint32_t)loaded->functionCount) {
+      return false;
+    }
+    *value = OBJ_VAL(loaded->functions[index]);
+    return true;
+  case IMAGE_NATIVE:
+    if (index >= (uint32_t)loaded->nativeCount) {
+      return false;
+    }
+    *value = OBJ_VAL(loaded->natives[index]);
+    return true;
+  case IMAGE_CLOSURE:
+    if (index >= (uint32_t)loaded->closureCount) {
+      return false;
+    }
+    *value = OBJ_VAL(loaded->closures[index]);
+    return true;
+  case IMAGE_ARRAY:
+    if (index >= (uint32_t)loaded->arrayCount) {
+      return false;
+    }
+    *value = OBJ_VAL(loaded->arrays[index]);
+    return true;
+  }
+  return false;
+}
+
+static bool readStrings(Reader *reader, Loaded *loaded, bool withInterned) {
+  loaded->strings = calloc(loaded->stringCount + 1, sizeof(StringObj *));
+  if (loaded->strings == NULL) {
+    return false;
+  }
+  for (int i = 0; i < loaded->stringCount; i++) {
+    const uint32_t *length = take(reader, sizeof(uint32_t));
+    uint32_t interned = 1;
+    if (length == NULL || (withInterned && !takeIndex(reader, &interned))) {
+      return false;
+    }
+    // in size_t, so UINT32_MAX + 1 for the NUL can't wrap around to 0, and
+    // no more than a StringObj's int length can hold
+    if (*length > INT_MAX ||
+        (size_t)*length + 1 > (size_t)(reader->end - reader->at)) {
+      return false;
+    }
+    const char *chars = take(reader, (size_t)*length + 1);
+    if (chars == NULL) {
+      return false;
+    }
+    if (interned) {
+      loaded->strings[i] = copyString(chars, *length);
+    } else {
+      // the ones a prelude made while running, interning them all would
+      // cost more than making them did
+      char *copy = malloc(*length + 1);
+      memcpy(copy, chars, *length + 1);
+      loaded->strings[i] = makeObjWithString(copy, *length);
+    }
+  }
+  return true;
+}
+
+// the code and line tables get used right where they are in the mapping
+static bool readFunctions(Reader *reader, Loaded *loaded) {
+  int count = loaded->functionCount;
+  loaded->functions = calloc(count + 1, sizeof(ObjFunction *));
+  loaded->records = calloc(count + 1, sizeof(ImageFunction *));
+  loaded->constants = calloc(count + 1, sizeof(ImageConstant *));
+  if (loaded->functions == NULL || loaded->records == NULL ||
+      loaded->constants == NULL) {
+    return false;
+  }
+  for (int i = 0; i < count; i++) {
+    const ImageFunction *record = take(reader, sizeof(ImageFunction));
+    bool ok = record != NULL && record->codeCount >= 0 &&
+              record->lineCount >= 0 && record->constantCount >= 0 &&
+              record->upvalueCount >= 0 && record->name >= -1 &&
+              record->name < loaded->stringCount;
+    const uint8_t *code = ok ? take(reader, record->codeCount) : NULL;
+    const uint8_t *lines =
+        code != NULL ? take(reader, record->lineCount) : NULL;
+    loaded->constants[i] =
+        lines != NULL
+            ? take(reader, sizeof(ImageConstant) * record->constantCount)
+            : NULL;
+    if (loaded->constants[i] == NULL) {
+      return false;
+    }
+    ObjFunction *function = newFunction();
+    function->arity = record->arity;
+    function->upvalueCount = record->upvalueCount;
+    function->name = record->name < 0 ? NULL : loaded->strings[record->name];
+    function->chunk.code = (uint8_t *)code;
+    function->chunk.lines = (uint8_t *)lines;
+    function->chunk.lineCount = record->lineCount;
+    function->chunk.lineCapacity = record->lineCount;
+    function->chunk.count = record->codeCount;
+    function->chunk.capacity = record->codeCount;
+    function->chunk.mapped = true;
+    loaded->functions[i] = function;
+    loaded->records[i] = record;
+  }
+  return true;
+}
+
+// only what the compiler makes, which is all that's been read by the time
+// a snapshot gets here
+static bool fillConstants(Loaded *loaded) {
+  for (int i = 0; i < loaded->functionCount; i++) {
+    ValueArray *pool = &loaded->functions[i]->chunk.constants;
+    for (int c = 0; c < loaded->records[i]->constantCount; c++) {
+      const ImageConstant *constant = &loaded->constants[i][c];
+      Value value;
+      if ((constant->type != IMAGE_NUMBER && constant->type != IMAGE_STRING &&
+           constant->type != IMAGE_FUNCTION) ||
+          !decodeValue(loaded, constant, &value)) {
+        return false;
+      }
+      writeValueArray(pool, value);
+    }
+  }
+  return true;
+}
+
+// after a failed load: whatever did get made is on vm->objectsHead and goes
+// with freeVM(), but not with code pointing into a mapping that's about to
+// go away
+static void dropFunctions(Loaded *loaded) {
+  for (int i = 0; i < loaded->functionCount; i++) {
+    if (loaded->functions != NULL && loaded->functions[i] != NULL) {
+      freeChunk(&loaded->functions[i]->chunk);
+    }
+  }
+}
+
+static void freeLoaded(Loaded *loaded) {
+  free(loaded->strings);
+  free(loaded->functions);
+  free(loaded->records);
+  free(loaded->constants);
+  free(loaded->natives);
+  free(loaded->closures);
+  free(loaded->upvalues);
+  free(loaded->arrays);
+}
+
+// the functions of an image that's already been checked, NULL if its
+// insides are still wrong
+static ObjFunction *readImage(const char *bytes, size_t size) {
+  const ImageHeader *header = (const ImageHeader *)bytes;
+  // everything takes at least 4 bytes, same as in readHeap()
+  if (header->stringCount > size / 4 || header->functionCount > size / 4) {
+    return NULL;
+  }
+  Reader reader = {bytes + sizeof(ImageHeader), bytes + size};
+  Loaded loaded = {0};
+  loaded.stringCount = header->stringCount;
+  loaded.functionCount = header->functionCount;
+  bool ok = loaded.functionCount > 0 &&
+            readStrings(&reader, &loaded, false) &&
+            readFunctions(&reader, &loaded) && fillConstants(&loaded);
+
+  // the image is only as trustworthy as the file, so nothing of it runs
+  // without being verified. The script gets called with no arguments and
+  // no upvalues, and it's verified right away so a bad one just means
+  // compiling instead. The other functions keep maxStack at 0 and call()
+  // verifies them the first time they run, most scripts only ever call a
+  // few of their functions
+  ObjFunction *script = ok ? loaded.functions[0] : NULL;
+  ok = ok && script->arity == 0 && script->upvalueCount == 0 &&
+       verifyFunction(script) == NULL;
+  if (!ok) {
+    script = NULL;
+    dropFunctions(&loaded);
+  }
+  freeLoaded(&loaded);
+  return script;
+}
+
+ObjFunction *loadImage(Image *image, const char *path, const char *source,
+                       size_t sourceLength) {
+  image->bytes = NULL;
+  size_t size;
+  char *bytes = mapFile(path, &size);
+  if (bytes == NULL) {
+    return NULL;
+  }
+  const ImageHeader *header = (const ImageHeader *)bytes;
+  if (!stamped(bytes, size, IMAGE_MAGIC, IMAGE_VERSION, sizeof(ImageHeader)) ||
+      header->sourceLength != sourceLength ||
+      header->sourceHash != hashString(source, (int)sourceLength)) {
+    unmapFile(bytes, size);
+    return NULL;
+  }
+  ObjFunction *script = readImage(bytes, size);
+  if (script == NULL) {
+    unmapFile(bytes, size);
+  } else {
+    image->bytes = bytes;
+    image->size = size;
+  }
+  return script;
+}
+
+ObjFunction *instantiateProgram(const Image *program) {
+  return readImage(program->bytes, program->size);
+}
+
+void freeProgram(Image *program) {
+  free(program->bytes);
+  program->bytes = NULL;
+  for (int i = 0; i < program->sharedCount; i++) {
+    program->shared[i].freeState(program->shared[i].state);
+  }
+  free(program->shared);
+  program->shared = NULL;
+  program->sharedCount = 0;
+}
+
+// what a heap image starts from: globals by name, and with a package the
+// values being handed over
+typedef struct {
+  StringObj **names;
+  Value *globals;
+  int globalCount;
+  int globalCapacity;
+  Value *values;
+  int valueCount;
+  // copies of the natives a package holds a share of, found by index
+  ObjNative *shared;
+  int sharedCount;
+  int sharedCapacity;
+} Roots;
+
+// in place of a native's name
+#define SHARED_NATIVE UINT32_MAX
+
+// the package takes a hold of its own on native's state
+static void addShared(Roots *roots, ObjNative *native) {
+  roots->shared = growList(roots->shared, roots->sharedCount,
+                           &roots->sharedCapacity, sizeof(ObjNative));
+  roots->shared[roots->sharedCount] = *native;
+  roots->shared[roots->sharedCount++].state = native->shareState(native->state);
+}
+
+static void addGlobal(Roots *roots, StringObj *name, Value value) {
+  int capacity = roots->globalCapacity; // both lists grow the same
+  roots->names = growList(roots->names, roots->globalCount, &capacity,
+                          sizeof(StringObj *));
+  roots->globals = growList(roots->globals, roots->globalCount,
+                            &roots->globalCapacity, sizeof(Value));
+  roots->names[roots->globalCount] = name;
+  roots->globals[roots->globalCount++] = value;
+}
+
+// everything the roots reach, collected already, laid out as a snapshot.
+// byValue takes upvalues that are still open as they are right now, a
+// snapshot needs the prelude to be done with them
+static bool writeHeap(Buffer *heap, Collected *collected, Roots *roots,
+                      bool byValue) {
+  SnapshotHeader header = {
+      .stringCount = collected->counts[OBJ_STRING],
+      .functionCount = collected->counts[OBJ_FUNCTION],
+      .nativeCount = collected->counts[OBJ_NATIVE],
+      .closureCount = collected->counts[OBJ_CLOSURE],
+      .upvalueCount = collected->counts[OBJ_UPVALUE],
+      .arrayCount = collected->counts[OBJ_ARRAY],
+      .globalCount = roots->globalCount,
+  };
+  stamp(&header.stamp, SNAPSHOT_MAGIC, SNAPSHOT_VERSION);
+  append(heap, &header, sizeof(header));
+  writeStrings(heap, collected, true);
+  bool ok = writeFunctions(heap, collected);
+  for (int i = 0; i < collected->counts[OBJ_NATIVE] && ok; i++) {
+    ObjNative *native = (ObjNative *)collected->objects[OBJ_NATIVE][i];
+    if (byValue && native->shareState != NULL) {
+      // the VM that unpacks it is in this process, it can hold the same state
+      appendIndex(heap, SHARED_NATIVE);
+      appendIndex(heap, roots->sharedCount);
+      addShared(roots, native);
+      continue;
+    }
+    ok = native->name != NULL && native->state == NULL;
+    if (ok) {
+      appendIndex(heap, indexOf(collected, (Obj *)native->name));
+    }
+  }
+  for (int i = 0; i < collected->counts[OBJ_CLOSURE] && ok; i++) {
+    ObjClosure *closure = (ObjClosure *)collected->objects[OBJ_CLOSURE][i];
+    appendIndex(heap, indexOf(collected, (Obj *)closure->function));
+    appendIndex(heap, closure->upvalueCount);
+    for (int u = 0; u < closure->upvalueCount; u++) {
+      appendIndex(heap, indexOf(collected, (Obj *)closure->upvalues[u]));
+    }
+  }
+  for (int i = 0; i < collected->counts[OBJ_UPVALUE] && ok; i++) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)collected->objects[OBJ_UPVALUE][i];
+    ImageConstant closed;
+    ok = (byValue || upvalue->location == &upvalue->closed) &&
+         encodeValue(collected, *upvalue->location, &closed);
+    append(heap, &closed, sizeof(closed));
+  }
+  for (int i = 0; i < collected->counts[OBJ_ARRAY] && ok; i++) {
+    ValueArray *elements =
+        &((ObjArray *)collected->objects[OBJ_ARRAY][i])->elements;
+    appendIndex(heap, elements->count);
+    for (int e = 0; e < elements->count && ok; e++) {
+      ImageConstant element;
+      ok = encodeValue(collected, elements->values[e], &element);
+      append(heap, &element, sizeof(element));
+    }
+  }
+  for (int i = 0; i < roots->globalCount && ok; i++) {
+    ImageConstant value;
+    ok = encodeValue(collected, roots->globals[i], &value);
+    appendIndex(heap, indexOf(collected, (Obj *)roots->names[i]));
+    append(heap, &value, sizeof(value));
+  }
+  // a package's values come last, the caller knows how many
+  for (int i = 0; i < roots->valueCount && ok; i++) {
+    ImageConstant value;
+    ok = encodeValue(collected, roots->values[i], &value);
+    append(heap, &value, sizeof(value));
+  }
+  if (ok) {
+    seal(heap, sizeof(header));
+  }
+  return ok;
+}
+
+static void freeRoots(Roots *roots) {
+  free(roots->names);
+  free(roots->globals);
+}
+
+bool writeSnapshot(const char *path) {
+  Collected collected = {0};
+  Roots roots = {0};
+  for (int i = 0; i < vm->globals.capacity; i++) {
+    Entry *entry = vm->globals.entries[i];
+    if (entry != NULL && entry->key != NULL) {
+      numberOf(&collected, (Obj *)entry->key);
+      collectValue(&collected, entry->value);
+      addGlobal(&roots, entry->key, entry->value);
+    }
+  }
+  collectQueued(&collected);
+
+  Buffer snapshot = {0};
+  bool ok = writeHeap(&snapshot, &collected, &roots, false) &&
+            writeStamped(&snapshot, sizeof(SnapshotHeader), path);
+  free(snapshot.bytes);
+  freeRoots(&roots);
+  freeCollected(&collected);
+  return ok;
+}
+
+static bool hasGlobal(Roots *roots, StringObj *name) {
+  for (int i = 0; i < roots->globalCount; i++) {
+    if (roots->names[i] == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the globals the function reads or writes, with what they reach. Their
+// functions get looked through in turn, they come later in the same list
+static void collectUsedGlobals(Collected *collected, Roots *roots,
+                               ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t op = chunk->code[offset];
+    if (op != OP_GET_GLOBAL && op != OP_SET_GLOBAL) {
+      continue;
+    }
+    StringObj *name =
+        PAYLOAD_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+    Entry *entry = lookUp(&vm->globals, name->chars, name->hash, name->length);
+    if (entry != NULL && !hasGlobal(roots, entry->key)) {
+      numberOf(collected, (Obj *)entry->key);
+      collectValue(collected, entry->value);
+      addGlobal(roots, entry->key, entry->value);
+    }
+  }
+  collectQueued(collected);
+}
+
+bool packValues(Value *values, int count, bool dataOnly, Image *package) {
+  Collected collected = {0};
+  Roots roots = {.values = values, .valueCount = count};
+  for (int i = 0; i < count; i++) {
+    collectValue(&collected, values[i]);
+  }
+  collectQueued(&collected);
+  for (int i = 0; i < collected.counts[OBJ_FUNCTION]; i++) {
+    collectUsedGlobals(&collected, &roots,
+                       (ObjFunction *)collected.objects[OBJ_FUNCTION][i]);
+  }
+
+  int data = collected.counts[OBJ_STRING] + collected.counts[OBJ_ARRAY];
+  for (int i = 0; i < collected.counts[OBJ_NATIVE]; i++) {
+    ObjNative *native = (ObjNative *)collected.objects[OBJ_NATIVE][i];
+    data += native->shareState != NULL;
+  }
+  Buffer heap = {0};
+  bool ok = (!dataOnly || data == collected.seenCount) &&
+            writeHeap(&heap, &collected, &roots, true);
+  package->bytes = ok ? heap.bytes : NULL;
+  package->size = ok ? heap.count : 0;
+  package->shared = roots.shared;
+  package->sharedCount = roots.sharedCount;
+  if (!ok) {
+    free(heap.bytes);
+    freeProgram(package);
+  }
+  freeRoots(&roots);
+  freeCollected(&collected);
+  return ok;
+}
+
+// the natives this VM defined under the same names
+static bool readNatives(Reader *reader, Loaded *loaded, const Roots *roots) {
+  loaded->natives = calloc(loaded->nativeCount + 1, sizeof(ObjNative *));
+  if (loaded->natives == NULL) {
+    return false;
+  }
+  for (int i = 0; i < loaded->nativeCount; i++) {
+    uint32_t name;
+    uint32_t index;
+    if (!takeIndex(reader, &name)) {
+      return false;
+    }
+    // a package's share of one, this VM gets a hold of its own
+    if (name == SHARED_NATIVE) {
+      if (!takeIndex(reader, &index) || index >= (uint32_t)roots->sharedCount) {
+        return false;
+      }
+      const ObjNative *shared = &roots->shared[index];
+      loaded->natives[i] = newNative(shared->function);
+      loaded->natives[i]->state = shared->shareState(shared->state);
+      loaded->natives[i]->freeState = shared->freeState;
+      loaded->natives[i]->shareState = shared->shareState;
+      continue;
+    }
+    if (name >= (uint32_t)loaded->stringCount) {
+      return false;
+    }
+    StringObj *string = loaded->strings[name];
+    Entry *entry =
+        lookUp(&vm->globals, string->chars, string->hash, string->length);
+    if (entry == NULL || !IS_NATIVE(entry->value) ||
+        ((ObjNative *)PAYLOAD_OBJ(entry->value))->name != string) {
+      return false;
+    }
+    loaded->natives[i] = (ObjNative *)PAYLOAD_OBJ(entry->value);
+  }
+  return true;
+}
+
+// closures get made here and get their upvalues once those exist, the
+// upvalue indexes are left where they are in the mapping until then
+static bool readClosures(Reader *reader, Loaded *loaded,
+                         const uint32_t **upvalueIndexes) {
+  loaded->closures = calloc(loaded->closureCount + 1, sizeof(ObjClosure *));
+  if (loaded->closures == NULL) {
+    return false;
+  }
+  for (int i = 0; i < loaded->closureCount; i++) {
+    uint32_t function;
+    uint32_t upvalueCount;
+    if (!takeIndex(reader, &function) ||
+        function >= (uint32_t)loaded->functionCount ||
+        !takeIndex(reader, &upvalueCount) ||
+        upvalueCount !=
+            (uint32_t)loaded->functions[function]->upvalueCount) {
+      return false;
+    }
+    upvalueIndexes[i] = take(reader, sizeof(uint32_t) * upvalueCount);
+    if (upvalueIndexes[i] == NULL) {
+      return false;
+    }
+    loaded->closures[i] = newClosure(loaded->functions[function]);
+  }
+  loaded->upvalues = calloc(loaded->upvalueCount + 1, sizeof(ObjUpvalue *));
+  if (loaded->upvalues == NULL) {
+    return false;
+  }
+  for (int i = 0; i < loaded->upvalueCount; i++) {
+    ObjUpvalue *upvalue = newUpvalue(NULL);
+    upvalue->location = &upvalue->closed;
+    loaded->upvalues[i] = upvalue;
+  }
+  for (int i = 0; i < loaded->closureCount; i++) {
+    ObjClosure *closure = loaded->closures[i];
+    for (int u = 0; u < closure->upvalueCount; u++) {
+      if (upvalueIndexes[i][u] >= (uint32_t)loaded->upvalueCount) {
+        return false;
+      }
+      closure->upvalues[u] = loaded->upvalues[upvalueIndexes[i][u]];
+    }
+  }
+  return true;
+}
+
+// the globals (checked, but not set) and values of a heap image
+static bool readHeap(const char *bytes, size_t size, Roots *roots) {
+  const SnapshotHeader *header = (const SnapshotHeader *)bytes;
+  // everything takes at least 4 bytes, so no count can be more than that
+  uint32_t most = (uint32_t)(size / 4);
+  if (header->stringCount > most || header->functionCount > most ||
+      header->nativeCount > most || header->closureCount > most ||
+      header->upvalueCount > most || header->arrayCount > most ||
+      header->globalCount > most) {
+    return false;
+  }
+  Reader reader = {bytes + sizeof(SnapshotHeader), bytes + size};
+  Loaded loaded = {0};
+  loaded.stringCount = header->stringCount;
+  loaded.functionCount = header->functionCount;
+  loaded.nativeCount = header->nativeCount;
+  loaded.closureCount = header->closureCount;
+  loaded.upvalueCount = header->upvalueCount;
+  loaded.arrayCount = header->arrayCount;
+  const uint32_t **upvalueIndexes =
+      calloc(loaded.closureCount + 1, sizeof(uint32_t *));
+  bool ok = upvalueIndexes != NULL && readStrings(&reader, &loaded, true) &&
+            readFunctions(&reader, &loaded) &&
+            readNatives(&reader, &loaded, roots) &&
+            readClosures(&reader, &loaded, upvalueIndexes);
+  const ImageConstant *closed =
+      ok ? take(&reader, sizeof(ImageConstant) * loaded.upvalueCount) : NULL;
+  ok = closed != NULL && fillConstants(&loaded);
+
+  // arrays all exist before any get their elements
+  loaded.arrays = calloc(loaded.arrayCount + 1, sizeof(ObjArray *));
+  const ImageConstant **elements =
+      calloc(loaded.arrayCount + 1, sizeof(ImageConstant *));
+  uint32_t *elementCounts = calloc(loaded.arrayCount + 1, sizeof(uint32_t));
+  ok = ok && loaded.arrays != NULL && elements != NULL && elementCounts != NULL;
+  for (int i = 0; i < loaded.arrayCount && ok; i++) {
+    ok = takeIndex(&reader, &elementCounts[i]) &&
+         elementCounts[i] <= (size_t)(reader.end - reader.at) /
+                                 sizeof(ImageConstant);
+    elements[i] =
+        ok ? take(&reader, sizeof(ImageConstant) * elementCounts[i]) : NULL;
+    ok = elements[i] != NULL;
+    if (ok) {
+      loaded.arrays[i] = newArray();
+    }
+  }
+  for (int i = 0; i < loaded.upvalueCount && ok; i++) {
+    ok = decodeValue(&loaded, &closed[i], &loaded.upvalues[i]->closed);
+  }
+  for (int i = 0; i < loaded.arrayCount && ok; i++) {
+    for (uint32_t e = 0; e < elementCounts[i] && ok; e++) {
+      Value value;
+      ok = decodeValue(&loaded, &elements[i][e], &value);
+      if (ok) {
+        writeValueArray(&loaded.arrays[i]->elements, value);
+      }
+    }
+  }
+
+  roots->globalCount = header->globalCount;
+  roots->names = calloc(roots->globalCount + 1, sizeof(StringObj *));
+  roots->globals = calloc(roots->globalCount + 1, sizeof(Value));
+  ok = ok && roots->names != NULL && roots->globals != NULL;
+  for (int i = 0; i < roots->globalCount && ok; i++) {
+    uint32_t name;
+    const ImageConstant *value = NULL;
+    ok = takeIndex(&reader, &name) && name < (uint32_t)loaded.stringCount &&
+         (value = take(&reader, sizeof(ImageConstant))) != NULL &&
+         decodeValue(&loaded, value, &roots->globals[i]);
+    if (ok) {
+      roots->names[i] = loaded.strings[name];
+    }
+  }
+  for (int i = 0; i < roots->valueCount && ok; i++) {
+    const ImageConstant *value = take(&reader, sizeof(ImageConstant));
+    ok = value != NULL && decodeValue(&loaded, value, &roots->values[i]);
+  }
+  ok = ok && reader.at == reader.end;
+  if (!ok) {
+    dropFunctions(&loaded);
+  }
+  free(elements);
+  free(elementCounts);
+  free(upvalueIndexes);
+  freeLoaded(&loaded);
+  return ok;
+}
+
+bool loadSnapshot(Image *image, const char *path) {
+  image->bytes = NULL;
+  size_t size;
+  char *bytes = mapFile(path, &size);
+  if (bytes == NULL) {
+    return false;
+  }
+  Roots roots = {0};
+  bool ok = stamped(bytes, size, SNAPSHOT_MAGIC, SNAPSHOT_VERSION,
+                    sizeof(SnapshotHeader)) &&
+            readHeap(bytes, size, &roots);
+  // every global got checked before any of them go in
+  if (ok) {
+    for (int i = 0; i < roots.globalCount; i++) {
+      set(&vm->globals, roots.globals[i], roots.names[i]);
+    }
+    image->bytes = bytes;
+    image->size = size;
+  } else {
+    unmapFile(bytes, size);
+  }
+  freeRoots(&roots);
+  return ok;
+}
+
+bool unpackValues(const Image *package, Value *values, int count) {
+  Roots roots = {.values = values,
+                 .valueCount = count,
+                 .shared = package->shared,
+                 .sharedCount = package->sharedCount};
+  bool ok = readHeap(package->bytes, package->size, &roots);
+  if (ok) {
+    for (int i = 0; i < roots.globalCount; i++) {
+      set(&vm->globals, roots.globals[i], roots.names[i]);
+    }
+  }
+  freeRoots(&roots);
+  return ok;
+}
+
+void closeImage(Image *image) {
+  if (image->bytes != NULL) {
+    unmapFile(image->bytes, image->size);
+    image->bytes = NULL;
+  }
+}
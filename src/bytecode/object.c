@@ -3,8 +3,10 @@
 
 #include "../../include/bytecode/object.h"
 #include "../../include/bytecode/value.h"
+#include "../../include/datastructures/hash.h"
 #include "../../include/datastructures/hashmap.h"
 #include "../../include/memory.h"
+#include "../../include/output.h"
 #include "../../include/vm/vm.h"
 
 // #define ALLOCATE_OBJ(type, objectType) ((type*) allocateObject(sizeof(type),
@@ -19,24 +21,41 @@ ObjFunction *newFunction() {
   ObjFunction *function = malloc(sizeof(ObjFunction));
   function->arity = 0;
   function->obj.type = OBJ_FUNCTION;
+  function->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)function;
   function->upvalueCount = 0;
   function->name = NULL;
+  function->callCount = 0;
+  function->jitCode = NULL;
+  function->jitSize = 0;
+  function->maxStack = 0;
+  function->aotCode = NULL;
+  function->lazy = NULL;
   initChunk(&function->chunk);
   return function;
 }
 ObjNative *newNative(NativeFunction function) {
   ObjNative *native = malloc(sizeof(ObjNative));
   native->obj.type = OBJ_NATIVE;
+  native->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)native;
   native->function = function;
+  native->state = NULL;
+  native->freeState = NULL;
+  native->shareState = NULL;
+  native->name = NULL;
   return native;
 }
 ObjClosure *newClosure(ObjFunction *function) {
-  ObjUpvalue **upvalues = malloc(sizeof(ObjUpvalue *));
+  ObjUpvalue **upvalues =
+      malloc(sizeof(ObjUpvalue *) * function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
     upvalues[i] = NULL;
   }
   ObjClosure *closure = malloc(sizeof(ObjClosure));
   closure->obj.type = OBJ_CLOSURE;
+  closure->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)closure;
   closure->function = function;
   closure->upvalueCount = function->upvalueCount;
   closure->upvalues = upvalues;
@@ -44,34 +63,38 @@ ObjClosure *newClosure(ObjFunction *function) {
 }
 // FOR THE RECORD, IDK WHY THE CODE ABOVE IS EVEN THERE WHY SO COMPLICATED, JUST
 // CALL MALLOC: IT AIN'T THAT DEEP
-static StringObj *allocateString(char *chars, int length, uint32_t hash) {
+// every string starts out transient: not hashed and not in vm->strings
+static StringObj *allocateString(char *chars, int length) {
   StringObj *string = malloc(sizeof(StringObj));
-  string->obj.next = vm.objectsHead;
-  vm.objectsHead = (Obj *)string;
+  string->obj.type = OBJ_STRING;
+  string->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)string;
   string->chars = chars;
   string->length = length;
-  string->hash = hash;
-  set(&vm.strings, NULL_VAL, string);
+  string->hash = 0;
+  string->interned = false;
+  string->left = NULL;
+  string->right = NULL;
+  string->parent = NULL;
   return string;
 }
 
-static uint32_t hashFunc(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
+// for a string whose text isn't in vm->strings yet
+static StringObj *addInterned(StringObj *string, uint32_t hash) {
+  string->hash = hash;
+  string->interned = true;
+  set(&vm->strings, NULL_VAL, string);
+  return string;
 }
 
 StringObj *copyString(const char *chars, int length) {
 
-  uint32_t hash = hashFunc(chars, length);
+  uint32_t hash = hashString(chars, length);
 
 #ifdef DEBUG_PRINT_CODE
   printf("lookup from copyString with %s\n", chars);
 #endif
-  Entry *interned = lookUp(&vm.strings, chars, hash, length);
+  Entry *interned = lookUp(&vm->strings, chars, hash, length);
   if (interned != NULL) {
 #ifdef DEBUG_PRINT_CODE
     printf("interned found from copystring at %p\n", interned);
@@ -88,11 +111,13 @@ StringObj *copyString(const char *chars, int length) {
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
 
-  return allocateString(heapChars, length, hash);
+  return addInterned(allocateString(heapChars, length), hash);
 }
 ObjUpvalue *newUpvalue(Value *slot) {
   ObjUpvalue *upvalue = malloc(sizeof(ObjUpvalue));
   upvalue->obj.type = OBJ_UPVALUE;
+  upvalue->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)upvalue;
   upvalue->location = slot;
   upvalue->next = NULL;
   upvalue->closed = NULL_VAL;
@@ -102,8 +127,8 @@ ObjUpvalue *newUpvalue(Value *slot) {
 ObjArray *newArray() {
   ObjArray *array = malloc(sizeof(ObjArray));
   array->obj.type = OBJ_ARRAY;
-  array->obj.next = vm.objectsHead;
-  vm.objectsHead = (Obj *)array;
+  array->obj.next = vm->objectsHead;
+  vm->objectsHead = (Obj *)array;
   initValueArray(&array->elements);
   return array;
 }
@@ -146,16 +171,18 @@ void arraySet(Value arrayVal, int index, Value value) {
 
 static void printFunction(ObjFunction *function) {
   if (function->name == NULL) {
-    printf("<script>");
+    writeOutput("<script>", 8);
     return;
   }
-  printf("<fn %s", function->name->chars);
+  writeOutput("<fn ", 4);
+  writeOutput(function->name->chars, function->name->length);
 }
 
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_STRING: {
-    printf("%s", PAYLOAD_CSTRING(value));
+    StringObj *string = PAYLOAD_STRING(value);
+    writeOutput(flattenString(string), string->length);
     break;
   }
   case OBJ_FUNCTION: {
@@ -163,7 +190,7 @@ void printObject(Value value) {
     break;
   }
   case OBJ_NATIVE: {
-    printf("<native function");
+    writeOutput("<native function", 16);
     break;
   }
   case OBJ_CLOSURE: {
@@ -171,36 +198,121 @@ void printObject(Value value) {
     break;
   }
   case OBJ_UPVALUE: {
-    printf("upvalue");
+    writeOutput("upvalue", 7);
     break;
   }
   case OBJ_ARRAY: {
     ObjArray *array = PAYLOAD_ARRAY(value);
-    printf("[");
+    writeOutputChar('[');
     for (int i = 0; i < array->elements.count; i++) {
       printValue(array->elements.values[i]);
       if (i < array->elements.count - 1) {
-        printf(", ");
+        writeOutput(", ", 2);
       }
     }
-    printf("]");
+    writeOutputChar(']');
     break;
   }
   }
 }
 
 StringObj *makeObjWithString(char *chars, int length) {
-  uint32_t hash = hashFunc(chars, length);
-  printf("lookup from makeojb with %s\n", chars);
-  Entry *interned = lookUp(&vm.strings, chars, hash, length);
-  if (interned != NULL) {
-    free(chars);
+  return allocateString(chars, length);
+}
 
-#ifdef DEBUG_PRINT_CODE
-    printf("interned found from makeObjWithString at %p\n", interned);
-#endif
+StringObj *internString(StringObj *string) {
+  if (string->interned) {
+    return string;
+  }
+  char *chars = flattenString(string);
+  uint32_t hash = hashString(chars, string->length);
+  if (string->parent != NULL) {
+    // table keys get compared as C strings, so a slice needs its own copy
+    char *copy = malloc(sizeof(char) * string->length + 1);
+    memcpy(copy, chars, string->length);
+    copy[string->length] = '\0';
+    chars = copy;
+    string->chars = copy;
+    string->parent = NULL;
+  }
+  Entry *interned = lookUp(&vm->strings, chars, hash, string->length);
+  if (interned != NULL) {
     return interned->key;
   }
-  printf("nothing found at makeObjWithString\n");
-  return allocateString(chars, length, hash);
+  return addInterned(string, hash);
+}
+
+// shorter results just get copied, ropes only pay off once there's something
+// worth not copying
+#define ROPE_MIN_LENGTH 64
+
+StringObj *concatStrings(StringObj *left, StringObj *right) {
+  int length = left->length + right->length;
+  if (length < ROPE_MIN_LENGTH) {
+    char *chars = malloc(sizeof(char) * length + 1);
+    memcpy(chars, flattenString(left), left->length);
+    memcpy(chars + left->length, flattenString(right), right->length);
+    chars[length] = '\0';
+    return makeObjWithString(chars, length);
+  }
+  StringObj *rope = allocateString(NULL, length);
+  rope->left = left;
+  rope->right = right;
+  return rope;
+}
+
+char *flattenString(StringObj *string) {
+  if (string->chars != NULL) {
+    return string->chars;
+  }
+  char *chars = malloc(sizeof(char) * string->length + 1);
+  chars[string->length] = '\0';
+  // filled in from the end with our own stack instead of recursion, `s = s +
+  // x` in a loop makes ropes thousands of nodes deep on the left
+  int capacity = 8;
+  int count = 0;
+  StringObj **stack = malloc(sizeof(StringObj *) * capacity);
+  stack[count++] = string;
+  int end = string->length;
+  while (count > 0) {
+    StringObj *node = stack[--count];
+    if (node->chars != NULL) {
+      end -= node->length;
+      memcpy(chars + end, node->chars, node->length);
+      continue;
+    }
+    if (count + 2 > capacity) {
+      capacity *= 2;
+      stack = realloc(stack, sizeof(StringObj *) * capacity);
+    }
+    stack[count++] = node->left;
+    stack[count++] = node->right; // popped first
+  }
+  free(stack);
+  string->chars = chars;
+  string->left = NULL;
+  string->right = NULL;
+  return chars;
+}
+
+bool stringsEqual(StringObj *a, StringObj *b) {
+  if (a == b) {
+    return true;
+  }
+  // two interned strings with the same text would be the same object
+  if (a->length != b->length || (a->interned && b->interned)) {
+    return false;
+  }
+  return memcmp(flattenString(a), flattenString(b), a->length) == 0;
+}
+
+StringObj *sliceString(StringObj *string, int start, int length) {
+  if (start == 0 && length == string->length) {
+    return string;
+  }
+  char *chars = flattenString(string);
+  StringObj *slice = allocateString(chars + start, length);
+  // always the one that owns the memory, never another slice
+  slice->parent = string->parent != NULL ? string->parent : string;
+  return slice;
 }
@@ -1,6 +1,8 @@
 #include "../../include/bytecode/value.h"
 #include "../../include/memory.h"
 #include "../../include/bytecode/object.h"
+#include "../../include/output.h"
+#include "../../include/bytecode/number.h"
 #include <string.h>
 
 
@@ -47,6 +49,10 @@ bool isEqual(Value a, Value b){
             // StringObj* aString = PAYLOAD_STRING(a);
             // StringObj* bString = PAYLOAD_STRING(b);
             // return aString->length == bString->length && strcmp(aString->chars,bString->chars)==0 ;
+            if (IS_STRING(a) && IS_STRING(b)){
+                // ropes aren't interned, so pointers aren't enough for them
+                return stringsEqual(PAYLOAD_STRING(a), PAYLOAD_STRING(b));
+            }
             return PAYLOAD_OBJ(a) == PAYLOAD_OBJ(b);
 
         }
@@ -59,12 +65,19 @@ bool isEqual(Value a, Value b){
 void printValue(Value value){
     switch (value.type){
         case VAL_BOOL:
-            printf(value.payload.boolean? "true": "false");
+            if (value.payload.boolean){
+                writeOutput("true", 4);
+            } else {
+                writeOutput("false", 5);
+            }
             break;
-        case VAL_NULL: printf("NULL"); break;
-        case VAL_NUMBER:
-            printf("%g", PAYLOAD_NUMBER(value));
+        case VAL_NULL: writeOutput("NULL", 4); break;
+        case VAL_NUMBER: {
+            char number[NUMBER_BUFFER_SIZE];
+            int length = formatNumber(PAYLOAD_NUMBER(value), number);
+            writeOutput(number, length);
             break;
+        }
         case VAL_OBJ:
             printObject(value);
             break;
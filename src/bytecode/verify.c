@@ -0,0 +1,312 @@
+#include "../../include/bytecode/verify.h"
+#include <stdlib.h>
+
+#define UNSEEN -1
+
+typedef struct {
+  ObjFunction *function;
+  Chunk *chunk;
+  bool *starts; // where instructions start
+  int *depths;  // stack depth on the way into each instruction
+  int *worklist; // reached but not stepped through yet
+  int pending;
+  int maxStack;
+} Verifier;
+
+static bool isConstant(Chunk *chunk, int index) {
+  return index < chunk->constants.count;
+}
+
+static bool isStringConstant(Chunk *chunk, int index) {
+  return isConstant(chunk, index) &&
+         IS_STRING(chunk->constants.values[index]);
+}
+
+static int jumpTarget(uint8_t *code, int offset) {
+  int distance = (code[1] << 8) | code[2];
+  return code[0] == OP_LOOP ? offset + 3 - distance : offset + 3 + distance;
+}
+
+// everything that doesn't depend on the stack. decodeChunk() goes through
+// every instruction, reachable or not, so this does too
+static const char *checkOperands(Verifier *v, int offset) {
+  Chunk *chunk = v->chunk;
+  uint8_t *code = chunk->code + offset;
+  switch (code[0]) {
+  case OP_CONSTANT:
+    // a bare function would get called as if it were a closure
+    if (!isConstant(chunk, code[1]) ||
+        IS_FUNCTION(chunk->constants.values[code[1]])) {
+      return "bad constant";
+    }
+    break;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_PROPERTY:
+    if (!isStringConstant(chunk, code[1])) {
+      return "name isn't a string constant";
+    }
+    break;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    if (code[1] >= v->function->upvalueCount) {
+      return "upvalue index out of range";
+    }
+    break;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP: {
+    // whether it lands on an instruction gets checked if it can be reached
+    int target = jumpTarget(code, offset);
+    if (target < 0 || target >= chunk->count) {
+      return "jump out of the chunk";
+    }
+    break;
+  }
+  case OP_CLOSURE: {
+    // instructionLength() already needed it to be a function
+    ObjFunction *inner = PAYLOAD_FUNCTION(chunk->constants.values[code[1]]);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      uint8_t isLocal = code[2 + i * 2];
+      uint8_t index = code[3 + i * 2];
+      if (isLocal > 1 || (!isLocal && index >= v->function->upvalueCount)) {
+        return "closure captures an upvalue that doesn't exist";
+      }
+    }
+    break;
+  }
+  case OP_MOVE_R:
+    if ((code[1] & ~REG_A_CONSTANT) != 0 ||
+        ((code[1] & REG_A_CONSTANT) && !isConstant(chunk, code[3]))) {
+      return "bad register operands";
+    }
+    break;
+  case OP_ADD_R:
+  case OP_SUBSTRACT_R:
+  case OP_MULITPLY_R:
+  case OP_DIVIDE_R:
+  case OP_EQUAL_R:
+  case OP_GREATER_R:
+  case OP_LESS_R:
+    if ((code[1] & ~(REG_A_CONSTANT | REG_B_CONSTANT | REG_PUSH)) != 0 ||
+        ((code[1] & REG_A_CONSTANT) && !isConstant(chunk, code[3])) ||
+        ((code[1] & REG_B_CONSTANT) && !isConstant(chunk, code[4]))) {
+      return "bad register operands";
+    }
+    break;
+  }
+  return NULL;
+}
+
+// where every instruction starts, and that the last one ends with the chunk
+static const char *findInstructions(Verifier *v) {
+  Chunk *chunk = v->chunk;
+  int offset = 0;
+  while (offset < chunk->count) {
+    uint8_t *code = chunk->code + offset;
+    if (code[0] > OP_MOVE_R) {
+      return "unknown opcode";
+    }
+    // OP_CLOSURE's length comes from its function
+    if (code[0] == OP_CLOSURE &&
+        (offset + 1 >= chunk->count || !isConstant(chunk, code[1]) ||
+         !IS_FUNCTION(chunk->constants.values[code[1]]))) {
+      return "closure of something that isn't a function";
+    }
+    int length = instructionLength(chunk, offset);
+    if (offset + length > chunk->count) {
+      return "instruction runs past the end of the chunk";
+    }
+    const char *problem = checkOperands(v, offset);
+    if (problem != NULL) {
+      return problem;
+    }
+    v->starts[offset] = true;
+    offset += length;
+  }
+  return NULL;
+}
+
+// hands `depth` on to the instruction at `offset`
+static const char *reach(Verifier *v, int offset, int depth) {
+  if (offset >= v->chunk->count) {
+    return "runs off the end of the chunk";
+  }
+  if (!v->starts[offset]) {
+    return "jump doesn't land on an instruction";
+  }
+  if (v->depths[offset] == UNSEEN) {
+    v->depths[offset] = depth;
+    v->worklist[v->pending++] = offset;
+  } else if (v->depths[offset] != depth) {
+    return "stack depth differs between paths";
+  }
+  return NULL;
+}
+
+// a register operand that isn't a constant has to be a slot that's there
+static bool isSlot(bool isConstant, uint8_t index, int depth) {
+  return isConstant || index < depth;
+}
+
+// one reachable instruction: what it pops has to be above the callee's slot,
+// the slots it names have to exist, then it hands its depth on
+static const char *step(Verifier *v, int offset) {
+  uint8_t *code = v->chunk->code + offset;
+  int depth = v->depths[offset];
+  int pops = 0;
+  int pushes = 0;
+  int peak = 0; // anything pushed for a moment on top of that
+  bool fallsThrough = true;
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_NULL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_UPVALUE:
+  case OP_GET_GLOBAL:
+  case OP_CLOSURE:
+    pushes = 1;
+    break;
+  case OP_GET_LOCAL:
+    if (code[1] >= depth) {
+      return "local slot out of range";
+    }
+    pushes = 1;
+    break;
+  case OP_SET_LOCAL:
+    if (code[1] >= depth) {
+      return "local slot out of range";
+    }
+    pops = pushes = 1;
+    break;
+  case OP_SET_UPVALUE:
+  case OP_SET_GLOBAL:
+  case OP_NEGATE:
+  case OP_NOT:
+  case OP_GET_PROPERTY:
+  case OP_JUMP_IF_FALSE:
+    pops = pushes = 1;
+    break;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+    pops = 1;
+    break;
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBSTRACT:
+  case OP_MULITPLY:
+  case OP_DIVIDE:
+  case OP_GET_INDEX:
+    pops = 2;
+    pushes = 1;
+    break;
+  case OP_SET_INDEX:
+    pops = 3;
+    pushes = 1;
+    break;
+  case OP_ARRAY:
+    pops = code[1];
+    pushes = 1;
+    break;
+  case OP_CALL:
+    pops = code[1] + 1;
+    pushes = 1;
+    peak = 1; // natives can push a temporary
+    break;
+  case OP_RETURN:
+    pops = 1;
+    fallsThrough = false;
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    fallsThrough = false;
+    break;
+  case OP_MOVE_R:
+    if (code[2] >= depth || !isSlot(code[1] & REG_A_CONSTANT, code[3], depth)) {
+      return "register out of range";
+    }
+    break;
+  default: // the binary register ops
+    if (!isSlot(code[1] & REG_A_CONSTANT, code[3], depth) ||
+        !isSlot(code[1] & REG_B_CONSTANT, code[4], depth) ||
+        (!(code[1] & REG_PUSH) && code[2] >= depth)) {
+      return "register out of range";
+    }
+    pushes = code[1] & REG_PUSH ? 1 : 0;
+    peak = 2; // binaryOp() pushes both strings to concatenate them
+    break;
+  }
+  if (code[0] == OP_CLOSURE) {
+    ObjFunction *inner =
+        PAYLOAD_FUNCTION(v->chunk->constants.values[code[1]]);
+    // the closure gets pushed before it captures anything, so a local
+    // function that calls itself captures the slot at `depth`
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      if (code[2 + i * 2] && code[3 + i * 2] > depth) {
+        return "closure captures a local that doesn't exist";
+      }
+    }
+  }
+  // slot 0 is the callee (or the script), the frame's values start above it
+  if (depth - pops < 1) {
+    return "pops more than the frame has";
+  }
+  int after = depth - pops + pushes;
+  if (depth + peak > v->maxStack) {
+    v->maxStack = depth + peak;
+  }
+  if (after > v->maxStack) {
+    v->maxStack = after;
+  }
+
+  const char *problem = NULL;
+  if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE ||
+      code[0] == OP_LOOP) {
+    problem = reach(v, jumpTarget(code, offset), after);
+  }
+  if (problem == NULL && fallsThrough) {
+    problem = reach(v, offset + instructionLength(v->chunk, offset), after);
+  }
+  return problem;
+}
+
+const char *verifyFunction(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0) {
+    return "empty chunk";
+  }
+  Verifier v;
+  v.function = function;
+  v.chunk = chunk;
+  v.starts = calloc(chunk->count, sizeof(bool));
+  v.depths = malloc(sizeof(int) * chunk->count);
+  // an instruction only goes on the list the first time it's reached, and
+  // anything never reached is dead code
+  v.worklist = malloc(sizeof(int) * chunk->count);
+  v.pending = 0;
+  v.maxStack = function->arity + 1;
+  for (int i = 0; i < chunk->count; i++) {
+    v.depths[i] = UNSEEN;
+  }
+
+  const char *problem = findInstructions(&v);
+  if (problem == NULL) {
+    problem = reach(&v, 0, function->arity + 1);
+  }
+  while (problem == NULL && v.pending > 0) {
+    problem = step(&v, v.worklist[--v.pending]);
+  }
+  if (problem == NULL) {
+    function->maxStack = v.maxStack;
+  }
+  free(v.starts);
+  free(v.depths);
+  free(v.worklist);
+  return problem;
+}
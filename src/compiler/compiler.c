@@ -1,6 +1,11 @@
 #include "../../include/compiler/compiler.h"
+#include "../../include/bytecode/number.h"
+#include "../../include/bytecode/verify.h"
+#include "../../include/compiler/registers.h"
 #include "../../include/compiler/scanner.h"
+#include "../../include/compiler/tokens.h"
 #include "../../include/debug.h"
+#include "../../include/output.h"
 #include "../../include/vm/vm.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -14,9 +19,9 @@ typedef struct {
   bool hadError;
 
 } Parser;
-Chunk *compilingChunk;
+_Thread_local Chunk *compilingChunk;
 
-Parser parser;
+_Thread_local Parser parser;
 
 typedef enum {
   PREC_NONE,
@@ -64,9 +69,13 @@ typedef struct Compiler {
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
   // local variables are stored in array "locals"
+  LazyBody *lazy; // compiling a skimmed body, what it captured
 } Compiler;
 
-Compiler *current = NULL;
+// a compile starts and finishes on one thread, so each thread gets its own
+_Thread_local Compiler *current = NULL;
+// where the source being compiled ends, for --lazy bodies to resume from
+static _Thread_local const char *sourceEnd;
 static Chunk *currentChunk() { return &current->function->chunk; }
 
 static void expression();
@@ -76,7 +85,7 @@ static void declaration();
 static bool check(TokenType type);
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
-static u_int8_t makeConstant(Value value);
+static uint8_t makeConstant(Value value);
 static void writeLoop(int loopStart);
 static bool match(TokenType type);
 static void defineVariable(uint8_t global);
@@ -96,6 +105,8 @@ static void initCompiler(Compiler *compiler, FunctionType type);
 static void endScope();
 static void beginScope();
 static bool identifierEquals(Token *a, Token *b);
+static int resolveLocal(Compiler *compiler, Token *name);
+static int resolveUpvalue(Compiler *compiler, Token *name);
 static void writeBytes(uint8_t byte1, uint8_t byte2);
 static void parsePrecedence(Precedence precedence) {
   advance();
@@ -126,6 +137,10 @@ static void errorAt(Token *token, const char *message) {
   if (parser.cooked)
     return;
   parser.cooked = true;
+  // a --lazy body gets compiled on its first call, after the script may
+  // have printed things, which have to show up first like with
+  // runtimeError()
+  flushOutput();
   fprintf(stderr, "[line %d] Error ", token->line);
   if (token->type == TOKEN_EOF) {
     fprintf(stderr, " at end");
@@ -145,7 +160,7 @@ static void errorAtCurrent(const char *message) {
 static void advance() {
   parser.previous = parser.current;
   while (1) {
-    parser.current = scanToken(); // moves the current token forward
+    parser.current = nextToken(); // moves the current token forward
     if (parser.current.type !=
         TOKEN_ERROR) // lwk retarded, only loops if there is an error
 
@@ -180,10 +195,8 @@ static void block() {
   }
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
-static void function(FunctionType type) {
-  Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
+// '(' through '{', declaring the params as locals
+static void parameters() {
   consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
   if (!check(TOKEN_RIGHT_PAREN)) {
     do {
@@ -198,8 +211,55 @@ static void function(FunctionType type) {
   }
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after function name.");
   consume(TOKEN_LEFT_BRACE, "Expected '{' after function name.");
-  block();
-  ObjFunction *function = endCompiler();
+}
+// --lazy: steps over the body to its '}'. Any name that isn't one of the
+// params gets looked up in the enclosing functions like it would be in an
+// expression, so the closure captures everything the body could need
+static LazyBody *skimBody(Token open) {
+  Token names[UINT8_COUNT];
+  int named = 0;
+  int depth = 1;
+  while (depth > 0) {
+    if (check(TOKEN_EOF)) {
+      errorAtCurrent("Expect '}' after block.");
+      break;
+    }
+    if (check(TOKEN_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOKEN_RIGHT_BRACE)) {
+      depth--;
+    } else if (check(TOKEN_IDENTIFIER) &&
+               resolveLocal(current, &parser.current) == -1) {
+      // a new upvalue gets the next index, a name seen before an old one
+      if (resolveUpvalue(current, &parser.current) == named) {
+        names[named++] = parser.current;
+      }
+    }
+    advance();
+  }
+  LazyBody *body = malloc(sizeof(LazyBody) + sizeof(Token) * named);
+  body->start = open.start;
+  body->end = sourceEnd;
+  body->line = open.line;
+  body->capturedCount = named;
+  memcpy(body->captured, names, sizeof(Token) * named);
+  return body;
+}
+static void function(FunctionType type) {
+  Compiler compiler;
+  initCompiler(&compiler, type);
+  beginScope();
+  Token open = parser.current;
+  parameters();
+  ObjFunction *function;
+  if (vm->lazy) {
+    function = current->function;
+    function->lazy = skimBody(open);
+    current = current->enclosing;
+  } else {
+    block();
+    function = endCompiler();
+  }
   writeBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
   for (int i = 0; i < function->upvalueCount; i++) {
     writeByte(compiler.upvalues[i].isLocal ? 1 : 0);
@@ -251,8 +311,18 @@ static int addUpValue(Compiler *compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++;
 }
 static int resolveUpvalue(Compiler *compiler, Token *name) {
-  if (compiler->enclosing == NULL)
+  if (compiler->enclosing == NULL) {
+    // a skimmed body's enclosing functions are long gone, but the skim
+    // already worked out what each upvalue is
+    if (compiler->lazy != NULL) {
+      for (int i = 0; i < compiler->lazy->capturedCount; i++) {
+        if (identifierEquals(name, &compiler->lazy->captured[i])) {
+          return i;
+        }
+      }
+    }
     return -1;
+  }
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
@@ -345,10 +415,10 @@ static void ifStatement() {
   int elseJump = writeJump(OP_JUMP); // no need to worry bout conditional
                                      // since included in the if statement
   patchJump(thenJump);
+  writeByte(OP_POP); // pop bool if false
   if (match(TOKEN_ELSE))
     statement();
   patchJump(elseJump);
-  writeByte(OP_POP); // pop bool if false
 }
 static void whileLoop() {
   int loop_start = currentChunk()->count;
@@ -440,6 +510,7 @@ static void synchronize() {
 
     default:;
     }
+    advance();
   }
 }
 static void declaration() {
@@ -452,7 +523,7 @@ static void declaration() {
     statement();
   }
   if (parser.cooked)
-    if (vm.repl) {
+    if (vm->repl) {
 
     } else {
       synchronize();
@@ -500,7 +571,7 @@ static void writeReturn() {
   writeByte(OP_NULL);
   writeByte(OP_RETURN);
 }
-static u_int8_t makeConstant(Value value) {
+static uint8_t makeConstant(Value value) {
   int constant_index = addConstant(currentChunk(), value);
   // gives back the index on the constant array for the chunk
   if (constant_index > UINT8_MAX) {
@@ -544,6 +615,7 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lazy = NULL;
   compiler->function = newFunction();
 
   current = compiler;
@@ -560,6 +632,16 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 static ObjFunction *endCompiler() {
   writeReturn();
   ObjFunction *function = current->function;
+#ifdef REGISTER_VM
+  registerize(currentChunk());
+#endif
+  // only ever fails on a compiler bug, but it's also what sets maxStack
+  if (!parser.hadError) {
+    const char *problem = verifyFunction(function);
+    if (problem != NULL) {
+      error(problem);
+    }
+  }
 #ifdef DEBUG_PRINT_CODE
   if (parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -680,7 +762,13 @@ static void call(bool canAssign) {
   writeBytes(OP_CALL, argCount);
 }
 static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
+  // the scanner already knows where the literal ends, no need for strtod to
+  // find it again
+  double value;
+  if (!parseNumber(parser.previous.start, parser.previous.length, &value)) {
+    error("Invalid number literal.");
+    return;
+  }
   writeConstant(NUMBER_VAL(value));
 }
 static void or_(bool canAssign) {
@@ -809,8 +897,7 @@ ParseRule rules[] = {
 };
 static ParseRule *getRule(TokenType type) { return &rules[type]; }
 
-ObjFunction *compile(const char *source) {
-  initScanner(source);
+static ObjFunction *compileScript() {
   // compilingChunk = chunk;
   parser.hadError = false;
   parser.cooked = false;
@@ -826,7 +913,7 @@ ObjFunction *compile(const char *source) {
     }
     declaration();
     // In file mode, exit immediately on error instead of trying to recover
-    if (parser.hadError && !vm.repl) {
+    if (parser.hadError && !vm->repl) {
       current = NULL;
       return NULL;
     }
@@ -834,3 +921,51 @@ ObjFunction *compile(const char *source) {
   ObjFunction *function = endCompiler();
   return parser.hadError ? NULL : function;
 }
+
+ObjFunction *compile(const char *source) {
+  if (vm->lazy) {
+    sourceEnd = source + strlen(source);
+  }
+  startTokens(source, vm->lexThread);
+  ObjFunction *function = compileScript();
+  stopTokens();
+  return function;
+}
+
+bool compileLazy(ObjFunction *function) {
+  LazyBody *body = function->lazy;
+  sourceEnd = body->end; // for any functions inside it
+  resumeTokens(body->start, body->end, body->line);
+  parser.hadError = false;
+  parser.cooked = false;
+  advance();
+  // like initCompiler(), but into the function the skim already made
+  Compiler compiler;
+  compiler.enclosing = NULL;
+  compiler.function = function;
+  compiler.type = TYPE_FUNCTION;
+  compiler.localCount = 0;
+  compiler.scopeDepth = 0;
+  compiler.lazy = body;
+  Local *local = &compiler.locals[compiler.localCount++];
+  local->depth = 0;
+  local->isCaptured = false;
+  local->name.start = "";
+  local->name.length = 0;
+  current = &compiler;
+
+  function->arity = 0; // parameters() counts them again
+  beginScope();
+  parameters();
+  block();
+  endCompiler();
+  current = NULL;
+  if (parser.hadError) {
+    // a second call tries again from scratch
+    freeChunk(&function->chunk);
+    return false;
+  }
+  function->lazy = NULL;
+  free(body);
+  return true;
+}
@@ -0,0 +1,139 @@
+#include "../../include/compiler/registers.h"
+#include "../../include/memory.h"
+#include <stdlib.h>
+
+// a GET_LOCAL or CONSTANT that can become a register operand
+static bool readOperand(Chunk *chunk, int offset, uint8_t *index,
+                        bool *constant) {
+  if (offset + 1 >= chunk->count)
+    return false;
+  uint8_t op = chunk->code[offset];
+  if (op != OP_GET_LOCAL && op != OP_CONSTANT)
+    return false;
+  *index = chunk->code[offset + 1];
+  *constant = op == OP_CONSTANT;
+  return true;
+}
+
+static int registerOp(uint8_t op) {
+  switch (op) {
+  case OP_ADD:
+    return OP_ADD_R;
+  case OP_SUBSTRACT:
+    return OP_SUBSTRACT_R;
+  case OP_MULITPLY:
+    return OP_MULITPLY_R;
+  case OP_DIVIDE:
+    return OP_DIVIDE_R;
+  case OP_EQUAL:
+    return OP_EQUAL_R;
+  case OP_GREATER:
+    return OP_GREATER_R;
+  case OP_LESS:
+    return OP_LESS_R;
+  default:
+    return -1;
+  }
+}
+
+// is `op` at offset, with nothing jumping to it
+static bool plain(Chunk *chunk, bool *targets, int offset, uint8_t op) {
+  return offset < chunk->count && !targets[offset] &&
+         chunk->code[offset] == op;
+}
+
+void registerize(Chunk *chunk) {
+  bool *targets = calloc(chunk->count + 1, sizeof(bool));
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t *code = chunk->code + offset;
+    if (code[0] == OP_JUMP || code[0] == OP_JUMP_IF_FALSE) {
+      targets[offset + 3 + ((code[1] << 8) | code[2])] = true;
+    } else if (code[0] == OP_LOOP) {
+      targets[offset + 3 - ((code[1] << 8) | code[2])] = true;
+    }
+  }
+
+  Chunk out;
+  initChunk(&out);
+  LineReader lines;
+  initLineReader(&lines, chunk);
+  // where every old instruction ended up, for the jump fix up
+  int *moved = malloc(sizeof(int) * (chunk->count + 1));
+  int offset = 0;
+  while (offset < chunk->count) {
+    moved[offset] = out.count;
+    int line = readLine(&lines, offset);
+    uint8_t a, b;
+    bool aConstant, bConstant;
+    if (readOperand(chunk, offset, &a, &aConstant)) {
+      int next = offset + 2;
+      // a <op> b, stored into a local when followed by SET_LOCAL + POP
+      if (!targets[next] && readOperand(chunk, next, &b, &bConstant) &&
+          next + 2 < chunk->count && !targets[next + 2] &&
+          registerOp(chunk->code[next + 2]) >= 0) {
+        int op = registerOp(chunk->code[next + 2]);
+        uint8_t kinds = (aConstant ? REG_A_CONSTANT : 0) |
+                        (bConstant ? REG_B_CONSTANT : 0);
+        uint8_t dst = 0;
+        int end = next + 3;
+        if (plain(chunk, targets, end, OP_SET_LOCAL) &&
+            plain(chunk, targets, end + 2, OP_POP)) {
+          dst = chunk->code[end + 1];
+          end += 3;
+        } else {
+          kinds |= REG_PUSH;
+        }
+        writeChunk(&out, op, line);
+        writeChunk(&out, kinds, line);
+        writeChunk(&out, dst, line);
+        writeChunk(&out, a, line);
+        writeChunk(&out, b, line);
+        offset = end;
+        continue;
+      }
+      // local = a;
+      if (plain(chunk, targets, next, OP_SET_LOCAL) &&
+          plain(chunk, targets, next + 2, OP_POP)) {
+        writeChunk(&out, OP_MOVE_R, line);
+        writeChunk(&out, aConstant ? REG_A_CONSTANT : 0, line);
+        writeChunk(&out, chunk->code[next + 1], line);
+        writeChunk(&out, a, line);
+        offset = next + 3;
+        continue;
+      }
+    }
+    int length = instructionLength(chunk, offset);
+    for (int i = 0; i < length; i++) {
+      writeChunk(&out, chunk->code[offset + i], readLine(&lines, offset + i));
+    }
+    offset += length;
+  }
+  moved[chunk->count] = out.count;
+
+  // jumps only ever land on the start of something that got copied or
+  // rewritten, so the new distances can be read off `moved`
+  for (int old = 0; old < chunk->count; old += instructionLength(chunk, old)) {
+    uint8_t *code = chunk->code + old;
+    if (code[0] != OP_JUMP && code[0] != OP_JUMP_IF_FALSE &&
+        code[0] != OP_LOOP)
+      continue;
+    int at = moved[old];
+    uint16_t jump = (uint16_t)((code[1] << 8) | code[2]);
+    int distance = code[0] == OP_LOOP
+                       ? at + 3 - moved[old + 3 - jump]
+                       : moved[old + 3 + jump] - (at + 3);
+    out.code[at + 1] = (distance >> 8) & 0xff;
+    out.code[at + 2] = distance & 0xff;
+  }
+
+  // the constants stay, everything else is out's
+  ValueArray constants = chunk->constants;
+  freeValueArray(&out.constants);
+  out.constants = constants;
+  free(chunk->code);
+  free(chunk->lines);
+  *chunk = out;
+  free(moved);
+  free(targets);
+}
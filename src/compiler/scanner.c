@@ -2,21 +2,32 @@
 #include "../../include/common.h"
 #include <stdio.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 typedef struct {
   const char *start;
   const char *current;
+  const char *end; // the '\0', so the 16 byte loads know where to stop
   int line;
 
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 void initScanner(const char *source) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + strlen(source);
   scanner.line = 1;
 }
+void resumeScanner(const char *at, const char *end, int line) {
+  scanner.start = at;
+  scanner.current = at;
+  scanner.end = end;
+  scanner.line = line;
+}
 
 static bool isAtEnd() { return *(scanner.current) == '\0'; }
 static Token makeToken(TokenType type) {
@@ -56,6 +67,47 @@ static char peekNext() {
                  // anymore
   return *(scanner.current + 1);
 }
+// whitespace, identifier and string bodies get looked at 16 bytes at a
+// time with SSE2: compare the block against what we're after, movemask it
+// into 16 bits, and the first bit that's off is where the run stops. The
+// plain loops after each one finish the last <16 bytes (and are all there is
+// without SSE2)
+#ifdef __SSE2__
+static inline __m128i load16(const char *p) {
+  return _mm_loadu_si128((const __m128i *)p);
+}
+static inline int bytesEqual(__m128i chunk, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
+}
+// signed compares, which is fine since nothing we look for is past 0x7f
+static inline __m128i inRange(__m128i chunk, char low, char high) {
+  return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1)),
+                       _mm_cmplt_epi8(chunk, _mm_set1_epi8(high + 1)));
+}
+#endif
+
+// blank runs long enough to bother with are the indentation (and empty
+// lines) after a newline, between tokens it's nearly always one space and
+// the switch below is quicker for that
+static void skipIndentation() {
+#ifdef __SSE2__
+  while (scanner.end - scanner.current >= 16) {
+    __m128i chunk = load16(scanner.current);
+    int newlines = bytesEqual(chunk, '\n');
+    int blanks = bytesEqual(chunk, ' ') | bytesEqual(chunk, '\t') |
+                 bytesEqual(chunk, '\r') | newlines;
+    int run = __builtin_ctz(~blanks); // 16 when it's all blanks
+    if (newlines & ((1 << run) - 1)) {
+      scanner.line += __builtin_popcount(newlines & ((1 << run) - 1));
+    }
+    scanner.current += run;
+    if (run < 16) {
+      return;
+    }
+  }
+#endif
+}
+
 static void skipWhitespace() {
   while (true) {
     char c = peek();
@@ -68,137 +120,84 @@ static void skipWhitespace() {
     case '\n':
       scanner.line++;
       advance();
+      skipIndentation();
       break;
-    case '#': // for comments
-      advance();
-      while (peek() != '\n' && !isAtEnd()) {
-        advance();
-      }
+    case '#': { // for comments, libc's memchr finds the end of the line
+      const char *newline =
+          memchr(scanner.current, '\n', scanner.end - scanner.current);
+      scanner.current = newline == NULL ? scanner.end : newline;
       break;
+    }
 
     default:
       return;
     }
   }
 }
-static TokenType checkKeyword(int start, int length, const char *rest,
-                              TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
-  return TOKEN_IDENTIFIER;
-}
-static TokenType saasType() {
-  switch (scanner.start[0]) {
-  case 'a':
-    return checkKeyword(1, 6, "gentic", TOKEN_FOR);
-  case 'b': {
-    if ((scanner.current - scanner.start) > 1) {
-      switch (scanner.start[1]) {
-      case '2':
-        return checkKeyword(2, 1, "b", TOKEN_WHILE);
-      case 'l':
-        return checkKeyword(2, 8, "ockchain", TOKEN_NULL);
-      case 'o':
-        return checkKeyword(2, 7, "otstrap", TOKEN_VAR);
-      case 'u':
-        return checkKeyword(2, 5, "rnout", TOKEN_FALSE);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
-      return TOKEN_IDENTIFIER;
-    }
-  }
 
-  case 'd':
-    return checkKeyword(1, 6, "isrupt", TOKEN_IF);
-  case 'l':
-    return checkKeyword(1, 7, "everage", TOKEN_PRINT);
-  case 'm':
-    return checkKeyword(1, 2, "vp", TOKEN_FUN);
-  case 'p':
-    return checkKeyword(1, 4, "ivot", TOKEN_ELSE);
-  case 's':
+typedef struct {
+  const char *name;
+  int length;
+  TokenType type;
+} Keyword;
 
-    if ((scanner.current - scanner.start) > 1) {
-      switch (scanner.start[1]) {
-      case 'a':
-        return checkKeyword(2, 2, "as", TOKEN_RETURN);
-      case 'c':
-        return checkKeyword(2, 3, "ale", TOKEN_OR);
-      case 'y':
-        return checkKeyword(2, 5, "nergy", TOKEN_AND);
-      deafult:
-        return TOKEN_IDENTIFIER;
-      }
-    }
-    return TOKEN_IDENTIFIER;
+// a perfect hash over both keyword sets: the first two characters and the
+// length put every keyword in its own slot, so telling a keyword from an
+// identifier is one lookup and one memcmp. The multipliers came from trying
+// all pairs under 64 until nothing collided, the layout below has to be
+// redone if a keyword changes. start[1] of a one letter identifier is
+// whatever comes after it, which is fine, the length check throws it out
+#define KEYWORD_SLOT(start, length)                                            \
+  (((uint8_t)(start)[0] * 23 + (uint8_t)(start)[1] * 30 + (length)) & 31)
+
+#ifdef SAAS_MODE
+static const Keyword keywords[32] = {
+    [0] = {"blockchain", 10, TOKEN_NULL}, [2] = {"mvp", 3, TOKEN_FUN},
+    [3] = {"pivot", 5, TOKEN_ELSE},       [10] = {"synergy", 7, TOKEN_AND},
+    [11] = {"burnout", 7, TOKEN_FALSE},   [13] = {"b2b", 3, TOKEN_WHILE},
+    [14] = {"unicorn", 7, TOKEN_TRUE},    [16] = {"agentic", 7, TOKEN_FOR},
+    [17] = {"disrupt", 7, TOKEN_IF},      [18] = {"leverage", 8, TOKEN_PRINT},
+    [20] = {"scale", 5, TOKEN_OR},        [23] = {"saas", 4, TOKEN_RETURN},
+    [25] = {"bootstrap", 9, TOKEN_VAR},
+};
+#else
+static const Keyword keywords[32] = {
+    [0] = {"this", 4, TOKEN_THIS},     [3] = {"fun", 3, TOKEN_FUN},
+    [5] = {"if", 2, TOKEN_IF},         [6] = {"while", 5, TOKEN_WHILE},
+    [12] = {"true", 4, TOKEN_TRUE},    [13] = {"false", 5, TOKEN_FALSE},
+    [15] = {"for", 3, TOKEN_FOR},      [16] = {"super", 5, TOKEN_SUPER},
+    [17] = {"print", 5, TOKEN_PRINT},  [18] = {"class", 5, TOKEN_CLASS},
+    [23] = {"or", 2, TOKEN_OR},        [26] = {"return", 6, TOKEN_RETURN},
+    [27] = {"var", 3, TOKEN_VAR},      [28] = {"null", 4, TOKEN_NULL},
+    [30] = {"and", 3, TOKEN_AND},      [31] = {"else", 4, TOKEN_ELSE},
+};
+#endif
 
-  case 'u':
-    return checkKeyword(1, 6, "nicorn", TOKEN_TRUE);
-  default:
-    return TOKEN_IDENTIFIER;
+static TokenType identifierType() {
+  int length = (int)(scanner.current - scanner.start);
+  const Keyword *keyword = &keywords[KEYWORD_SLOT(scanner.start, length)];
+  if (keyword->length == length &&
+      memcmp(scanner.start, keyword->name, length) == 0) {
+    return keyword->type;
   }
+  return TOKEN_IDENTIFIER;
 }
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-  case 'a':
-    return checkKeyword(1, 2, "nd", TOKEN_AND);
-  case 'c':
-    return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-  case 'e':
-    return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-  case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
-  case 'n':
-    return checkKeyword(1, 3, "ull", TOKEN_NULL);
-  case 'o':
-    return checkKeyword(1, 1, "r", TOKEN_OR);
-  case 'p':
-    return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r':
-    return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-  case 's':
-    return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-  case 'v':
-    return checkKeyword(1, 2, "ar", TOKEN_VAR);
-  case 'w':
-    return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  case 'f': {
-    if ((scanner.current - scanner.start) > 1) {
-      switch (scanner.start[1]) {
-      case 'a':
-        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-      case 'o':
-        return checkKeyword(2, 1, "r", TOKEN_FOR);
-      case 'u':
-        return checkKeyword(2, 1, "n", TOKEN_FUN);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
-      return TOKEN_IDENTIFIER;
+static Token string() {
+#ifdef __SSE2__
+  while (scanner.end - scanner.current >= 16) {
+    __m128i chunk = load16(scanner.current);
+    int quotes = bytesEqual(chunk, '"');
+    int newlines = bytesEqual(chunk, '\n');
+    int run = __builtin_ctz(quotes | 0x10000);
+    if (newlines & ((1 << run) - 1)) {
+      scanner.line += __builtin_popcount(newlines & ((1 << run) - 1));
     }
-    return TOKEN_IDENTIFIER;
-  }
-  case 't': {
-    if ((scanner.current - scanner.start) > 1) {
-      switch (scanner.start[1]) {
-      case 'h':
-        return checkKeyword(2, 2, "is", TOKEN_THIS);
-      case 'r':
-        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-      default:
-        return TOKEN_IDENTIFIER;
-      }
+    scanner.current += run;
+    if (run < 16) {
+      break;
     }
-    return TOKEN_IDENTIFIER;
-  }
-  default:
-    return TOKEN_IDENTIFIER;
   }
-}
-static Token string() {
+#endif
   while (peek() != '"' && !isAtEnd()) {
     if (peek() == '\n')
       scanner.line++;
@@ -231,16 +230,35 @@ static bool isAlpha(char c) {
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek()))
+#ifdef __SSE2__
+  // most names are short enough that the plain loop is done before the
+  // vector one would've paid for itself
+  for (int i = 0; i < 12; i++) {
+    if (!isAlpha(peek()) && !isDigit(peek())) {
+      return makeToken(identifierType());
+    }
     advance();
-#ifdef SAAS_MODE
-  return makeToken(saasType());
-#endif
-#ifndef SAAS_MODE
-  return makeToken(identifierType());
+  }
+  while (scanner.end - scanner.current >= 16) {
+    __m128i chunk = load16(scanner.current);
+    // or-ing in 0x20 folds A-Z onto a-z and doesn't move anything else in
+    __m128i letters =
+        inRange(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+    int word = _mm_movemask_epi8(
+                   _mm_or_si128(letters, inRange(chunk, '0', '9'))) |
+               bytesEqual(chunk, '_');
+    int run = __builtin_ctz(~word);
+    scanner.current += run;
+    if (run < 16) {
+      break;
+    }
+  }
 #endif
+  while (isAlpha(peek()) || isDigit(peek()))
+    advance();
   // => what the fuck idk why not just return TOKEN_IDENTIFIER
   // maybe for reserved words or user made identifiers(i.e. variables)
+  return makeToken(identifierType());
 }
 
 Token scanToken() {
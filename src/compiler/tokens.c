@@ -0,0 +1,128 @@
+#include "../../include/compiler/tokens.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define RING_SIZE 4096 // a power of two so the indexes just get masked
+// how many tokens either side gets through before telling the other one,
+// keeps the two cores from passing head and tail back and forth every token
+#define BATCH 64
+
+typedef struct {
+  Token tokens[RING_SIZE];
+  // head and tail only ever go up, they get masked on the way in, each on
+  // its own cache line
+  _Alignas(64) atomic_size_t head; // written by the scanner thread
+  _Alignas(64) atomic_size_t tail; // written by the compiler
+  _Alignas(64) atomic_bool stop;
+  const char *source;
+} TokenRing;
+
+// per thread, two vms can be compiling at once. The ring only exists while
+// a scanner thread does, it's too big to give every thread one
+static _Thread_local TokenRing *ring;
+static _Thread_local pthread_t scannerThread;
+static _Thread_local bool threaded = false;
+
+// the compiler's side
+static _Thread_local size_t tail;
+static _Thread_local size_t knownHead;
+static _Thread_local Token eof; // handed out again if it asks past the end
+static _Thread_local bool ended;
+
+// the scanner thread has its own scanner, the ring comes in as its argument
+static void *scanAhead(void *argument) {
+  TokenRing *ring = argument;
+  initScanner(ring->source);
+  size_t head = 0;
+  size_t knownTail = 0;
+  while (true) {
+    Token token = scanToken();
+    if (head - knownTail == RING_SIZE) {
+      atomic_store_explicit(&ring->head, head, memory_order_release);
+      while ((knownTail = atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire)) ==
+             head - RING_SIZE) {
+        if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) {
+          return NULL;
+        }
+        sched_yield();
+      }
+    }
+    ring->tokens[head & (RING_SIZE - 1)] = token;
+    head++;
+    if (token.type == TOKEN_EOF || head % BATCH == 0) {
+      atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+    if (token.type == TOKEN_EOF) {
+      return NULL;
+    }
+  }
+}
+
+void startTokens(const char *source, bool useThread) {
+  // with one core the two threads would just take turns through
+  // sched_yield(), which is slower than not having a thread at all
+  threaded = useThread && sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  if (!threaded) {
+    initScanner(source);
+    return;
+  }
+  ring = aligned_alloc(64, sizeof(TokenRing));
+  ring->source = source;
+  atomic_store(&ring->head, 0);
+  atomic_store(&ring->tail, 0);
+  atomic_store(&ring->stop, false);
+  tail = 0;
+  knownHead = 0;
+  ended = false;
+  if (pthread_create(&scannerThread, NULL, scanAhead, ring) != 0) {
+    threaded = false; // no thread, scan inline like usual
+    free(ring);
+    ring = NULL;
+    initScanner(source);
+  }
+}
+
+void resumeTokens(const char *at, const char *end, int line) {
+  threaded = false;
+  resumeScanner(at, end, line);
+}
+
+Token nextToken() {
+  if (!threaded) {
+    return scanToken();
+  }
+  if (ended) {
+    return eof;
+  }
+  while (tail == knownHead) {
+    knownHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == knownHead) {
+      sched_yield();
+    }
+  }
+  Token token = ring->tokens[tail & (RING_SIZE - 1)];
+  tail++;
+  if (tail % BATCH == 0) {
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+  if (token.type == TOKEN_EOF) {
+    ended = true;
+    eof = token;
+  }
+  return token;
+}
+
+void stopTokens() {
+  if (!threaded) {
+    return;
+  }
+  atomic_store_explicit(&ring->stop, true, memory_order_relaxed);
+  pthread_join(scannerThread, NULL);
+  free(ring);
+  ring = NULL;
+  threaded = false;
+}
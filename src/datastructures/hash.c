@@ -0,0 +1,148 @@
+#include "../../include/datastructures/hash.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// wyhash's constants for the short paths, xxh3 style lanes for the long one
+#define SEED0 0xa0761d6478bd642full
+#define SEED1 0xe7037ed1a0b428dbull
+#define SEED2 0x8ebc6af09c88c6e3ull
+#define SEED3 0x589965cc75374cc3ull
+#define PRIME32 0x9e3779b1ull
+#define STRIPE 32
+#define STRIPES_PER_SCRAMBLE 16
+
+static const uint64_t lanes[4] = {0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull,
+                                  0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull};
+
+static inline uint64_t read64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+static inline uint64_t read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// 64x64 -> 128 bit multiply folded back into 64 bits
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t hashShort(const char *key, int length) {
+  uint64_t a = 0, b = 0;
+  if (length >= 8) { // 8..16, the two reads overlap when it's less than 16
+    a = read64(key);
+    b = read64(key + length - 8);
+  } else if (length >= 4) {
+    a = read32(key);
+    b = read32(key + length - 4);
+  } else if (length > 0) {
+    a = ((uint64_t)(uint8_t)key[0] << 16) |
+        ((uint64_t)(uint8_t)key[length >> 1] << 8) | (uint8_t)key[length - 1];
+  }
+  return mix(a ^ SEED1, b ^ SEED0 ^ (uint64_t)length);
+}
+
+static uint64_t hashMedium(const char *key, int length) {
+  uint64_t seed = SEED0 ^ (uint64_t)length;
+  const char *p = key;
+  int left = length;
+  while (left > 16) {
+    seed = mix(read64(p) ^ SEED1, read64(p + 8) ^ seed);
+    p += 16;
+    left -= 16;
+  }
+  // the last 16 bytes, overlapping what the loop already did
+  return mix(read64(key + length - 16) ^ SEED2,
+             read64(key + length - 8) ^ seed);
+}
+
+// every stripe adds lo32 * hi32 of (data ^ lane) into its lane and the raw
+// data into the neighbouring one, then every so often the lanes get
+// scrambled so nothing just cancels out
+#ifdef __SSE2__
+static void accumulate(uint64_t acc[4], const char *key, int stripes) {
+  __m128i acc0 = _mm_loadu_si128((const __m128i *)acc);
+  __m128i acc1 = _mm_loadu_si128((const __m128i *)(acc + 2));
+  const __m128i lane0 = _mm_loadu_si128((const __m128i *)lanes);
+  const __m128i lane1 = _mm_loadu_si128((const __m128i *)(lanes + 2));
+  const __m128i prime = _mm_set1_epi32((int)PRIME32);
+  for (int i = 0; i < stripes; i++) {
+    const char *p = key + i * STRIPE;
+    __m128i data0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i data1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i key0 = _mm_xor_si128(data0, lane0);
+    __m128i key1 = _mm_xor_si128(data1, lane1);
+    // swapping the 64 bit halves puts each lane's data next to its neighbour
+    acc0 = _mm_add_epi64(acc0, _mm_shuffle_epi32(data0, 0x4e));
+    acc1 = _mm_add_epi64(acc1, _mm_shuffle_epi32(data1, 0x4e));
+    acc0 = _mm_add_epi64(acc0, _mm_mul_epu32(key0, _mm_srli_epi64(key0, 32)));
+    acc1 = _mm_add_epi64(acc1, _mm_mul_epu32(key1, _mm_srli_epi64(key1, 32)));
+    if ((i + 1) % STRIPES_PER_SCRAMBLE == 0) {
+      // acc = (acc ^ acc >> 47 ^ lane) * PRIME32, the 64 bit multiply done
+      // as two 32 bit halves
+      acc0 = _mm_xor_si128(acc0, _mm_srli_epi64(acc0, 47));
+      acc1 = _mm_xor_si128(acc1, _mm_srli_epi64(acc1, 47));
+      acc0 = _mm_xor_si128(acc0, lane1);
+      acc1 = _mm_xor_si128(acc1, lane0);
+      acc0 = _mm_add_epi64(
+          _mm_mul_epu32(acc0, prime),
+          _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc0, 32), prime), 32));
+      acc1 = _mm_add_epi64(
+          _mm_mul_epu32(acc1, prime),
+          _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(acc1, 32), prime), 32));
+    }
+  }
+  _mm_storeu_si128((__m128i *)acc, acc0);
+  _mm_storeu_si128((__m128i *)(acc + 2), acc1);
+}
+#else
+static void accumulate(uint64_t acc[4], const char *key, int stripes) {
+  for (int i = 0; i < stripes; i++) {
+    const char *p = key + i * STRIPE;
+    for (int lane = 0; lane < 4; lane++) {
+      uint64_t data = read64(p + lane * 8);
+      uint64_t keyed = data ^ lanes[lane];
+      acc[lane ^ 1] += data;
+      acc[lane] += (keyed & 0xffffffff) * (keyed >> 32);
+    }
+    if ((i + 1) % STRIPES_PER_SCRAMBLE == 0) {
+      for (int lane = 0; lane < 4; lane++) {
+        acc[lane] ^= acc[lane] >> 47;
+        acc[lane] ^= lanes[lane ^ 2];
+        acc[lane] *= PRIME32;
+      }
+    }
+  }
+}
+#endif
+
+static uint64_t hashLong(const char *key, int length) {
+  uint64_t acc[4] = {SEED0, SEED1, SEED2, SEED3};
+  accumulate(acc, key, length / STRIPE);
+  uint64_t h = mix(acc[0] ^ SEED2, acc[1] ^ SEED3) ^
+               mix(acc[2] ^ SEED0, acc[3] ^ SEED1) ^ (uint64_t)length;
+  // whatever didn't fill a stripe, the last 16 bytes overlap the stripes
+  // when there's less than that left
+  for (int at = length - length % STRIPE; at + 16 < length; at += 16) {
+    h = mix(read64(key + at) ^ SEED1, read64(key + at + 8) ^ h);
+  }
+  return mix(read64(key + length - 16) ^ SEED2, read64(key + length - 8) ^ h);
+}
+
+uint32_t hashString(const char *key, int length) {
+  uint64_t h;
+  if (length <= 16) {
+    h = hashShort(key, length);
+  } else if (length <= 128) {
+    h = hashMedium(key, length);
+  } else {
+    h = hashLong(key, length);
+  }
+  return (uint32_t)(h ^ (h >> 32));
+}
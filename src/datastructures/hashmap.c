@@ -1,32 +1,26 @@
 #include "../../include/bytecode/object.h"
 #include "../../include/bytecode/value.h"
-#include <math.h>
 #include "../../include/memory.h"
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include "../../include/datastructures/hashmap.h"
-#define PRIME 151
 #define BASE_SIZE 32
+#define MAX_LOAD 0.7
 
 static Entry DELETED_ENTRY = {.key = NULL, .value = 0};
+// shared by every vm's tables, whichever thread they're on
+static atomic_int generations = 0;
 void initTable(Table *table)
 {
+    // growing, freeing and deleting all go through here or bump it themselves,
+    // so an Entry* cached with the old generation is never used again
+    table->generation = atomic_fetch_add(&generations, 1) + 1;
 
     table->capacity = 0;
     table->count = 0;
     table->entries = NULL;
 }
-static int hash(const char *string, const int prime, const int capacity)
-{
-    long hash = 0;
-    int len = strlen(string);
-    for (int i = 0; i < len; i++)
-    {
-        hash += (int)pow(prime, (len - i - 1)) * string[i];
-        hash = hash % capacity;
-    }
-    return hash;
-}
 void freeTable(Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
@@ -40,6 +34,7 @@ void freeTable(Table *table)
     free(table->entries);
     initTable(table);
 }
+// hash is hashString(key, length), StringObjs carry theirs around in ->hash
 Entry *lookUp(Table *table, char*key,  uint32_t hash, int length) // returns the index
 {
     if (table->capacity == 0){
@@ -130,7 +125,9 @@ bool set(Table *table, Value value, StringObj *key)
         lookup->value = value;
         return false;
     }
-    if ((table->count / table->capacity) > 0.7)
+    // a double compare, count / capacity on ints stayed 0 until the table
+    // was completely full
+    if (table->count + 1 > table->capacity * MAX_LOAD)
     {
         growTable(table, table->capacity * 2);
     }
@@ -159,8 +156,9 @@ bool delete_entry(Table *table, StringObj *key)
     free(temp_ptr);
     table->entries[index] = &(DELETED_ENTRY);
     table->count--;
+    table->generation = atomic_fetch_add(&generations, 1) + 1;
     // NOW RESIZE DOWN IF COUNT IS SMALLER THAN 10%
-    if ((table->count / table->capacity) < 0.1)
+    if (table->count < table->capacity * 0.1)
     {
         growTable(table, table->capacity / 2);
     }
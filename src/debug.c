@@ -9,6 +9,7 @@ static int simpleInstruction(const char *, int);
 static int jumpInstruction(const char *name, int sign, Chunk *chunk,
                            int offset);
 static int constantInstruction(const char *name, Chunk *chunk, int offset);
+static int registerInstruction(const char *name, Chunk *chunk, int offset);
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
   for (int offset = 0; offset < chunk->count;) {
@@ -18,13 +19,14 @@ void disassembleChunk(Chunk *chunk, const char *name) {
 }
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
 
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
-  u_int8_t instruction = chunk->code[offset];
+  uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
@@ -103,6 +105,22 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_JUMP", 1, chunk, offset);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+  case OP_ADD_R:
+    return registerInstruction("OP_ADD_R", chunk, offset);
+  case OP_SUBSTRACT_R:
+    return registerInstruction("OP_SUBSTRACT_R", chunk, offset);
+  case OP_MULITPLY_R:
+    return registerInstruction("OP_MULTIPLY_R", chunk, offset);
+  case OP_DIVIDE_R:
+    return registerInstruction("OP_DIVIDE_R", chunk, offset);
+  case OP_EQUAL_R:
+    return registerInstruction("OP_EQUAL_R", chunk, offset);
+  case OP_GREATER_R:
+    return registerInstruction("OP_GREATER_R", chunk, offset);
+  case OP_LESS_R:
+    return registerInstruction("OP_LESS_R", chunk, offset);
+  case OP_MOVE_R:
+    return registerInstruction("OP_MOVE_R", chunk, offset);
 
   default:
     printf("Unknowd opcode %d\n", instruction);
@@ -127,7 +145,7 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
 }
 
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
-  u_int8_t constant =
+  uint8_t constant =
       chunk->code[offset +
                   1]; // constant is the index of the constant we want ig
   printf("%-16s %4d => ", name, constant); // prints: OP_CONSTANT (some index)
@@ -135,4 +153,22 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   printf("\n");
   return offset + 2;
 }
+// prints as e.g. OP_ADD_R r3 = r1, k0 with push instead of a destination
+// when the result goes on the stack
+static int registerInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t kinds = chunk->code[offset + 1];
+  printf("%-16s ", name);
+  if (kinds & REG_PUSH) {
+    printf("push =");
+  } else {
+    printf("r%d =", chunk->code[offset + 2]);
+  }
+  printf(" %c%d", kinds & REG_A_CONSTANT ? 'k' : 'r', chunk->code[offset + 3]);
+  if (chunk->code[offset] != OP_MOVE_R) {
+    printf(", %c%d", kinds & REG_B_CONSTANT ? 'k' : 'r',
+           chunk->code[offset + 4]);
+  }
+  printf("\n");
+  return offset + instructionLength(chunk, offset);
+}
 // daily
@@ -0,0 +1,200 @@
+#include "../../include/io/files.h"
+#include "../../include/bytecode/object.h"
+#include "../../include/vm/vm.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// readLines() reads through a buffer this big no matter how big the file is
+#define READ_BUFFER_SIZE (64 * 1024)
+
+// the file's pages plus a page of zeros: the anonymous mapping reserves the
+// whole range and the file gets mapped over the front of it. Whatever's left
+// of the file's last page reads as zeros too
+static size_t mappedLength(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (size / page + 1) * page;
+}
+
+char *mapFile(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  size_t length = mappedLength(*size);
+  char *chars =
+      mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (chars == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  if (*size > 0 && mmap(chars, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+                        0) == MAP_FAILED) {
+    munmap(chars, length);
+    close(fd);
+    return NULL;
+  }
+  close(fd);
+  return chars;
+}
+
+void unmapFile(char *chars, size_t size) { munmap(chars, mappedLength(size)); }
+
+static bool checkPath(const char *native, int argCount, int expected,
+                      Value *args) {
+  if (argCount != expected) {
+    runtimeError("%s expects %d arguments but got %d.", native, expected,
+                 argCount);
+    return false;
+  }
+  if (!IS_STRING(args[0])) {
+    runtimeError("%s expects a path string.", native);
+    return false;
+  }
+  return true;
+}
+
+// paths go to open() and friends, which want them NUL terminated
+static char *pathOf(Value value) {
+  StringObj *string = PAYLOAD_STRING(value);
+  char *path = malloc(string->length + 1);
+  memcpy(path, flattenString(string), string->length);
+  path[string->length] = '\0';
+  return path;
+}
+
+// readAll(path), the whole file as one string
+static Value readAllNative(int argCount, Value *args) {
+  if (!checkPath("readAll", argCount, 1, args)) {
+    return NULL_VAL;
+  }
+  char *path = pathOf(args[0]);
+  size_t size;
+  char *mapped = mapFile(path, &size);
+  if (mapped == NULL) {
+    runtimeError("Could not read file \"%s\".", path);
+    free(path);
+    return NULL_VAL;
+  }
+  // a string's length is an int
+  if (size > INT_MAX) {
+    unmapFile(mapped, size);
+    runtimeError("File \"%s\" is too big for one string, use readLines().",
+                 path);
+    free(path);
+    return NULL_VAL;
+  }
+  free(path);
+  char *chars = malloc(size + 1);
+  memcpy(chars, mapped, size);
+  chars[size] = '\0';
+  unmapFile(mapped, size);
+  return OBJ_VAL(makeObjWithString(chars, (int)size));
+}
+
+static void closeReader(void *state) {
+  if (state != NULL) {
+    fclose((FILE *)state);
+  }
+}
+
+// what readLines() hands back: every call is the next line without its line
+// break, then NULL once the file's done. args[-1] is the callee, which is
+// where the open file lives
+static Value nextLineNative(int argCount, Value *args) {
+  ObjNative *reader = (ObjNative *)PAYLOAD_OBJ(args[-1]);
+  if (reader->state == NULL) {
+    return NULL_VAL;
+  }
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length = getline(&line, &capacity, (FILE *)reader->state);
+  if (length < 0) {
+    free(line);
+    closeReader(reader->state);
+    reader->state = NULL;
+    return NULL_VAL;
+  }
+  if (length > 0 && line[length - 1] == '\n') {
+    line[--length] = '\0';
+  }
+  if (length > 0 && line[length - 1] == '\r') {
+    line[--length] = '\0';
+  }
+  if (length > INT_MAX) {
+    free(line);
+    runtimeError("Line is too long for one string.");
+    return NULL_VAL;
+  }
+  return OBJ_VAL(makeObjWithString(line, (int)length));
+}
+
+// readLines(path), a function that returns the next line each time it's
+// called. The file gets read through a fixed buffer so any size works
+static Value readLinesNative(int argCount, Value *args) {
+  if (!checkPath("readLines", argCount, 1, args)) {
+    return NULL_VAL;
+  }
+  char *path = pathOf(args[0]);
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    runtimeError("Could not open file \"%s\".", path);
+    free(path);
+    return NULL_VAL;
+  }
+  free(path);
+  setvbuf(file, NULL, _IOFBF, READ_BUFFER_SIZE);
+  ObjNative *reader = newNative(nextLineNative);
+  reader->state = file;
+  reader->freeState = closeReader;
+  return OBJ_VAL(reader);
+}
+
+static Value writeWithMode(const char *native, const char *mode, int argCount,
+                           Value *args) {
+  if (!checkPath(native, argCount, 2, args)) {
+    return NULL_VAL;
+  }
+  if (!IS_STRING(args[1])) {
+    runtimeError("%s expects a string to write.", native);
+    return NULL_VAL;
+  }
+  char *path = pathOf(args[0]);
+  FILE *file = fopen(path, mode);
+  if (file == NULL) {
+    runtimeError("Could not open file \"%s\".", path);
+    free(path);
+    return NULL_VAL;
+  }
+  free(path);
+  StringObj *string = PAYLOAD_STRING(args[1]);
+  size_t written = fwrite(flattenString(string), 1, string->length, file);
+  bool ok = fclose(file) == 0 && written == (size_t)string->length;
+  return BOOL_VAL(ok);
+}
+
+// writeFile(path, s) and appendFile(path, s), true when it all got written
+static Value writeFileNative(int argCount, Value *args) {
+  return writeWithMode("writeFile", "wb", argCount, args);
+}
+static Value appendFileNative(int argCount, Value *args) {
+  return writeWithMode("appendFile", "ab", argCount, args);
+}
+
+void defineFileNatives() {
+  defineNative("readAll", readAllNative);
+  defineNative("readLines", readLinesNative);
+  defineNative("writeFile", writeFileNative);
+  defineNative("appendFile", appendFileNative);
+}
@@ -0,0 +1,99 @@
+#include "../../include/jit/assembler.h"
+#include "../../include/memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define HAS_MMAP
+#endif
+
+void initAssembler(Assembler *as) {
+  as->code = NULL;
+  as->count = 0;
+  as->capacity = 0;
+}
+void freeAssembler(Assembler *as) {
+  free(as->code);
+  initAssembler(as);
+}
+
+void emitArray(Assembler *as, const uint8_t *bytes, int length) {
+  if (as->capacity < as->count + length) {
+    int oldCapacity = as->capacity;
+    while (as->capacity < as->count + length) {
+      as->capacity = GROW_CAPACITY(as->capacity);
+    }
+    as->code = grow_array(sizeof(uint8_t), as->code, oldCapacity, as->capacity);
+  }
+  memcpy(as->code + as->count, bytes, length);
+  as->count += length;
+}
+void emit32(Assembler *as, uint32_t value) {
+  emitArray(as, (uint8_t *)&value, 4);
+}
+void emit64(Assembler *as, uint64_t value) {
+  emitArray(as, (uint8_t *)&value, 8);
+}
+
+static void emitPrefixes(Assembler *as, uint8_t prefix, bool wide,
+                         bool twoByte, uint8_t opcode, int reg, int rm) {
+  if (prefix != 0)
+    EMIT(as, prefix); // legacy prefix has to come before rex
+  uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+  if (rex != 0x40)
+    EMIT(as, rex);
+  if (twoByte)
+    EMIT(as, 0x0F);
+  EMIT(as, opcode);
+}
+void emitMemOp(Assembler *as, uint8_t prefix, bool wide, bool twoByte,
+               uint8_t opcode, int reg, int base, int32_t disp) {
+  emitPrefixes(as, prefix, wide, twoByte, opcode, reg, base);
+  EMIT(as, 0x80 | ((reg & 7) << 3) | (base & 7)); // mod = disp32
+  if ((base & 7) == RSP)
+    EMIT(as, 0x24); // rsp/r12 as a base need a sib byte
+  emit32(as, (uint32_t)disp);
+}
+void emitRegOp(Assembler *as, uint8_t prefix, bool wide, bool twoByte,
+               uint8_t opcode, int reg, int rm) {
+  emitPrefixes(as, prefix, wide, twoByte, opcode, reg, rm);
+  EMIT(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+void emitMovImm64(Assembler *as, int reg, uint64_t value) {
+  EMIT(as, 0x48 | (reg >= 8 ? 1 : 0), 0xB8 + (reg & 7));
+  emit64(as, value);
+}
+
+int emitJump(Assembler *as, int cc) {
+  if (cc == CC_ALWAYS) {
+    EMIT(as, 0xE9);
+  } else {
+    EMIT(as, 0x0F, 0x80 | cc);
+  }
+  emit32(as, 0);
+  return as->count - 4;
+}
+void patchJump(Assembler *as, int at, int target) {
+  int32_t rel = target - (at + 4);
+  memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+#ifdef HAS_MMAP
+void *finalizeCode(Assembler *as) {
+  void *memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+  memcpy(memory, as->code, as->count);
+  if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, as->count);
+    return NULL;
+  }
+  return memory;
+}
+void freeCode(void *code, size_t size) { munmap(code, size); }
+#else
+void *finalizeCode(Assembler *as) { return NULL; }
+void freeCode(void *code, size_t size) {}
+#endif
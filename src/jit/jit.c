@@ -0,0 +1,503 @@
+#include "../../include/jit/jit.h"
+#include "../../include/bytecode/object.h"
+#include "../../include/jit/assembler.h"
+#include "../../include/jit/trace.h"
+#include "../../include/memory.h"
+#include "../../include/output.h"
+#include "../../include/vm/vm.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X64
+#endif
+
+// what the generated code returns
+#define JIT_ERROR 0
+#define JIT_RETURNED 1
+#define JIT_BAIL 2 // left the frame to the interpreter at frame->ip
+typedef int (*JitFunction)(CallFrame *frame);
+
+#ifdef JIT_X64
+
+/*
+Register plan for the generated code (all callee saved so the C helpers
+leave them alone):
+  rbx = CallFrame *frame
+  r12 = &vm->stackTop
+  r13 = frame->slots
+rax/rcx/xmm0/xmm1 are scratch. A Value is 16 bytes, type at +0 and payload at
++8, so the top of the stack is [stackTop - 16] and the one below [stackTop - 32]
+*/
+#define TOP -16
+#define SECOND -32
+#define PAYLOAD 8
+
+typedef struct {
+  int at;     // position of the rel32 to patch
+  int target; // bytecode offset, or -1 for the error exit
+} Fixup;
+
+typedef struct {
+  Fixup *fixups;
+  int count;
+  int capacity;
+} FixupList;
+
+// jcc/jmp to a bytecode offset, the rel32 gets patched once all labels exist
+static void emitJumpTo(Assembler *as, FixupList *list, int target) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->fixups =
+        grow_array(sizeof(Fixup), list->fixups, oldCapacity, list->capacity);
+  }
+  list->fixups[list->count].at = as->count;
+  list->fixups[list->count].target = target;
+  list->count++;
+  emit32(as, 0);
+}
+// short forward jump inside a template, returns where to patch
+static int emitShortJump(Assembler *as, uint8_t opcode) {
+  EMIT(as, opcode, 0);
+  return as->count - 1;
+}
+static void patchShortJump(Assembler *as, int at) {
+  as->code[at] = (uint8_t)(as->count - at - 1);
+}
+
+static void loadStackTop(Assembler *as) {
+  EMIT(as, 0x49, 0x8B, 0x04, 0x24); // mov rax, [r12]
+}
+static void growStack(Assembler *as, int8_t bytes) {
+  EMIT(as, 0x49, 0x83, 0x04, 0x24, (uint8_t)bytes); // add qword [r12], bytes
+}
+static void shrinkStack(Assembler *as, int8_t bytes) {
+  EMIT(as, 0x49, 0x83, 0x2C, 0x24, (uint8_t)bytes); // sub qword [r12], bytes
+}
+static void callHelper(Assembler *as, void *helper) {
+  EMIT(as, 0x48, 0xB8); // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xFF, 0xD0); // call rax
+}
+// runtimeError() reads the line from frame->ip, so store it before anything
+// that can fail
+static void saveIp(Assembler *as, uint8_t *ip) {
+  EMIT(as, 0x48, 0xB8); // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)ip);
+  EMIT(as, 0x48, 0x89, 0x83); // mov [rbx + ip], rax
+  emit32(as, offsetof(CallFrame, ip));
+}
+static void argFrame(Assembler *as) {
+  EMIT(as, 0x48, 0x89, 0xDF); // mov rdi, rbx
+}
+static void argInt(Assembler *as, uint8_t reg, uint32_t value) {
+  EMIT(as, 0xB8 + reg); // mov edi/esi, imm32
+  emit32(as, value);
+}
+static void argPointer(Assembler *as, uint8_t reg, void *pointer) {
+  EMIT(as, 0x48, 0xB8 + reg); // mov rdi/rsi/rdx, imm64
+  emit64(as, (uint64_t)(uintptr_t)pointer);
+}
+// helpers return a bool, false goes to the error exit
+static void checkResult(Assembler *as, FixupList *list) {
+  EMIT(as, 0x84, 0xC0);       // test al, al
+  EMIT(as, 0x0F, 0x84);       // jz error
+  emitJumpTo(as, list, -1);
+}
+static void epilogue(Assembler *as) {
+  EMIT(as, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); // pop r13, r12, rbx; ret
+}
+
+static void pushValue(Assembler *as, Value value) {
+  uint64_t payload;
+  memcpy(&payload, &value.payload, sizeof(payload));
+  loadStackTop(as);
+  EMIT(as, 0xC7, 0x40, 0x00); // mov dword [rax], type
+  emit32(as, value.type);
+  EMIT(as, 0x48, 0xB9); // mov rcx, payload
+  emit64(as, payload);
+  EMIT(as, 0x48, 0x89, 0x48, PAYLOAD); // mov [rax + 8], rcx
+  growStack(as, sizeof(Value));
+}
+
+// jumps to the returned position if either operand isn't a number
+static void guardNumbers(Assembler *as, int *slowTop, int *slowSecond) {
+  loadStackTop(as);
+  EMIT(as, 0x83, 0x78, (uint8_t)TOP, VAL_NUMBER); // cmp dword [rax-16], num
+  *slowTop = emitShortJump(as, 0x75);              // jne slow
+  EMIT(as, 0x83, 0x78, (uint8_t)SECOND, VAL_NUMBER);
+  *slowSecond = emitShortJump(as, 0x75);
+}
+
+static bool numbersError() {
+  runtimeError("Operands have to be numbers.");
+  return false;
+}
+static bool addSlow() {
+  if (IS_STRING(vm->stackTop[-1]) && IS_STRING(vm->stackTop[-2])) {
+    concatenate();
+    return true;
+  }
+  runtimeError("Operands must be two numbers (addition) or two strings "
+               "(concatenation)");
+  return false;
+}
+
+// +, -, * and / on two numbers are done inline with sse2
+static void arithmetic(Assembler *as, FixupList *list, uint8_t sseOp,
+                       uint8_t *ip, void *slowPath) {
+  int slowTop, slowSecond;
+  guardNumbers(as, &slowTop, &slowSecond);
+  EMIT(as, 0xF2, 0x0F, 0x10, 0x40, (uint8_t)(SECOND + PAYLOAD)); // movsd xmm0
+  EMIT(as, 0xF2, 0x0F, sseOp, 0x40, (uint8_t)(TOP + PAYLOAD));   // op xmm0
+  EMIT(as, 0xF2, 0x0F, 0x11, 0x40, (uint8_t)(SECOND + PAYLOAD)); // movsd back
+  shrinkStack(as, sizeof(Value));
+  int done = emitShortJump(as, 0xEB);
+  patchShortJump(as, slowTop);
+  patchShortJump(as, slowSecond);
+  saveIp(as, ip);
+  callHelper(as, slowPath);
+  checkResult(as, list);
+  patchShortJump(as, done);
+}
+
+// < and >, the operands get swapped for < so that seta is false on NaN
+static void comparison(Assembler *as, FixupList *list, bool less,
+                       uint8_t *ip) {
+  int slowTop, slowSecond;
+  guardNumbers(as, &slowTop, &slowSecond);
+  EMIT(as, 0xF2, 0x0F, 0x10, 0x40, (uint8_t)(SECOND + PAYLOAD)); // xmm0 = a
+  EMIT(as, 0xF2, 0x0F, 0x10, 0x48, (uint8_t)(TOP + PAYLOAD));    // xmm1 = b
+  if (less) {
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC8); // ucomisd xmm1, xmm0
+  } else {
+    EMIT(as, 0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+  }
+  EMIT(as, 0x0F, 0x97, 0xC1);                    // seta cl
+  EMIT(as, 0x0F, 0xB6, 0xC9);                    // movzx ecx, cl
+  EMIT(as, 0xC7, 0x40, (uint8_t)SECOND);         // mov dword [rax-32], bool
+  emit32(as, VAL_BOOL);
+  EMIT(as, 0x48, 0x89, 0x48, (uint8_t)(SECOND + PAYLOAD)); // mov [rax-24], rcx
+  shrinkStack(as, sizeof(Value));
+  int done = emitShortJump(as, 0xEB);
+  patchShortJump(as, slowTop);
+  patchShortJump(as, slowSecond);
+  saveIp(as, ip);
+  callHelper(as, numbersError);
+  checkResult(as, list);
+  patchShortJump(as, done);
+}
+
+static void equalHelper() {
+  Value b = pop();
+  Value a = pop();
+  push(BOOL_VAL(isEqual(a, b)));
+}
+static void notHelper() {
+  Value last = pop();
+  push(BOOL_VAL(MAKE_NOT(last)));
+}
+static bool negateHelper() {
+  if (!IS_NUMBER(vm->stackTop[-1])) {
+    runtimeError("Operand must be a number.");
+    return false;
+  }
+  vm->stackTop[-1].payload.number *= -1;
+  return true;
+}
+static void printHelper() {
+  printValue(pop());
+  writeOutputChar('\n');
+}
+static void defineGlobalHelper(StringObj *name) {
+  set(&vm->globals, vm->stackTop[-1], name);
+  pop();
+}
+static void getUpvalueHelper(CallFrame *frame, int slot) {
+  push(*frame->closure->upvalues[slot]->location);
+}
+static void setUpvalueHelper(CallFrame *frame, int slot) {
+  *frame->closure->upvalues[slot]->location = vm->stackTop[-1];
+}
+static bool callHelperFn(int argCount) {
+  int frameCount = vm->frameCount;
+  if (!callOperand(argCount)) {
+    return false;
+  }
+  if (vm->frameCount == frameCount) {
+    return true; // native, already done
+  }
+  return runFrame();
+}
+
+static bool compileChunk(Assembler *as, ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  int *labels = malloc(sizeof(int) * (chunk->count + 1));
+  for (int i = 0; i <= chunk->count; i++) {
+    labels[i] = -1;
+  }
+  FixupList list = {NULL, 0, 0};
+
+  // prologue: push rbx, r12, r13 (keeps rsp 16 byte aligned for calls)
+  EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55);
+  EMIT(as, 0x48, 0x89, 0xFB); // mov rbx, rdi
+  EMIT(as, 0x49, 0xBC);       // mov r12, &vm->stackTop
+  emit64(as, (uint64_t)(uintptr_t)&vm->stackTop);
+  EMIT(as, 0x4C, 0x8B, 0xAB); // mov r13, [rbx + slots]
+  emit32(as, offsetof(CallFrame, slots));
+
+  bool ok = true;
+  int offset = 0;
+  while (ok && offset < chunk->count) {
+    labels[offset] = as->count;
+    uint8_t *code = chunk->code + offset;
+    uint8_t operand = offset + 1 < chunk->count ? code[1] : 0;
+    int length = 1;
+    switch (code[0]) {
+    case OP_CONSTANT:
+      pushValue(as, chunk->constants.values[operand]);
+      length = 2;
+      break;
+    case OP_NULL:
+      pushValue(as, NULL_VAL);
+      break;
+    case OP_TRUE:
+      pushValue(as, BOOL_VAL(true));
+      break;
+    case OP_FALSE:
+      pushValue(as, BOOL_VAL(false));
+      break;
+    case OP_POP:
+      shrinkStack(as, sizeof(Value));
+      break;
+    case OP_GET_LOCAL:
+      loadStackTop(as);
+      EMIT(as, 0xF3, 0x41, 0x0F, 0x6F, 0x85); // movdqu xmm0, [r13 + slot]
+      emit32(as, operand * sizeof(Value));
+      EMIT(as, 0xF3, 0x0F, 0x7F, 0x00); // movdqu [rax], xmm0
+      growStack(as, sizeof(Value));
+      length = 2;
+      break;
+    case OP_SET_LOCAL:
+      loadStackTop(as);
+      EMIT(as, 0xF3, 0x0F, 0x6F, 0x40, (uint8_t)TOP); // movdqu xmm0, [rax-16]
+      EMIT(as, 0xF3, 0x41, 0x0F, 0x7F, 0x85);         // movdqu [r13+slot], xmm0
+      emit32(as, operand * sizeof(Value));
+      length = 2;
+      break;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      argFrame(as);
+      argInt(as, RSI, operand);
+      callHelper(as, code[0] == OP_GET_UPVALUE ? (void *)getUpvalueHelper
+                                               : (void *)setUpvalueHelper);
+      length = 2;
+      break;
+    case OP_CLOSE_UPVALUE:
+      callHelper(as, closeTopUpvalue);
+      break;
+    case OP_DEFINE_GLOBAL:
+      argPointer(as, RDI, PAYLOAD_STRING(chunk->constants.values[operand]));
+      callHelper(as, defineGlobalHelper);
+      length = 2;
+      break;
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      saveIp(as, code + 2);
+      argPointer(as, RDI, PAYLOAD_STRING(chunk->constants.values[operand]));
+      callHelper(as, code[0] == OP_GET_GLOBAL ? (void *)getGlobal
+                                              : (void *)setGlobal);
+      checkResult(as, &list);
+      length = 2;
+      break;
+    case OP_EQUAL:
+      callHelper(as, equalHelper);
+      break;
+    case OP_GREATER:
+      comparison(as, &list, false, code + 1);
+      break;
+    case OP_LESS:
+      comparison(as, &list, true, code + 1);
+      break;
+    case OP_ADD:
+      arithmetic(as, &list, 0x58, code + 1, addSlow);
+      break;
+    case OP_SUBSTRACT:
+      arithmetic(as, &list, 0x5C, code + 1, numbersError);
+      break;
+    case OP_MULITPLY:
+      arithmetic(as, &list, 0x59, code + 1, numbersError);
+      break;
+    case OP_DIVIDE:
+      arithmetic(as, &list, 0x5E, code + 1, numbersError);
+      break;
+    case OP_NEGATE:
+      saveIp(as, code + 1);
+      callHelper(as, negateHelper);
+      checkResult(as, &list);
+      break;
+    case OP_NOT:
+      callHelper(as, notHelper);
+      break;
+    case OP_PRINT:
+      callHelper(as, printHelper);
+      break;
+    case OP_JUMP_IF_FALSE: {
+      int target = offset + 3 + (uint16_t)((code[1] << 8) | code[2]);
+      loadStackTop(as);
+      EMIT(as, 0x8B, 0x48, (uint8_t)TOP); // mov ecx, [rax-16]
+      EMIT(as, 0x83, 0xF9, VAL_NULL);     // cmp ecx, VAL_NULL
+      EMIT(as, 0x0F, 0x84);               // je target
+      emitJumpTo(as, &list, target);
+      EMIT(as, 0x83, 0xF9, VAL_BOOL); // cmp ecx, VAL_BOOL
+      int truthy = emitShortJump(as, 0x75);
+      EMIT(as, 0x80, 0x78, (uint8_t)(TOP + PAYLOAD), 0x00); // cmp byte, 0
+      EMIT(as, 0x0F, 0x84);                                 // je target
+      emitJumpTo(as, &list, target);
+      patchShortJump(as, truthy);
+      length = 3;
+      break;
+    }
+    case OP_JUMP:
+      EMIT(as, 0xE9);
+      emitJumpTo(as, &list, offset + 3 + (uint16_t)((code[1] << 8) | code[2]));
+      length = 3;
+      break;
+    case OP_LOOP: {
+      // back edges check in with the trace jit, which may want the rest of
+      // this call in the interpreter (to record, or after running a trace)
+      uint8_t *header = code + 3 - (uint16_t)((code[1] << 8) | code[2]);
+      saveIp(as, header);
+      argFrame(as);
+      callHelper(as, traceLoop);
+      EMIT(as, 0x84, 0xC0); // test al, al
+      EMIT(as, 0x0F, 0x84); // jz header
+      emitJumpTo(as, &list, header - chunk->code);
+      EMIT(as, 0xB8, JIT_BAIL, 0x00, 0x00, 0x00); // mov eax, JIT_BAIL
+      epilogue(as);
+      length = 3;
+      break;
+    }
+    case OP_CALL:
+      saveIp(as, code + 2);
+      argInt(as, RDI, operand);
+      callHelper(as, callHelperFn);
+      checkResult(as, &list);
+      length = 2;
+      break;
+    case OP_CLOSURE: {
+      ObjFunction *inner = PAYLOAD_FUNCTION(chunk->constants.values[operand]);
+      argFrame(as);
+      argPointer(as, RSI, inner);
+      argPointer(as, RDX, code + 2);
+      callHelper(as, makeClosure);
+      length = 2 + inner->upvalueCount * 2;
+      break;
+    }
+    case OP_RETURN:
+      callHelper(as, returnFrame);
+      EMIT(as, 0xB8, JIT_RETURNED, 0x00, 0x00, 0x00); // mov eax, JIT_RETURNED
+      epilogue(as);
+      break;
+    case OP_ARRAY:
+      argInt(as, RDI, operand);
+      callHelper(as, makeArray);
+      length = 2;
+      break;
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+      saveIp(as, code + 1);
+      callHelper(as, code[0] == OP_GET_INDEX ? (void *)getIndex
+                                             : (void *)setIndex);
+      checkResult(as, &list);
+      break;
+    case OP_GET_PROPERTY:
+      saveIp(as, code + 2);
+      argPointer(as, RDI, PAYLOAD_STRING(chunk->constants.values[operand]));
+      callHelper(as, getProperty);
+      checkResult(as, &list);
+      length = 2;
+      break;
+    default:
+      ok = false; // unknown opcode, leave it to the interpreter
+      break;
+    }
+    offset += length;
+  }
+  labels[chunk->count] = as->count;
+
+  // error exit: return false with the stack already reset by runtimeError()
+  int errorExit = as->count;
+  EMIT(as, 0x31, 0xC0); // xor eax, eax (JIT_ERROR)
+  epilogue(as);
+
+  for (int i = 0; ok && i < list.count; i++) {
+    Fixup *fixup = &list.fixups[i];
+    int target = fixup->target == -1 ? errorExit
+                 : fixup->target >= 0 && fixup->target <= chunk->count
+                     ? labels[fixup->target]
+                     : -1;
+    if (target == -1) {
+      ok = false; // jump into the middle of an instruction
+      break;
+    }
+    int32_t rel = target - (fixup->at + 4);
+    memcpy(as->code + fixup->at, &rel, sizeof(rel));
+  }
+  free(list.fixups);
+  free(labels);
+  return ok;
+}
+
+static bool jitCompile(ObjFunction *function) {
+  Assembler as;
+  initAssembler(&as);
+  void *code = compileChunk(&as, function) ? finalizeCode(&as) : NULL;
+  if (code != NULL) {
+    function->jitCode = code;
+    function->jitSize = as.count;
+  }
+  freeAssembler(&as);
+  return code != NULL;
+}
+
+bool jitAvailable() { return sizeof(Value) == 16; }
+
+bool jitHot(ObjFunction *function) {
+  if (function->jitCode != NULL)
+    return true;
+  if (function->callCount >= JIT_THRESHOLD)
+    return false; // already tried and couldn't compile it
+  if (++function->callCount < JIT_THRESHOLD)
+    return false;
+  return jitCompile(function);
+}
+
+bool jitEnter(CallFrame *frame) {
+  JitFunction code = (JitFunction)frame->closure->function->jitCode;
+  int status = code(frame);
+  if (status == JIT_BAIL) {
+    return resumeFrame();
+  }
+  return status == JIT_RETURNED;
+}
+
+void jitFree(ObjFunction *function) {
+  if (function->jitCode != NULL) {
+    freeCode(function->jitCode, function->jitSize);
+    function->jitCode = NULL;
+  }
+}
+
+#else
+
+// no x86-64: --jit is accepted but everything stays in run()
+bool jitAvailable() { return false; }
+bool jitHot(ObjFunction *function) { return false; }
+bool jitEnter(CallFrame *frame) { return false; }
+void jitFree(ObjFunction *function) {}
+
+#endif
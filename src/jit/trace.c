@@ -0,0 +1,809 @@
+#include "../../include/jit/trace.h"
+#include "../../include/bytecode/object.h"
+#include "../../include/jit/assembler.h"
+#include "../../include/memory.h"
+#include "../../include/vm/vm.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_BUCKETS 64
+#define TRACE_MAX_GLOBALS 16
+#define TRACE_MAX_ATTEMPTS 3
+// xmm0-xmm13 hold the expression stack, xmm14/xmm15 are scratch
+#define TRACE_MAX_DEPTH 14
+#define SCRATCH 15
+
+typedef enum { T_NUMBER, T_BOOL, T_ARRAY, T_OTHER } TraceType;
+
+typedef struct {
+  uint8_t *ip;
+  TraceType type; // what a load produced
+  bool taken;     // OP_JUMP_IF_FALSE went to its target
+} TraceStep;
+
+typedef struct Trace {
+  uint8_t *header;
+  struct Trace *next; // bucket chain
+  int hotness;
+  int attempts; // recordings that got aborted
+  int misses;   // entries refused by the entry guards
+  bool blacklisted;
+  int base; // stack slots in use at the header, anything above is virtual
+  void *code;
+  size_t codeSize;
+  StringObj *globals[TRACE_MAX_GLOBALS]; // looked up on every entry
+  int globalCount;
+} Trace;
+
+// returns the exit ip, or the header if the entry guards failed
+typedef uint8_t *(*TraceFunction)(Value *slots, Entry **globals);
+
+typedef struct {
+  Trace *trace;
+  int frame;
+  int base;
+  TraceStep steps[TRACE_MAX_LENGTH];
+  int count;
+} Recorder;
+
+// every vm has its own, hung off vm->tracer the first time a loop gets hot
+typedef struct Tracer {
+  Trace *traces[TRACE_BUCKETS];
+  Recorder recorder;
+} Tracer;
+
+static Tracer *currentTracer() {
+  if (vm->tracer == NULL) {
+    vm->tracer = calloc(1, sizeof(Tracer));
+  }
+  return vm->tracer;
+}
+
+static Trace *findTrace(uint8_t *header) {
+  Tracer *tracer = currentTracer();
+  int bucket = ((uintptr_t)header >> 2) % TRACE_BUCKETS;
+  for (Trace *trace = tracer->traces[bucket]; trace != NULL; trace = trace->next) {
+    if (trace->header == header)
+      return trace;
+  }
+  Trace *trace = malloc(sizeof(Trace));
+  trace->header = header;
+  trace->next = tracer->traces[bucket];
+  trace->hotness = 0;
+  trace->attempts = 0;
+  trace->misses = 0;
+  trace->blacklisted = false;
+  trace->code = NULL;
+  trace->codeSize = 0;
+  trace->globalCount = 0;
+  trace->base = 0;
+  tracer->traces[bucket] = trace;
+  return trace;
+}
+
+static TraceType typeOf(Value value) {
+  if (IS_NUMBER(value))
+    return T_NUMBER;
+  if (IS_BOOL(value))
+    return T_BOOL;
+  if (IS_ARRAY(value))
+    return T_ARRAY;
+  return T_OTHER;
+}
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+
+/*
+Trace code gets (Value *slots, Entry **globals) and keeps them in rbx and
+r12. The expression stack only exists at compile time: a number or bool at
+depth d lives in xmm<d> (bools as 0/1), an array is just a note of which
+local/global holds it. Nothing is written to the vm stack unless a side exit
+needs it there.
+*/
+typedef struct {
+  TraceType type;
+  bool global; // arrays: where to reload the Value from
+  int index;
+} StackEntry;
+
+typedef struct {
+  int jumpAt;
+  uint8_t *ip;
+  int depth;
+  StackEntry stack[TRACE_MAX_DEPTH];
+} SideExit;
+
+typedef struct {
+  Assembler body;
+  Trace *trace;
+  Chunk *chunk;
+  int base;
+  StackEntry stack[TRACE_MAX_DEPTH];
+  int depth;
+  // per variable: the type the entry guard checks (T_OTHER for none) and
+  // the type it holds at this point of the trace (T_OTHER for unknown)
+  TraceType localGuard[UINT8_COUNT];
+  TraceType localType[UINT8_COUNT];
+  TraceType globalGuard[TRACE_MAX_GLOBALS];
+  TraceType globalType[TRACE_MAX_GLOBALS];
+  SideExit *exits;
+  int exitCount;
+  int exitCapacity;
+} TraceCompiler;
+
+#define VALUE_TYPE 0
+#define VALUE_PAYLOAD 8
+#define LOCAL(slot) ((int)((slot) * sizeof(Value)))
+#define ENTRY_VALUE ((int)offsetof(Entry, value))
+#define ARRAY_COUNT                                                            \
+  ((int)(offsetof(ObjArray, elements) + offsetof(ValueArray, count)))
+#define ARRAY_VALUES                                                           \
+  ((int)(offsetof(ObjArray, elements) + offsetof(ValueArray, values)))
+
+static void movsdLoad(Assembler *as, int xmm, int base, int disp) {
+  emitMemOp(as, 0xF2, false, true, 0x10, xmm, base, disp);
+}
+static void movsdStore(Assembler *as, int xmm, int base, int disp) {
+  emitMemOp(as, 0xF2, false, true, 0x11, xmm, base, disp);
+}
+static void movqToXmm(Assembler *as, int xmm, int reg) {
+  emitRegOp(as, 0x66, true, true, 0x6E, xmm, reg);
+}
+static void movqFromXmm(Assembler *as, int reg, int xmm) {
+  emitRegOp(as, 0x66, true, true, 0x7E, xmm, reg);
+}
+static void storeType(Assembler *as, int base, int disp, ValueType type) {
+  emitMemOp(as, 0, false, false, 0xC7, 0, base, disp); // mov dword [], imm32
+  emit32(as, type);
+}
+static void boolFromAl(Assembler *as, int xmm) {
+  emitRegOp(as, 0, false, true, 0xB6, RAX, RAX); // movzx eax, al
+  movqToXmm(as, xmm, RAX);
+}
+static void epilogue(Assembler *as) {
+  EMIT(as, 0x41, 0x5C, 0x5B, 0xC3); // pop r12; pop rbx; ret
+}
+
+static void addExit(TraceCompiler *tc, int cc, uint8_t *ip) {
+  if (tc->exitCapacity < tc->exitCount + 1) {
+    int oldCapacity = tc->exitCapacity;
+    tc->exitCapacity = GROW_CAPACITY(oldCapacity);
+    tc->exits = grow_array(sizeof(SideExit), tc->exits, oldCapacity,
+                           tc->exitCapacity);
+  }
+  SideExit *exit = &tc->exits[tc->exitCount++];
+  exit->jumpAt = emitJump(&tc->body, cc);
+  exit->ip = ip;
+  exit->depth = tc->depth;
+  memcpy(exit->stack, tc->stack, sizeof(StackEntry) * tc->depth);
+}
+
+static bool pushEntry(TraceCompiler *tc, TraceType type, bool global,
+                      int index) {
+  if (tc->depth == TRACE_MAX_DEPTH)
+    return false;
+  StackEntry *entry = &tc->stack[tc->depth++];
+  entry->type = type;
+  entry->global = global;
+  entry->index = index;
+  return true;
+}
+
+static int globalIndex(TraceCompiler *tc, StringObj *name) {
+  Trace *trace = tc->trace;
+  for (int i = 0; i < trace->globalCount; i++) {
+    if (trace->globals[i] == name)
+      return i;
+  }
+  if (trace->globalCount == TRACE_MAX_GLOBALS)
+    return -1;
+  tc->globalGuard[trace->globalCount] = T_OTHER;
+  tc->globalType[trace->globalCount] = T_OTHER;
+  trace->globals[trace->globalCount] = name;
+  return trace->globalCount++;
+}
+// leaves the address of the Value in (base, disp)
+static void variableAddress(TraceCompiler *tc, bool global, int index,
+                            int *base, int *disp) {
+  if (global) {
+    emitMemOp(&tc->body, 0, true, false, 0x8B, RAX, R12, index * 8);
+    *base = RAX;
+    *disp = ENTRY_VALUE;
+  } else {
+    *base = RBX;
+    *disp = LOCAL(index);
+  }
+}
+
+static bool loadVariable(TraceCompiler *tc, bool global, int index,
+                         TraceType seen) {
+  TraceType *guard = global ? &tc->globalGuard[index] : &tc->localGuard[index];
+  TraceType *type = global ? &tc->globalType[index] : &tc->localType[index];
+  if (*type == T_OTHER) {
+    // first read before any write: the entry guard pins the type
+    *guard = seen;
+    *type = seen;
+  }
+  if (*type != seen)
+    return false;
+  int base, disp;
+  switch (seen) {
+  case T_NUMBER:
+    variableAddress(tc, global, index, &base, &disp);
+    movsdLoad(&tc->body, tc->depth, base, disp + VALUE_PAYLOAD);
+    break;
+  case T_BOOL:
+    variableAddress(tc, global, index, &base, &disp);
+    emitMemOp(&tc->body, 0, false, true, 0xB6, RAX, base,
+              disp + VALUE_PAYLOAD); // movzx eax, byte []
+    movqToXmm(&tc->body, tc->depth, RAX);
+    break;
+  case T_ARRAY:
+    break;
+  default:
+    return false;
+  }
+  return pushEntry(tc, seen, global, index);
+}
+
+static bool storeVariable(TraceCompiler *tc, bool global, int index) {
+  if (tc->depth == 0)
+    return false;
+  StackEntry *top = &tc->stack[tc->depth - 1];
+  for (int i = 0; i < tc->depth; i++) {
+    // exits reload arrays from their variable, so it has to keep them
+    if (tc->stack[i].type == T_ARRAY && tc->stack[i].global == global &&
+        tc->stack[i].index == index)
+      return false;
+  }
+  TraceType *type = global ? &tc->globalType[index] : &tc->localType[index];
+  int base, disp;
+  variableAddress(tc, global, index, &base, &disp);
+  switch (top->type) {
+  case T_NUMBER:
+    movsdStore(&tc->body, tc->depth - 1, base, disp + VALUE_PAYLOAD);
+    if (*type != T_NUMBER)
+      storeType(&tc->body, base, disp + VALUE_TYPE, VAL_NUMBER);
+    break;
+  case T_BOOL:
+    movqFromXmm(&tc->body, RCX, tc->depth - 1);
+    emitMemOp(&tc->body, 0, true, false, 0x89, RCX, base,
+              disp + VALUE_PAYLOAD);
+    if (*type != T_BOOL)
+      storeType(&tc->body, base, disp + VALUE_TYPE, VAL_BOOL);
+    break;
+  default:
+    return false; // arrays stay where they are
+  }
+  *type = top->type;
+  return true;
+}
+
+// rax = the ObjArray behind a stack entry
+static void loadArray(TraceCompiler *tc, StackEntry *entry) {
+  int base, disp;
+  variableAddress(tc, entry->global, entry->index, &base, &disp);
+  emitMemOp(&tc->body, 0, true, false, 0x8B, RAX, base, disp + VALUE_PAYLOAD);
+}
+// rdx = &array->elements.values[index], side exits to ip when out of range
+static void elementAddress(TraceCompiler *tc, StackEntry *array, int indexXmm,
+                           uint8_t *ip) {
+  Assembler *as = &tc->body;
+  loadArray(tc, array);
+  emitRegOp(as, 0xF2, false, true, 0x2C, RCX, indexXmm); // cvttsd2si ecx
+  emitMemOp(as, 0, false, false, 0x3B, RCX, RAX, ARRAY_COUNT); // cmp ecx, n
+  addExit(tc, CC_AE, ip); // unsigned, so negative indexes exit too
+  emitMemOp(as, 0, true, false, 0x8B, RDX, RAX, ARRAY_VALUES);
+  EMIT(as, 0x48, 0xC1, 0xE1, 0x04); // shl rcx, 4
+  EMIT(as, 0x48, 0x01, 0xCA);       // add rdx, rcx
+}
+
+static bool compileStep(TraceCompiler *tc, TraceStep *step, bool last) {
+  Assembler *as = &tc->body;
+  uint8_t *ip = step->ip;
+  int d = tc->depth;
+  StackEntry *a = d >= 2 ? &tc->stack[d - 2] : NULL;
+  StackEntry *b = d >= 1 ? &tc->stack[d - 1] : NULL;
+  switch (ip[0]) {
+  case OP_CONSTANT: {
+    Value constant = tc->chunk->constants.values[ip[1]];
+    if (!IS_NUMBER(constant))
+      return false;
+    uint64_t bits;
+    memcpy(&bits, &constant.payload.number, sizeof(bits));
+    emitMovImm64(as, RAX, bits);
+    movqToXmm(as, d, RAX);
+    return pushEntry(tc, T_NUMBER, false, 0);
+  }
+  case OP_TRUE:
+  case OP_FALSE:
+    EMIT(as, 0xB8, ip[0] == OP_TRUE ? 1 : 0, 0, 0, 0); // mov eax, 0/1
+    movqToXmm(as, d, RAX);
+    return pushEntry(tc, T_BOOL, false, 0);
+  case OP_POP:
+    if (d == 0)
+      return false;
+    tc->depth--;
+    return true;
+  case OP_GET_LOCAL:
+    if (ip[1] < tc->base)
+      return loadVariable(tc, false, ip[1], step->type);
+    // a local declared inside the loop, it only exists on our stack
+    if (ip[1] - tc->base >= d || tc->stack[ip[1] - tc->base].type != step->type)
+      return false;
+    emitRegOp(as, 0x66, false, true, 0x28, d, ip[1] - tc->base); // movapd
+    return pushEntry(tc, step->type, tc->stack[ip[1] - tc->base].global,
+                     tc->stack[ip[1] - tc->base].index);
+  case OP_SET_LOCAL:
+    if (ip[1] < tc->base)
+      return storeVariable(tc, false, ip[1]);
+    if (b == NULL || ip[1] - tc->base >= d - 1 || b->type == T_ARRAY)
+      return false;
+    emitRegOp(as, 0x66, false, true, 0x28, ip[1] - tc->base, d - 1);
+    tc->stack[ip[1] - tc->base] = *b;
+    return true;
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL: {
+    int index =
+        globalIndex(tc, PAYLOAD_STRING(tc->chunk->constants.values[ip[1]]));
+    if (index < 0)
+      return false;
+    return ip[0] == OP_GET_GLOBAL ? loadVariable(tc, true, index, step->type)
+                                  : storeVariable(tc, true, index);
+  }
+  case OP_ADD:
+  case OP_SUBSTRACT:
+  case OP_MULITPLY:
+  case OP_DIVIDE: {
+    if (a == NULL || a->type != T_NUMBER || b->type != T_NUMBER)
+      return false;
+    uint8_t op = ip[0] == OP_ADD         ? 0x58
+                 : ip[0] == OP_SUBSTRACT ? 0x5C
+                 : ip[0] == OP_MULITPLY  ? 0x59
+                                         : 0x5E;
+    emitRegOp(as, 0xF2, false, true, op, d - 2, d - 1);
+    tc->depth--;
+    return true;
+  }
+  case OP_NEGATE:
+    if (b == NULL || b->type != T_NUMBER)
+      return false;
+    emitMovImm64(as, RAX, 0x8000000000000000ull);
+    movqToXmm(as, SCRATCH, RAX);
+    emitRegOp(as, 0x66, false, true, 0x57, d - 1, SCRATCH); // xorpd
+    return true;
+  case OP_NOT:
+    if (b == NULL)
+      return false;
+    if (b->type == T_BOOL) {
+      movqFromXmm(as, RAX, d - 1);
+      EMIT(as, 0x83, 0xF0, 0x01); // xor eax, 1
+    } else {
+      EMIT(as, 0x31, 0xC0); // numbers and arrays are truthy
+    }
+    movqToXmm(as, d - 1, RAX);
+    b->type = T_BOOL;
+    return true;
+  case OP_EQUAL:
+    if (a == NULL)
+      return false;
+    if (a->type == T_NUMBER && b->type == T_NUMBER) {
+      emitRegOp(as, 0x66, false, true, 0x2E, d - 2, d - 1); // ucomisd
+      emitRegOp(as, 0, false, true, 0x90 | CC_E, 0, RAX);   // sete al
+      emitRegOp(as, 0, false, true, 0x90 | CC_NP, 0, RCX);  // setnp cl
+      EMIT(as, 0x20, 0xC8);                                 // and al, cl
+    } else if (a->type == T_BOOL && b->type == T_BOOL) {
+      movqFromXmm(as, RAX, d - 2);
+      movqFromXmm(as, RCX, d - 1);
+      EMIT(as, 0x48, 0x39, 0xC8);                         // cmp rax, rcx
+      emitRegOp(as, 0, false, true, 0x90 | CC_E, 0, RAX); // sete al
+    } else if (a->type != b->type) {
+      EMIT(as, 0x31, 0xC0); // different types are never equal
+    } else {
+      return false;
+    }
+    boolFromAl(as, d - 2);
+    a->type = T_BOOL;
+    tc->depth--;
+    return true;
+  case OP_LESS:
+  case OP_GREATER:
+    if (a == NULL || a->type != T_NUMBER || b->type != T_NUMBER)
+      return false;
+    // a < b is b > a, seta keeps NaN false
+    if (ip[0] == OP_LESS) {
+      emitRegOp(as, 0x66, false, true, 0x2E, d - 1, d - 2);
+    } else {
+      emitRegOp(as, 0x66, false, true, 0x2E, d - 2, d - 1);
+    }
+    emitRegOp(as, 0, false, true, 0x90 | CC_A, 0, RAX); // seta al
+    boolFromAl(as, d - 2);
+    a->type = T_BOOL;
+    tc->depth--;
+    return true;
+  case OP_JUMP_IF_FALSE: {
+    if (b == NULL)
+      return false;
+    uint8_t *target = ip + 3 + (uint16_t)((ip[1] << 8) | ip[2]);
+    if (b->type != T_BOOL) {
+      return !step->taken; // numbers and arrays never jump
+    }
+    movqFromXmm(as, RAX, d - 1);
+    EMIT(as, 0x48, 0x85, 0xC0); // test rax, rax
+    // leave if the condition doesn't go the way it went while recording
+    if (step->taken) {
+      addExit(tc, CC_NE, ip + 3);
+    } else {
+      addExit(tc, CC_E, target);
+    }
+    return true;
+  }
+  case OP_JUMP:
+    return true; // the trace already continues at the target
+  case OP_LOOP:
+    if (!last)
+      return true;
+    if (d != 0)
+      return false;
+    patchJump(as, emitJump(as, CC_ALWAYS), 0); // back to the top
+    return true;
+  case OP_GET_INDEX:
+    if (a == NULL || a->type != T_ARRAY || b->type != T_NUMBER ||
+        step->type != T_NUMBER)
+      return false;
+    elementAddress(tc, a, d - 1, ip);
+    emitMemOp(as, 0, false, false, 0x81, 7, RDX, VALUE_TYPE); // cmp dword
+    emit32(as, VAL_NUMBER);
+    addExit(tc, CC_NE, ip);
+    movsdLoad(as, d - 2, RDX, VALUE_PAYLOAD);
+    a->type = T_NUMBER;
+    tc->depth--;
+    return true;
+  case OP_SET_INDEX: {
+    if (d < 3)
+      return false;
+    StackEntry *array = &tc->stack[d - 3];
+    if (array->type != T_ARRAY || a->type != T_NUMBER ||
+        (b->type != T_NUMBER && b->type != T_BOOL))
+      return false;
+    elementAddress(tc, array, d - 2, ip);
+    if (b->type == T_NUMBER) {
+      storeType(as, RDX, VALUE_TYPE, VAL_NUMBER);
+      movsdStore(as, d - 1, RDX, VALUE_PAYLOAD);
+    } else {
+      storeType(as, RDX, VALUE_TYPE, VAL_BOOL);
+      movqFromXmm(as, RCX, d - 1);
+      emitMemOp(as, 0, true, false, 0x89, RCX, RDX, VALUE_PAYLOAD);
+    }
+    emitRegOp(as, 0x66, false, true, 0x28, d - 3, d - 1); // movapd
+    array->type = b->type;
+    tc->depth -= 2;
+    return true;
+  }
+  case OP_GET_PROPERTY: {
+    StringObj *name = PAYLOAD_STRING(tc->chunk->constants.values[ip[1]]);
+    if (b == NULL || b->type != T_ARRAY || name->length != 3 ||
+        memcmp(name->chars, "arr", 3) != 0)
+      return false;
+    loadArray(tc, b);
+    emitMemOp(as, 0xF2, false, true, 0x2A, d - 1, RAX,
+              ARRAY_COUNT); // cvtsi2sd xmm, dword [count]
+    b->type = T_NUMBER;
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// rebuilds the interpreter's view of the stack and returns the exit ip
+static void emitSideExit(TraceCompiler *tc, SideExit *exit) {
+  Assembler *as = &tc->body;
+  patchJump(as, exit->jumpAt, as->count);
+  emitMovImm64(as, RDX, (uint64_t)(uintptr_t)&vm->stackTop);
+  emitMemOp(as, 0, true, false, 0x8B, RAX, RDX, 0); // mov rax, [rdx]
+  for (int k = 0; k < exit->depth; k++) {
+    StackEntry *entry = &exit->stack[k];
+    int disp = LOCAL(k);
+    switch (entry->type) {
+    case T_NUMBER:
+      storeType(as, RAX, disp + VALUE_TYPE, VAL_NUMBER);
+      movsdStore(as, k, RAX, disp + VALUE_PAYLOAD);
+      break;
+    case T_BOOL:
+      storeType(as, RAX, disp + VALUE_TYPE, VAL_BOOL);
+      movqFromXmm(as, RCX, k);
+      emitMemOp(as, 0, true, false, 0x89, RCX, RAX, disp + VALUE_PAYLOAD);
+      break;
+    default: {
+      int base = RBX, source = LOCAL(entry->index);
+      if (entry->global) {
+        emitMemOp(as, 0, true, false, 0x8B, RCX, R12, entry->index * 8);
+        base = RCX;
+        source = ENTRY_VALUE;
+      }
+      emitMemOp(as, 0xF3, false, true, 0x6F, SCRATCH, base, source); // movdqu
+      emitMemOp(as, 0xF3, false, true, 0x7F, SCRATCH, RAX, disp);
+      break;
+    }
+    }
+  }
+  if (exit->depth > 0) {
+    emitMemOp(as, 0, true, false, 0x81, 0, RDX, 0); // add qword [rdx], n
+    emit32(as, exit->depth * sizeof(Value));
+  }
+  emitMovImm64(as, RAX, (uint64_t)(uintptr_t)exit->ip);
+  epilogue(as);
+}
+
+// entry guards for every variable the trace reads before writing it
+static void emitGuard(Assembler *as, int base, int disp, TraceType type,
+                      int *bails, int *bailCount) {
+  emitMemOp(as, 0, false, false, 0x81, 7, base, disp + VALUE_TYPE);
+  emit32(as, type == T_NUMBER ? VAL_NUMBER
+             : type == T_BOOL ? VAL_BOOL
+                              : VAL_OBJ);
+  bails[(*bailCount)++] = emitJump(as, CC_NE);
+  if (type == T_ARRAY) {
+    emitMemOp(as, 0, true, false, 0x8B, RCX, base, disp + VALUE_PAYLOAD);
+    emitMemOp(as, 0, false, false, 0x81, 7, RCX, 0); // cmp obj->type
+    emit32(as, OBJ_ARRAY);
+    bails[(*bailCount)++] = emitJump(as, CC_NE);
+  }
+}
+
+static bool compileTrace(Trace *trace, Chunk *chunk) {
+  Recorder *recorder = &currentTracer()->recorder;
+  TraceCompiler *tc = malloc(sizeof(TraceCompiler));
+  initAssembler(&tc->body);
+  tc->trace = trace;
+  tc->chunk = chunk;
+  tc->base = recorder->base;
+  tc->depth = 0;
+  tc->exits = NULL;
+  tc->exitCount = 0;
+  tc->exitCapacity = 0;
+  trace->globalCount = 0;
+  trace->base = recorder->base;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    tc->localGuard[i] = T_OTHER;
+    tc->localType[i] = T_OTHER;
+  }
+
+  bool ok = true;
+  for (int i = 0; ok && i < recorder->count; i++) {
+    ok = compileStep(tc, &recorder->steps[i], i == recorder->count - 1);
+  }
+  // what the trace leaves in a variable has to pass its own entry guard
+  for (int i = 0; ok && i < UINT8_COUNT; i++) {
+    ok = tc->localGuard[i] == T_OTHER || tc->localGuard[i] == tc->localType[i];
+  }
+  for (int i = 0; ok && i < trace->globalCount; i++) {
+    ok = tc->globalGuard[i] == T_OTHER ||
+         tc->globalGuard[i] == tc->globalType[i];
+  }
+
+  Assembler entry;
+  initAssembler(&entry);
+  if (ok) {
+    for (int i = 0; i < tc->exitCount; i++) {
+      emitSideExit(tc, &tc->exits[i]);
+    }
+    EMIT(&entry, 0x53, 0x41, 0x54); // push rbx; push r12
+    EMIT(&entry, 0x48, 0x89, 0xFB); // mov rbx, rdi
+    EMIT(&entry, 0x49, 0x89, 0xF4); // mov r12, rsi
+    int bails[2 * (UINT8_COUNT + TRACE_MAX_GLOBALS)];
+    int bailCount = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+      if (tc->localGuard[i] != T_OTHER)
+        emitGuard(&entry, RBX, LOCAL(i), tc->localGuard[i], bails,
+                  &bailCount);
+    }
+    for (int i = 0; i < trace->globalCount; i++) {
+      if (tc->globalGuard[i] != T_OTHER) {
+        emitMemOp(&entry, 0, true, false, 0x8B, RAX, R12, i * 8);
+        emitGuard(&entry, RAX, ENTRY_VALUE, tc->globalGuard[i], bails,
+                  &bailCount);
+      }
+    }
+    int toBody = emitJump(&entry, CC_ALWAYS);
+    for (int i = 0; i < bailCount; i++) {
+      patchJump(&entry, bails[i], entry.count);
+    }
+    emitMovImm64(&entry, RAX, (uint64_t)(uintptr_t)trace->header);
+    epilogue(&entry);
+    patchJump(&entry, toBody, entry.count);
+    emitArray(&entry, tc->body.code, tc->body.count);
+    trace->code = finalizeCode(&entry);
+    trace->codeSize = entry.count;
+    ok = trace->code != NULL;
+  }
+  freeAssembler(&entry);
+  freeAssembler(&tc->body);
+  free(tc->exits);
+  free(tc);
+  return ok;
+}
+
+static uint8_t *enterTrace(Trace *trace, CallFrame *frame) {
+  if (vm->stackTop - frame->slots != trace->base)
+    return trace->header;
+  Entry *entries[TRACE_MAX_GLOBALS];
+  for (int i = 0; i < trace->globalCount; i++) {
+    StringObj *name = trace->globals[i];
+    entries[i] = lookUp(&vm->globals, name->chars, name->hash, name->length);
+    if (entries[i] == NULL)
+      return trace->header;
+  }
+  return ((TraceFunction)trace->code)(frame->slots, entries);
+}
+
+#else
+
+static bool compileTrace(Trace *trace, Chunk *chunk) { return false; }
+static uint8_t *enterTrace(Trace *trace, CallFrame *frame) {
+  return trace->header;
+}
+
+#endif
+
+static void stopRecording(bool compiled) {
+  Recorder *recorder = &currentTracer()->recorder;
+  Trace *trace = recorder->trace;
+  vm->tracing = false;
+  recorder->trace = NULL;
+  if (!compiled && ++trace->attempts >= TRACE_MAX_ATTEMPTS) {
+    trace->blacklisted = true;
+  }
+}
+
+bool traceLoop(CallFrame *frame) {
+  if (vm->tracing)
+    return false;
+  Trace *trace = findTrace(frame->ip);
+  if (trace->code != NULL) {
+    uint8_t *exit = enterTrace(trace, frame);
+    if (exit != trace->header) {
+      frame->ip = exit;
+      return true;
+    }
+    if (++trace->misses >= TRACE_THRESHOLD) {
+      // the types it was specialized for don't show up anymore
+      freeCode(trace->code, trace->codeSize);
+      trace->code = NULL;
+      trace->blacklisted = true;
+    }
+    return false;
+  }
+  if (trace->blacklisted || ++trace->hotness < TRACE_THRESHOLD)
+    return false;
+  trace->hotness = 0;
+  Recorder *recorder = &currentTracer()->recorder;
+  recorder->trace = trace;
+  recorder->frame = vm->frameCount - 1;
+  recorder->base = vm->stackTop - frame->slots;
+  recorder->count = 0;
+  vm->tracing = true;
+  return true;
+}
+
+void traceRecord(CallFrame *frame) {
+  Recorder *recorder = &currentTracer()->recorder;
+  if (vm->frameCount - 1 != recorder->frame) {
+    stopRecording(false); // returned or errored out of the loop
+    return;
+  }
+  uint8_t *ip = frame->ip;
+  if (ip == recorder->trace->header && recorder->count > 0) {
+    stopRecording(compileTrace(recorder->trace, &frame->closure->function->chunk));
+    return;
+  }
+  if (recorder->count == TRACE_MAX_LENGTH) {
+    stopRecording(false);
+    return;
+  }
+  TraceStep *step = &recorder->steps[recorder->count++];
+  step->ip = ip;
+  step->type = T_OTHER;
+  step->taken = false;
+  switch (ip[0]) {
+  case OP_GET_LOCAL:
+    step->type = typeOf(frame->slots[ip[1]]);
+    break;
+  case OP_GET_GLOBAL: {
+    StringObj *name =
+        PAYLOAD_STRING(frame->closure->function->chunk.constants.values[ip[1]]);
+    Entry *entry = lookUp(&vm->globals, name->chars, name->hash, name->length);
+    if (entry == NULL) {
+      stopRecording(false);
+      return;
+    }
+    step->type = typeOf(entry->value);
+    break;
+  }
+  case OP_GET_INDEX: {
+    Value index = vm->stackTop[-1];
+    Value array = vm->stackTop[-2];
+    if (!IS_ARRAY(array) || !IS_NUMBER(index)) {
+      stopRecording(false);
+      return;
+    }
+    step->type = typeOf(arrayGet(array, (int)PAYLOAD_NUMBER(index)));
+    break;
+  }
+  case OP_JUMP_IF_FALSE:
+    step->taken = MAKE_NOT(vm->stackTop[-1]);
+    break;
+  case OP_CONSTANT:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_SET_LOCAL:
+  case OP_SET_GLOBAL:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBSTRACT:
+  case OP_MULITPLY:
+  case OP_DIVIDE:
+  case OP_NEGATE:
+  case OP_NOT:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_SET_INDEX:
+  case OP_GET_PROPERTY:
+    break;
+  default:
+    stopRecording(false); // calls, printing, closures... stay interpreted
+    break;
+  }
+}
+
+void freeFunctionTraces(ObjFunction *function) {
+  Tracer *tracer = vm->tracer;
+  if (tracer == NULL) {
+    return;
+  }
+  uint8_t *start = function->chunk.code;
+  uint8_t *end = start + function->chunk.count;
+  for (int i = 0; i < TRACE_BUCKETS; i++) {
+    Trace **link = &tracer->traces[i];
+    while (*link != NULL) {
+      Trace *trace = *link;
+      if (trace->header < start || trace->header >= end) {
+        link = &trace->next;
+        continue;
+      }
+      if (vm->tracing && tracer->recorder.trace == trace) {
+        vm->tracing = false;
+        tracer->recorder.trace = NULL;
+      }
+      *link = trace->next;
+      if (trace->code != NULL)
+        freeCode(trace->code, trace->codeSize);
+      free(trace);
+    }
+  }
+}
+
+void freeTraces() {
+  Tracer *tracer = vm->tracer;
+  if (tracer == NULL) {
+    return;
+  }
+  for (int i = 0; i < TRACE_BUCKETS; i++) {
+    Trace *trace = tracer->traces[i];
+    while (trace != NULL) {
+      Trace *next = trace->next;
+      if (trace->code != NULL)
+        freeCode(trace->code, trace->codeSize);
+      free(trace);
+      trace = next;
+    }
+  }
+  free(tracer);
+  vm->tracer = NULL;
+  vm->tracing = false;
+}
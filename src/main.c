@@ -1,6 +1,11 @@
+#include "../include/aot/emitc.h"
 #include "../include/bytecode/chunk.h"
+#include "../include/bytecode/image.h"
+#include "../include/compiler/compiler.h"
 #include "../include/common.h"
 #include "../include/debug.h"
+#include "../include/io/files.h"
+#include "../include/jit/jit.h"
 #include "../include/vm/vm.h"
 #include <stdbool.h>
 #include <stdio.h>
@@ -8,7 +13,7 @@
 #include <string.h>
 
 static void
-repl() { // REPL read eval print loop when you just run >>python and puts u
+repl(VM *machine) { // REPL read eval print loop when you just run >>python and puts u
   // in that weird ass environment
   char line[1024];
   printf("SaaScript v.1.0\n");
@@ -24,7 +29,7 @@ repl() { // REPL read eval print loop when you just run >>python and puts u
       fprintf(stdout, "Byebye, can't wait for another b2b saas! :) \n");
       break;
     }
-    InterpretResult result = interpret(line);
+    InterpretResult result = interpret(machine, line);
     // if (result != INTERPRET_OK) {
     //   freeVM();
     //   initVM();
@@ -32,51 +37,87 @@ repl() { // REPL read eval print loop when you just run >>python and puts u
   }
 }
 
-static char *readFile(char *path) {
-  FILE *file = fopen(path, "rb");
-  // check for errors
-
-  if (file == NULL) {
+// the script gets mapped straight into memory and the scanner reads it there,
+// it's only needed until it's compiled
+static char *readFile(const char *path, size_t *size) {
+  char *source = mapFile(path, size);
+  if (source == NULL) {
     fprintf(stderr, "could not open file \"%s\". \n", path);
     exit(74);
   }
+  return source;
+}
 
-  // go to the end of the file
-  fseek(file, 0L, SEEK_END);
-  long int file_size =
-      ftell(file); // int of the position of the file as a byte count
-  rewind(file);    // goes back to the beginning
-  /*
-  alternative is fseek(file, 0L, SEEK_SET) which also goes back to the beginning
-  */
+// the .saasc the script got run from, its functions' code is in there so it
+// stays mapped until after freeVM()
+static Image image;
+// same for the --from-snapshot one
+static Image snapshot;
 
-  char *buffer = malloc(file_size + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
-  }
-  size_t bytesRead = fread(buffer, sizeof(char), file_size, file);
-  if (bytesRead < file_size) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
-  }
-  buffer[file_size] = '\0';
-  fclose(file);
-  return buffer;
-}
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+static void runFile(VM *machine, const char *path) {
+  size_t size;
+  char *source = readFile(path, &size);
+  // skip compiling when --compile-only left an image of this exact source
+  char *cached = imagePath(path);
+  ObjFunction *function = loadImage(&image, cached, source, size);
+  free(cached);
+  InterpretResult result = function != NULL
+                               ? interpretFunction(machine, function)
+                               : interpret(machine, source);
+  unmapFile(source, size);
 
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
   if (result == INTERPRET_RUNTIME_ERROR)
     exit(70);
 }
+// --emit-c: write the script as C to stdout instead of running it
+static void emitFile(const char *path) {
+  size_t size;
+  char *source = readFile(path, &size);
+  bool ok = emitC(source, path, stdout);
+  unmapFile(source, size);
+  if (!ok)
+    exit(65);
+}
+
+// --compile-only: compile the script and save it next to it as a .saasc
+static void compileFile(const char *path) {
+  size_t size;
+  char *source = readFile(path, &size);
+  ObjFunction *function = compile(source);
+  if (function == NULL) {
+    exit(65);
+  }
+  char *cached = imagePath(path);
+  bool ok = writeImage(function, source, size, cached);
+  if (!ok) {
+    fprintf(stderr, "could not write \"%s\". \n", cached);
+  }
+  free(cached);
+  unmapFile(source, size);
+  if (!ok) {
+    exit(74);
+  }
+}
+
+static void usage() {
+  fprintf(stderr, "usage: saas [--jit] [--emit-c] [--lex-thread] "
+                  "[--compile-only] [--lazy] [--snapshot file] "
+                  "[--from-snapshot file] [path]\n");
+  exit(64);
+}
+
+// --snapshot: after the prelude ran, save what it left in the globals
+static void snapshotFile(const char *path) {
+  if (!writeSnapshot(path)) {
+    fprintf(stderr, "could not write snapshot \"%s\". \n", path);
+    exit(74);
+  }
+}
 
 int main(int argc, const char *argv[]) {
-  initVM();
+  VM *machine = newVM();
   // writes the constant's index to the byte chunk
   /*
   So after everything ts looks like
@@ -84,18 +125,64 @@ int main(int argc, const char *argv[]) {
   CST_ARRAY = {1.2} --> THE 1.2 IS AT INDEX 0 SO THE OPERATION CAN KNOW WHAT
   INDEX TO ACCESS NEXT
   */
-  if (argc == 1) {
-    vm.repl = true;
-    repl();
-  } else if (argc == 2) {
-    vm.repl = false;
-    runFile(argv[1]);
+  // flags first, then the optional script path
+  int arg = 1;
+  bool emit = false;
+  bool compileOnly = false;
+  bool lazy = false;
+  const char *snapshotOut = NULL;
+  const char *snapshotIn = NULL;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (strcmp(argv[arg], "--jit") == 0) {
+      machine->jit = jitAvailable();
+      if (!machine->jit) {
+        fprintf(stderr, "--jit is not supported on this platform, "
+                        "running in the interpreter\n");
+      }
+    } else if (strcmp(argv[arg], "--emit-c") == 0) {
+      emit = true;
+    } else if (strcmp(argv[arg], "--lex-thread") == 0) {
+      machine->lexThread = true;
+    } else if (strcmp(argv[arg], "--compile-only") == 0) {
+      compileOnly = true;
+    } else if (strcmp(argv[arg], "--lazy") == 0) {
+      lazy = true;
+    } else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 1 < argc) {
+      snapshotOut = argv[++arg];
+    } else if (strcmp(argv[arg], "--from-snapshot") == 0 && arg + 1 < argc) {
+      snapshotIn = argv[++arg];
+    } else {
+      usage();
+    }
+  }
+  // its globals are there before anything gets compiled or run
+  if (snapshotIn != NULL && !loadSnapshot(&snapshot, snapshotIn)) {
+    fprintf(stderr, "could not load snapshot \"%s\". \n", snapshotIn);
+    exit(74);
+  }
+  if (emit && arg == argc - 1) {
+    emitFile(argv[arg]);
+  } else if (compileOnly && arg == argc - 1) {
+    compileFile(argv[arg]);
+  } else if (arg == argc && !emit && !compileOnly && snapshotOut == NULL) {
+    machine->repl = true;
+    repl(machine);
+  } else if (arg == argc - 1) {
+    machine->repl = false;
+    // only when running a file: the repl frees each line's source, and
+    // images, snapshots and C need every body compiled
+    machine->lazy = lazy && snapshotOut == NULL;
+    runFile(machine, argv[arg]);
+    if (snapshotOut != NULL) {
+      snapshotFile(snapshotOut);
+    }
   } else {
-    fprintf(stderr, "usage: saas [path]\n");
-    exit(64);
+    usage();
   }
 
-  freeVM();
+  freeVM(machine);
+  closeImage(&image);
+  closeImage(&snapshot);
 
   return 0;
 }
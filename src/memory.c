@@ -1,5 +1,7 @@
 #include "../include/memory.h"
 #include "../include/bytecode/object.h"
+#include "../include/jit/jit.h"
+#include "../include/jit/trace.h"
 #include "../include/vm/vm.h"
 #include <stdio.h>
 
@@ -10,32 +12,36 @@ static void freeObject(Obj *object) {
   case OBJ_STRING: {
     StringObj *string = (StringObj *)object;
 #ifdef DEBUG_PRINT_CODE
-    printf("Freed string: %s\n", string->chars);
+    printf("Freed string: %.*s\n", string->length, string->chars);
 #endif
-    free(string->chars);
+    if (string->parent == NULL) { // slices share their parent's chars
+      free(string->chars);
+    }
     free(object);
     break;
   }
   case OBJ_CLOSURE: {
+    // the upvalues are objects of their own, closures share them
     ObjClosure *closure = (ObjClosure *)object;
-    for (int i = 0; i < closure->upvalueCount; i++) {
-      free(closure->upvalues[i]);
-    }
+    free(closure->upvalues);
     free(closure);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
+    jitFree(function);
+    freeFunctionTraces(function);
     freeChunk(&function->chunk);
-    StringObj *string = function->name;
-#ifdef DEBUG_PRINT_CODE
-    printf("Freed string in function: %s\n", string->chars);
-#endif
-    free(string->chars);
+    free(function->lazy);
+    // the name is a string object of its own
     free(object);
     break;
   }
   case OBJ_NATIVE: {
+    ObjNative *native = (ObjNative *)object;
+    if (native->freeState != NULL) {
+      native->freeState(native->state);
+    }
     free(object);
     break;
   }
@@ -51,7 +57,7 @@ static void freeObject(Obj *object) {
   }
 }
 void freeObjects() {
-  Obj *head = vm.objectsHead;
+  Obj *head = vm->objectsHead;
   while (head != NULL) {
     Obj *temp_next = head->next;
     freeObject(head);
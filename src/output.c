@@ -0,0 +1,22 @@
+#include "../include/output.h"
+#include <pthread.h>
+#include <unistd.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static char buffer[OUTPUT_BUFFER_SIZE];
+
+static pthread_once_t ready = PTHREAD_ONCE_INIT;
+
+static void setBuffer() {
+  setvbuf(stdout, buffer, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF,
+          OUTPUT_BUFFER_SIZE);
+}
+
+void initOutput() {
+  // setvbuf only works before anything's been written, and every newVM()
+  // comes through here, from whichever thread
+  pthread_once(&ready, setBuffer);
+}
+
+void flushOutput() { fflush(stdout); }
@@ -0,0 +1,208 @@
+#include "../include/saas.h"
+#include "../include/bytecode/image.h"
+#include "../include/compiler/compiler.h"
+#include "../include/vm/vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct SaasProgram {
+  Image image;
+};
+
+// the native's SaasNative, in its state
+typedef struct {
+  SaasNative function;
+} HostNative;
+
+static SaasValue toSaas(Value value) {
+  switch (value.type) {
+  case VAL_BOOL:
+    return saasBool(PAYLOAD_BOOL(value));
+  case VAL_NUMBER:
+    return saasNumber(PAYLOAD_NUMBER(value));
+  case VAL_OBJ:
+    return (SaasValue){.type = IS_STRING(value) ? SAAS_STRING : SAAS_OBJECT,
+                       .as = {.object = PAYLOAD_OBJ(value)}};
+  default:
+    return saasNull();
+  }
+}
+
+static Value fromSaas(SaasValue value) {
+  switch (value.type) {
+  case SAAS_BOOL:
+    return BOOL_VAL(value.as.boolean);
+  case SAAS_NUMBER:
+    return NUMBER_VAL(value.as.number);
+  case SAAS_STRING:
+  case SAAS_OBJECT:
+    return OBJ_VAL(value.as.object);
+  default:
+    return NULL_VAL;
+  }
+}
+
+// everything below that takes a VM switches this thread to it and back to
+// whichever one it was using when it's done, the same as saasCompile(), so a
+// host native can reach into another VM without leaving its own behind
+
+SaasValue saasString(SaasVM *machine, const char *chars, int length) {
+  VM *previous = vm;
+  useVM(machine);
+  SaasValue string = toSaas(OBJ_VAL(copyString(chars, length)));
+  useVM(previous);
+  return string;
+}
+const char *saasChars(SaasValue string) {
+  return flattenString(string.as.object);
+}
+int saasLength(SaasValue string) {
+  return ((StringObj *)string.as.object)->length;
+}
+
+SaasVM *saasNewVM() {
+  VM *previous = vm;
+  VM *machine = newVM();
+  useVM(previous);
+  return machine;
+}
+void saasFreeVM(SaasVM *machine) {
+  VM *previous = vm;
+  freeVM(machine);
+  // nothing to go back to if it was the one being freed
+  useVM(previous == machine ? NULL : previous);
+}
+
+SaasProgram *saasCompile(const char *source) {
+  // compiling makes objects, so it happens in a VM of its own that's gone
+  // once the image is built. Whichever VM this thread was using (a native
+  // can compile) is put back after
+  VM *previous = vm;
+  VM *scratch = newVM();
+  ObjFunction *script = compile(source);
+  SaasProgram *program = NULL;
+  if (script != NULL) {
+    program = malloc(sizeof(SaasProgram));
+    if (!buildProgram(script, &program->image)) {
+      free(program);
+      program = NULL;
+    }
+  }
+  freeVM(scratch);
+  useVM(previous);
+  return program;
+}
+void saasFreeProgram(SaasProgram *program) {
+  freeProgram(&program->image);
+  free(program);
+}
+SaasResult saasRun(SaasVM *machine, const SaasProgram *program) {
+  VM *previous = vm;
+  useVM(machine);
+  ObjFunction *script = instantiateProgram(&program->image);
+  bool ok =
+      script != NULL && interpretFunction(machine, script) == INTERPRET_OK;
+  useVM(previous);
+  return ok ? SAAS_OK : SAAS_RUNTIME_ERROR;
+}
+
+SaasHandle saasHandle(SaasVM *machine, const char *name) {
+  VM *previous = vm;
+  useVM(machine);
+  // generation 0 is never a table's, so the first use looks it up
+  SaasHandle handle = {.name = copyString(name, (int)strlen(name)),
+                       .entry = NULL,
+                       .generation = 0};
+  useVM(previous);
+  return handle;
+}
+
+// same as cachedGlobal() in vm.c
+static Entry *handleEntry(SaasHandle *handle) {
+  if (handle->generation != vm->globals.generation) {
+    StringObj *name = handle->name;
+    Entry *entry = lookUp(&vm->globals, name->chars, name->hash, name->length);
+    if (entry == NULL) {
+      return NULL;
+    }
+    handle->entry = entry;
+    handle->generation = vm->globals.generation;
+  }
+  return handle->entry;
+}
+
+bool saasGet(SaasVM *machine, SaasHandle *global, SaasValue *value) {
+  VM *previous = vm;
+  useVM(machine);
+  Entry *entry = handleEntry(global);
+  if (entry != NULL) {
+    *value = toSaas(entry->value);
+  }
+  useVM(previous);
+  return entry != NULL;
+}
+
+static SaasResult callIn(SaasHandle *function, int argCount,
+                         const SaasValue *args, SaasValue *result) {
+  Entry *entry = handleEntry(function);
+  if (entry == NULL) {
+    runtimeError("Undefined variable '%s'",
+                 ((StringObj *)function->name)->chars);
+    return SAAS_RUNTIME_ERROR;
+  }
+  // OP_CALL's argument count is a byte, so the callee's frame could never
+  // have been checked for more
+  if (argCount > UINT8_MAX ||
+      vm->stackTop + argCount + 1 > vm->stack + STACK_MAX) {
+    runtimeError("Stack Overflow");
+    return SAAS_RUNTIME_ERROR;
+  }
+  // laid out like OP_CALL's operands
+  push(entry->value);
+  for (int i = 0; i < argCount; i++) {
+    push(fromSaas(args[i]));
+  }
+  if (!callNow(argCount)) {
+    return SAAS_RUNTIME_ERROR;
+  }
+  *result = toSaas(pop());
+  return SAAS_OK;
+}
+SaasResult saasCall(SaasVM *machine, SaasHandle *function, int argCount,
+                    const SaasValue *args, SaasValue *result) {
+  VM *previous = vm;
+  useVM(machine);
+  SaasResult called = callIn(function, argCount, args, result);
+  useVM(previous);
+  return called;
+}
+
+// every saasDefine() native goes through here, args[-1] is the callee
+static Value hostNative(int argCount, Value *args) {
+  ObjNative *native = (ObjNative *)PAYLOAD_OBJ(args[-1]);
+  HostNative *host = native->state;
+  SaasValue converted[UINT8_MAX];
+  for (int i = 0; i < argCount; i++) {
+    converted[i] = toSaas(args[i]);
+  }
+  SaasValue result = host->function(vm, argCount, converted);
+  return fromSaas(result);
+}
+
+void saasDefine(SaasVM *machine, const char *name, SaasNative function) {
+  VM *previous = vm;
+  useVM(machine);
+  ObjNative *native = defineNative(name, hostNative);
+  HostNative *host = malloc(sizeof(HostNative));
+  host->function = function;
+  native->state = host;
+  native->freeState = free;
+  useVM(previous);
+}
+
+void saasError(SaasVM *machine, const char *message) {
+  VM *previous = vm;
+  useVM(machine);
+  runtimeError("%s", message);
+  useVM(previous);
+}
@@ -0,0 +1,52 @@
+#include "../../include/vm/decode.h"
+#include "../../include/memory.h"
+#include <stdlib.h>
+
+void decodeChunk(Chunk *chunk, const void *const *handlers) {
+  // which instruction starts at each offset, jumps get their targets from
+  // it. One past the end too, so a jump to the very end still has somewhere
+  // to point at (the compiler always ends a chunk with OP_RETURN anyway)
+  uint32_t *indexes = calloc(chunk->count + 1, sizeof(uint32_t));
+  uint32_t count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    indexes[offset] = count++;
+  }
+  indexes[chunk->count] = count;
+
+  // and one more instruction that only marks where the code ends, so the
+  // one after the last still has an offset
+  Instruction *decoded = calloc(count + 1, sizeof(Instruction));
+  decoded[count].offset = chunk->count;
+  Instruction *instruction = decoded;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset), instruction++) {
+    uint8_t *code = chunk->code + offset;
+    int length = instructionLength(chunk, offset);
+    instruction->op = code[0];
+    instruction->handler = handlers == NULL ? NULL : handlers[code[0]];
+    instruction->offset = offset;
+    for (int i = 1; i < length && i <= 4; i++) {
+      instruction->operands[i - 1] = code[i];
+    }
+
+    switch (code[0]) {
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      instruction->as.entry = NULL;
+      instruction->generation = 0; // tables start at 1
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      instruction->as.target =
+          &decoded[indexes[offset + 3 + ((code[1] << 8) | code[2])]];
+      break;
+    case OP_LOOP:
+      instruction->as.target =
+          &decoded[indexes[offset + 3 - ((code[1] << 8) | code[2])]];
+      break;
+    }
+  }
+  chunk->decoded = decoded;
+  chunk->decodedIndex = indexes;
+}
@@ -0,0 +1,445 @@
+#include "../../include/vm/isolates.h"
+#include "../../include/bytecode/image.h"
+#include "../../include/memory.h"
+#include "../../include/vm/vm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the ring gets allocated up front
+#define CHANNEL_MAX 65536
+
+// one value on its way between VMs: a copy, or the elements of an array of
+// plain values being handed over
+typedef struct {
+  Image package;
+  ValueArray moved;
+  bool isMoved;
+} Message;
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+  Message *messages; // a ring, count of them from head
+  int capacity;
+  int head;
+  int count;
+  bool closed;
+  // the natives for it in every VM, packages it's in, isolates reporting
+  // back through it
+  atomic_int holds;
+} Channel;
+
+typedef enum {
+  SENT,
+  SEND_CLOSED, // the message is still the caller's
+  SEND_FULL,
+  SEND_LOOPS, // see reaches()
+} SendResult;
+
+// sends of messages with channels in them take this while they check where
+// the message leads and queue it, so two of them can't close a loop between
+// them
+static pthread_mutex_t linking = PTHREAD_MUTEX_INITIALIZER;
+
+// what a spawned thread starts from
+typedef struct {
+  Image package; // fn, then its arguments
+  int argCount;
+  bool jit;
+  Channel *done;
+} Isolate;
+
+static Channel *newChannel(int capacity) {
+  Channel *channel = calloc(1, sizeof(Channel));
+  pthread_mutex_init(&channel->lock, NULL);
+  pthread_cond_init(&channel->notEmpty, NULL);
+  pthread_cond_init(&channel->notFull, NULL);
+  channel->messages = calloc(capacity, sizeof(Message));
+  channel->capacity = capacity;
+  atomic_init(&channel->holds, 1);
+  return channel;
+}
+
+static void freeMessage(Message *message) {
+  if (message->isMoved) {
+    freeValueArray(&message->moved);
+  } else {
+    freeProgram(&message->package);
+  }
+}
+
+static void *holdChannel(void *state) {
+  Channel *channel = state;
+  atomic_fetch_add(&channel->holds, 1);
+  return channel;
+}
+
+static void releaseChannel(void *state) {
+  Channel *channel = state;
+  if (atomic_fetch_sub(&channel->holds, 1) != 1) {
+    return;
+  }
+  for (int i = 0; i < channel->count; i++) {
+    freeMessage(&channel->messages[(channel->head + i) % channel->capacity]);
+  }
+  free(channel->messages);
+  pthread_cond_destroy(&channel->notFull);
+  pthread_cond_destroy(&channel->notEmpty);
+  pthread_mutex_destroy(&channel->lock);
+  free(channel);
+}
+
+static void closeChannel(Channel *channel) {
+  pthread_mutex_lock(&channel->lock);
+  channel->closed = true;
+  pthread_cond_broadcast(&channel->notEmpty);
+  pthread_cond_broadcast(&channel->notFull);
+  pthread_mutex_unlock(&channel->lock);
+}
+
+static void waitForRoom(Channel *channel) {
+  while (channel->count == channel->capacity && !channel->closed) {
+    pthread_cond_wait(&channel->notFull, &channel->lock);
+  }
+}
+
+// onto the ring, waiting for room first unless that's left to the caller
+static SendResult enqueue(Channel *channel, Message *message, bool wait) {
+  pthread_mutex_lock(&channel->lock);
+  if (wait) {
+    waitForRoom(channel);
+  }
+  SendResult result = channel->closed                       ? SEND_CLOSED
+                      : channel->count == channel->capacity ? SEND_FULL
+                                                            : SENT;
+  if (result == SENT) {
+    int tail = (channel->head + channel->count) % channel->capacity;
+    channel->messages[tail] = *message;
+    channel->count++;
+    pthread_cond_signal(&channel->notEmpty);
+  }
+  pthread_mutex_unlock(&channel->lock);
+  return result;
+}
+
+static Value channelNative(int argCount, Value *args);
+
+// the channels a queued message holds
+static void collectChannels(const Message *message, Channel ***found,
+                            int *count, int *capacity) {
+  for (int i = 0; !message->isMoved && i < message->package.sharedCount;
+       i++) {
+    const ObjNative *shared = &message->package.shared[i];
+    if (shared->function != channelNative) {
+      continue;
+    }
+    if (*count == *capacity) {
+      int oldCapacity = *capacity;
+      *capacity = GROW_CAPACITY(oldCapacity);
+      *found = grow_array(sizeof(Channel *), *found, oldCapacity, *capacity);
+    }
+    (*found)[(*count)++] = shared->state;
+  }
+}
+
+// whether target is in the message, or queued on a channel that is, or on
+// one queued on one of those and so on. Queueing the message on target would
+// leave target holding itself, and neither it nor what's queued on it would
+// ever be freed. Takes one channel's lock at a time, with linking held
+static bool reaches(const Message *message, Channel *target) {
+  Channel **found = NULL;
+  int count = 0;
+  int capacity = 0;
+  collectChannels(message, &found, &count, &capacity);
+  bool loops = false;
+  for (int i = 0; i < count && !loops; i++) {
+    Channel *channel = found[i];
+    loops = channel == target;
+    bool seen = false;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = found[j] == channel;
+    }
+    if (loops || seen) {
+      continue;
+    }
+    pthread_mutex_lock(&channel->lock);
+    for (int m = 0; m < channel->count; m++) {
+      collectChannels(
+          &channel->messages[(channel->head + m) % channel->capacity], &found,
+          &count, &capacity);
+    }
+    pthread_mutex_unlock(&channel->lock);
+  }
+  free(found);
+  return loops;
+}
+
+static SendResult sendMessage(Channel *channel, Message *message) {
+  if (message->isMoved || message->package.sharedCount == 0) {
+    return enqueue(channel, message, true);
+  }
+  // linking can't be held while waiting for room, whoever would make room
+  // might have a message with channels of its own to send first
+  for (;;) {
+    pthread_mutex_lock(&linking);
+    SendResult result = reaches(message, channel)
+                            ? SEND_LOOPS
+                            : enqueue(channel, message, false);
+    pthread_mutex_unlock(&linking);
+    if (result != SEND_FULL) {
+      return result;
+    }
+    pthread_mutex_lock(&channel->lock);
+    waitForRoom(channel);
+    pthread_mutex_unlock(&channel->lock);
+  }
+}
+
+// false once it's closed and empty
+static bool receiveMessage(Channel *channel, Message *message) {
+  pthread_mutex_lock(&channel->lock);
+  while (channel->count == 0 && !channel->closed) {
+    pthread_cond_wait(&channel->notEmpty, &channel->lock);
+  }
+  bool found = channel->count > 0;
+  if (found) {
+    *message = channel->messages[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+    pthread_cond_signal(&channel->notFull);
+  }
+  pthread_mutex_unlock(&channel->lock);
+  return found;
+}
+
+// in the sending VM
+static bool packMessage(Value value, Message *message) {
+  memset(message, 0, sizeof(Message));
+  if (IS_ARRAY(value)) {
+    ValueArray *elements = &PAYLOAD_ARRAY(value)->elements;
+    bool plain = true;
+    for (int i = 0; i < elements->count && plain; i++) {
+      plain = !IS_OBJ(elements->values[i]);
+    }
+    if (plain) {
+      message->moved = *elements;
+      message->isMoved = true;
+      initValueArray(elements);
+      return true;
+    }
+  }
+  return packValues(&value, 1, true, &message->package);
+}
+
+// in the receiving VM, the message is used up either way
+static bool unpackMessage(Message *message, Value *value) {
+  if (message->isMoved) {
+    ObjArray *array = newArray();
+    array->elements = message->moved;
+    *value = OBJ_VAL(array);
+    return true;
+  }
+  bool ok = unpackValues(&message->package, value, 1);
+  freeProgram(&message->package);
+  return ok;
+}
+
+static Value receiveFrom(Channel *channel) {
+  Message message;
+  Value value = NULL_VAL;
+  if (receiveMessage(channel, &message) && !unpackMessage(&message, &value)) {
+    runtimeError("receive() couldn't unpack a message.");
+    return NULL_VAL;
+  }
+  return value;
+}
+
+// calling a channel receives from it
+static Value channelNative(int argCount, Value *args) {
+  if (argCount != 0) {
+    runtimeError("Expected 0 arguments but got %d", argCount);
+    return NULL_VAL;
+  }
+  return receiveFrom(((ObjNative *)PAYLOAD_OBJ(args[-1]))->state);
+}
+
+// takes over the caller's hold
+static ObjNative *channelObject(Channel *channel) {
+  ObjNative *native = newNative(channelNative);
+  native->state = channel;
+  native->freeState = releaseChannel;
+  native->shareState = holdChannel;
+  return native;
+}
+
+static Channel *channelOf(Value value) {
+  if (!IS_NATIVE(value) || PAYLOAD_NATIVE(value) != channelNative) {
+    return NULL;
+  }
+  return ((ObjNative *)PAYLOAD_OBJ(value))->state;
+}
+
+// channel(capacity)
+static Value channelMakeNative(int argCount, Value *args) {
+  double capacity = argCount == 1 && IS_NUMBER(args[0])
+                        ? PAYLOAD_NUMBER(args[0])
+                        : (argCount == 0 ? 1 : 0);
+  if (argCount > 1 || capacity < 1 || capacity > CHANNEL_MAX ||
+      capacity != (int)capacity) {
+    runtimeError("channel expects a capacity from 1 to %d.", CHANNEL_MAX);
+    return NULL_VAL;
+  }
+  return OBJ_VAL(channelObject(newChannel((int)capacity)));
+}
+
+// send(ch, value)
+static Value sendNative(int argCount, Value *args) {
+  Channel *channel = argCount == 2 ? channelOf(args[0]) : NULL;
+  if (channel == NULL) {
+    runtimeError("send expects a channel and a value.");
+    return NULL_VAL;
+  }
+  Message message;
+  if (!packMessage(args[1], &message)) {
+    runtimeError("send() can only pass numbers, booleans, null, strings, "
+                 "arrays and channels.");
+    return NULL_VAL;
+  }
+  SendResult result = sendMessage(channel, &message);
+  if (result == SENT) {
+    return NULL_VAL;
+  }
+  // the sender keeps what it would have handed over
+  if (message.isMoved) {
+    PAYLOAD_ARRAY(args[1])->elements = message.moved;
+  } else {
+    freeMessage(&message);
+  }
+  if (result == SEND_LOOPS) {
+    runtimeError("Can't send a channel through itself, not even inside "
+                 "another channel.");
+  } else {
+    runtimeError("Can't send on a closed channel.");
+  }
+  return NULL_VAL;
+}
+
+// receive(ch)
+static Value receiveNative(int argCount, Value *args) {
+  Channel *channel = argCount == 1 ? channelOf(args[0]) : NULL;
+  if (channel == NULL) {
+    runtimeError("receive expects a channel.");
+    return NULL_VAL;
+  }
+  return receiveFrom(channel);
+}
+
+// close(ch)
+static Value closeNative(int argCount, Value *args) {
+  Channel *channel = argCount == 1 ? channelOf(args[0]) : NULL;
+  if (channel == NULL) {
+    runtimeError("close expects a channel.");
+    return NULL_VAL;
+  }
+  closeChannel(channel);
+  return NULL_VAL;
+}
+
+// the spawned thread, everything it touches is its own except the channels
+static void *runIsolate(void *argument) {
+  Isolate *isolate = argument;
+  VM *machine = newVM();
+  machine->jit = isolate->jit;
+
+  Value *values = malloc(sizeof(Value) * (isolate->argCount + 1));
+  bool ok = unpackValues(&isolate->package, values, isolate->argCount + 1);
+  if (!ok) {
+    runtimeError("spawn() couldn't set up the isolate, does fn use a native "
+                 "the host defined?");
+  }
+  for (int i = 0; ok && i <= isolate->argCount; i++) {
+    push(values[i]);
+  }
+  Message message;
+  if (ok && callNow(isolate->argCount)) {
+    if (!packMessage(pop(), &message)) {
+      runtimeError("spawn()'s function has to return a number, boolean, "
+                   "null, string, array or channel.");
+    } else {
+      SendResult result = sendMessage(isolate->done, &message);
+      if (result == SEND_LOOPS) {
+        runtimeError("spawn()'s function can't return something that leads "
+                     "back to its own channel.");
+      }
+      if (result != SENT) {
+        freeMessage(&message); // or somebody closed it already
+      }
+    }
+  }
+  closeChannel(isolate->done);
+  releaseChannel(isolate->done);
+
+  // the functions' code lives in the package
+  free(values);
+  freeVM(machine);
+  freeProgram(&isolate->package);
+  free(isolate);
+  return NULL;
+}
+
+// spawn(fn, args)
+static Value spawnNative(int argCount, Value *args) {
+  if (argCount < 1 || argCount > 2 || !IS_CLOSURE(args[0]) ||
+      (argCount == 2 && !IS_ARRAY(args[1]))) {
+    runtimeError("spawn expects a function and an array of arguments.");
+    return NULL_VAL;
+  }
+  ValueArray *arguments = argCount == 2 ? &PAYLOAD_ARRAY(args[1])->elements
+                                        : NULL;
+  int count = arguments == NULL ? 0 : arguments->count;
+  if (count > 255) {
+    runtimeError("Can't have more than 255 params");
+    return NULL_VAL;
+  }
+  Value *values = malloc(sizeof(Value) * (count + 1));
+  values[0] = args[0];
+  for (int i = 0; i < count; i++) {
+    values[i + 1] = arguments->values[i];
+  }
+  Isolate *isolate = calloc(1, sizeof(Isolate));
+  bool ok = packValues(values, count + 1, false, &isolate->package);
+  free(values);
+  if (!ok) {
+    free(isolate);
+    runtimeError("spawn() can't copy fn into an isolate, it reaches a native "
+                 "holding state (a bound method, an open file).");
+    return NULL_VAL;
+  }
+  isolate->argCount = count;
+  isolate->jit = vm->jit;
+  Channel *done = newChannel(1);
+  ObjNative *native = channelObject(done);
+  isolate->done = holdChannel(done);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, runIsolate, isolate) != 0) {
+    releaseChannel(done);
+    freeProgram(&isolate->package);
+    free(isolate);
+    runtimeError("spawn() couldn't start a thread.");
+    return NULL_VAL;
+  }
+  pthread_detach(thread);
+  return OBJ_VAL(native);
+}
+
+void defineIsolateNatives() {
+  defineNative("spawn", spawnNative);
+  defineNative("channel", channelMakeNative);
+  defineNative("send", sendNative);
+  defineNative("receive", receiveNative);
+  defineNative("close", closeNative);
+}
@@ -0,0 +1,287 @@
+#include "../../include/vm/natives.h"
+#include "../../include/bytecode/number.h"
+#include "../../include/vm/vm.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// the natives report bad arguments through runtimeError() and return
+// NULL_VAL, callValue() sees the reset stack and stops the script
+
+static bool checkString(const char *native, Value value) {
+  if (!IS_STRING(value)) {
+    runtimeError("%s expects a string.", native);
+    return false;
+  }
+  return true;
+}
+
+static bool checkArgs(const char *native, int argCount, int expected) {
+  if (argCount != expected) {
+    runtimeError("%s expects %d arguments but got %d.", native, expected,
+                 argCount);
+    return false;
+  }
+  return true;
+}
+
+// first needle in haystack at or after `from`, -1 if there's none. memchr
+// finds the candidates for the first byte (libc does that with SIMD), memcmp
+// checks the rest
+static int findString(StringObj *haystack, int from, StringObj *needle) {
+  const char *chars = flattenString(haystack);
+  const char *first = flattenString(needle);
+  if (needle->length == 0) {
+    return from <= haystack->length ? from : -1;
+  }
+  // before working out `last`, which would point in front of chars
+  if (needle->length > haystack->length - from) {
+    return -1;
+  }
+  const char *at = chars + from;
+  const char *last = chars + haystack->length - needle->length;
+  while (at <= last) {
+    at = memchr(at, first[0], last - at + 1);
+    if (at == NULL) {
+      return -1;
+    }
+    if (memcmp(at + 1, first + 1, needle->length - 1) == 0) {
+      return (int)(at - chars);
+    }
+    at++;
+  }
+  return -1;
+}
+
+static Value lenNative(int argCount, Value *args) {
+  if (!checkArgs("len", argCount, 1)) {
+    return NULL_VAL;
+  }
+  if (IS_ARRAY(args[0])) {
+    return arrayLength(args[0]);
+  }
+  if (!checkString("len", args[0])) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(PAYLOAD_STRING(args[0])->length);
+}
+
+// a whole number, checked before casting so 2.5 doesn't quietly become 2
+static bool isIndex(double number) { return number == floor(number); }
+
+// a one character string, NULL past either end like arrays do, and for an
+// index that isn't a whole number
+static Value charAtNative(int argCount, Value *args) {
+  if (!checkArgs("charAt", argCount, 2) || !checkString("charAt", args[0])) {
+    return NULL_VAL;
+  }
+  if (!IS_NUMBER(args[1])) {
+    runtimeError("charAt expects a number index.");
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  double index = PAYLOAD_NUMBER(args[1]);
+  if (!isIndex(index) || index < 0 || index >= string->length) {
+    return NULL_VAL;
+  }
+  return OBJ_VAL(sliceString(string, (int)index, 1));
+}
+
+static Value indexOfNative(int argCount, Value *args) {
+  if (!checkArgs("indexOf", argCount, 2) || !checkString("indexOf", args[0]) ||
+      !checkString("indexOf", args[1])) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(
+      findString(PAYLOAD_STRING(args[0]), 0, PAYLOAD_STRING(args[1])));
+}
+
+static Value startsWithNative(int argCount, Value *args) {
+  if (!checkArgs("startsWith", argCount, 2) ||
+      !checkString("startsWith", args[0]) ||
+      !checkString("startsWith", args[1])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  StringObj *prefix = PAYLOAD_STRING(args[1]);
+  return BOOL_VAL(prefix->length <= string->length &&
+                  memcmp(flattenString(string), flattenString(prefix),
+                         prefix->length) == 0);
+}
+
+// substring(s, start, end), end is optional and both get clamped to the
+// string like slice() in js. NULL if either isn't a whole number
+static Value substringNative(int argCount, Value *args) {
+  if (argCount != 2 && argCount != 3) {
+    runtimeError("substring expects 2 or 3 arguments but got %d.", argCount);
+    return NULL_VAL;
+  }
+  if (!checkString("substring", args[0])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  if (!IS_NUMBER(args[1]) || (argCount == 3 && !IS_NUMBER(args[2]))) {
+    runtimeError("substring expects number indexes.");
+    return NULL_VAL;
+  }
+  double start = PAYLOAD_NUMBER(args[1]);
+  double end = argCount == 3 ? PAYLOAD_NUMBER(args[2]) : string->length;
+  if (!isIndex(start) || !isIndex(end)) {
+    return NULL_VAL;
+  }
+  start = start < 0 ? 0 : start > string->length ? string->length : start;
+  end = end < start ? start : end > string->length ? string->length : end;
+  return OBJ_VAL(sliceString(string, (int)start, (int)(end - start)));
+}
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+static Value trimNative(int argCount, Value *args) {
+  if (!checkArgs("trim", argCount, 1) || !checkString("trim", args[0])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  const char *chars = flattenString(string);
+  int start = 0;
+  int end = string->length;
+  while (start < end && isSpace(chars[start])) {
+    start++;
+  }
+  while (end > start && isSpace(chars[end - 1])) {
+    end--;
+  }
+  return OBJ_VAL(sliceString(string, start, end - start));
+}
+
+// split(s, separator) into an array of slices, an empty separator splits
+// into characters
+static Value splitNative(int argCount, Value *args) {
+  if (!checkArgs("split", argCount, 2) || !checkString("split", args[0]) ||
+      !checkString("split", args[1])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  StringObj *separator = PAYLOAD_STRING(args[1]);
+  Value array = OBJ_VAL(newArray());
+  push(array); // nothing collects yet, but it's where it'd be safe
+  if (separator->length == 0) {
+    for (int i = 0; i < string->length; i++) {
+      arrayPush(array, OBJ_VAL(sliceString(string, i, 1)));
+    }
+  } else {
+    int start = 0;
+    int found;
+    while ((found = findString(string, start, separator)) >= 0) {
+      arrayPush(array, OBJ_VAL(sliceString(string, start, found - start)));
+      start = found + separator->length;
+    }
+    arrayPush(array,
+              OBJ_VAL(sliceString(string, start, string->length - start)));
+  }
+  pop();
+  return array;
+}
+
+// replace(s, from, to), every occurrence
+static Value replaceNative(int argCount, Value *args) {
+  if (!checkArgs("replace", argCount, 3) || !checkString("replace", args[0]) ||
+      !checkString("replace", args[1]) || !checkString("replace", args[2])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  StringObj *from = PAYLOAD_STRING(args[1]);
+  StringObj *to = PAYLOAD_STRING(args[2]);
+  if (from->length == 0 || findString(string, 0, from) < 0) {
+    return args[0];
+  }
+  const char *chars = flattenString(string);
+  const char *replacement = flattenString(to);
+  int capacity = string->length + 1;
+  int length = 0;
+  char *result = malloc(capacity);
+  int start = 0;
+  int found;
+  while (true) {
+    found = findString(string, start, from);
+    int copy = (found < 0 ? string->length : found) - start;
+    int needed = length + copy + (found < 0 ? 0 : to->length) + 1;
+    if (needed > capacity) {
+      capacity = needed * 2;
+      result = realloc(result, capacity);
+    }
+    memcpy(result + length, chars + start, copy);
+    length += copy;
+    if (found < 0) {
+      break;
+    }
+    memcpy(result + length, replacement, to->length);
+    length += to->length;
+    start = found + from->length;
+  }
+  result[length] = '\0';
+  return OBJ_VAL(makeObjWithString(result, length));
+}
+
+// str(x), numbers come out the way leverage() prints them
+static Value strNative(int argCount, Value *args) {
+  if (!checkArgs("str", argCount, 1)) {
+    return NULL_VAL;
+  }
+  Value value = args[0];
+  if (IS_STRING(value)) {
+    return value;
+  }
+  char scratch[NUMBER_BUFFER_SIZE];
+  const char *text = scratch;
+  int length;
+  switch (value.type) {
+  case VAL_NUMBER:
+    length = formatNumber(PAYLOAD_NUMBER(value), scratch);
+    break;
+  case VAL_BOOL:
+    text = PAYLOAD_BOOL(value) ? "true" : "false";
+    length = strlen(text);
+    break;
+  case VAL_NULL:
+    text = "NULL";
+    length = 4;
+    break;
+  default:
+    runtimeError("str can't convert that.");
+    return NULL_VAL;
+  }
+  char *chars = malloc(length + 1);
+  memcpy(chars, text, length);
+  chars[length] = '\0';
+  return OBJ_VAL(makeObjWithString(chars, length));
+}
+
+// parseNumber(s), blockchain when s isn't a number
+static Value parseNumberNative(int argCount, Value *args) {
+  if (!checkArgs("parseNumber", argCount, 1) ||
+      !checkString("parseNumber", args[0])) {
+    return NULL_VAL;
+  }
+  StringObj *string = PAYLOAD_STRING(args[0]);
+  double value;
+  if (!parseNumber(flattenString(string), string->length, &value)) {
+    return NULL_VAL;
+  }
+  return NUMBER_VAL(value);
+}
+
+void defineStringNatives() {
+  defineNative("str", strNative);
+  defineNative("parseNumber", parseNumberNative);
+  defineNative("len", lenNative);
+  defineNative("charAt", charAtNative);
+  defineNative("indexOf", indexOfNative);
+  defineNative("split", splitNative);
+  defineNative("substring", substringNative);
+  defineNative("trim", trimNative);
+  defineNative("startsWith", startsWithNative);
+  defineNative("replace", replaceNative);
+}
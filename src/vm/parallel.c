@@ -0,0 +1,323 @@
+#include "../../include/vm/parallel.h"
+#include "../../include/bytecode/image.h"
+#include "../../include/memory.h"
+#include "../../include/vm/vm.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// chunks per worker to start with, smaller chunks balance better but take
+// the lock more often
+#define CHUNKS_PER_WORKER 8
+
+typedef struct Pool Pool;
+
+// one thread's share of the indexes, [next, end). It takes chunks off the
+// front, thieves take the back half
+typedef struct {
+  pthread_mutex_t lock;
+  int next;
+  int end;
+  int id;
+  Pool *pool;
+  // what it worked out, packed once it's done
+  int *indexes;
+  int count;
+  Image results;
+  bool failed;
+} Worker;
+
+struct Pool {
+  Image package;   // fn, then the array unless it's read in place
+  Value *elements; // the caller's elements, when they're plain values
+  int grain;
+  bool jit;
+  atomic_bool stop; // somebody hit a runtime error
+  Worker *workers;
+  int workerCount;
+  // under helpersLock: workers handed out so far, and helpers still on one
+  int claimed;
+  int running;
+};
+
+// the helper threads, started the first time a map needs them and kept for
+// the rest of the process so a map doesn't pay for creating and joining
+// threads. The VMs aren't kept: nothing a VM makes is freed before freeVM(),
+// so one that lived across maps would keep every object they ever made.
+// One map has the helpers at a time, one that starts while they're busy
+// (another isolate's) runs on its caller's thread alone
+static pthread_mutex_t helpersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t helpersWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t helpersDone = PTHREAD_COND_INITIALIZER;
+static int helperCount = 0;
+static bool helpersBusy = false;
+static Pool *helping = NULL; // the map they take workers from
+
+static bool takeOwn(Worker *worker, int *from, int *to) {
+  pthread_mutex_lock(&worker->lock);
+  bool found = worker->next < worker->end;
+  if (found) {
+    *from = worker->next;
+    *to = worker->next + worker->pool->grain;
+    if (*to > worker->end) {
+      *to = worker->end;
+    }
+    worker->next = *to;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return found;
+}
+
+// the back half of the first share that has anything left, which becomes
+// the thief's own share so it can be stolen from in turn
+static bool steal(Worker *thief, int *from, int *to) {
+  Pool *pool = thief->pool;
+  for (int i = 1; i < pool->workerCount; i++) {
+    Worker *victim = &pool->workers[(thief->id + i) % pool->workerCount];
+    pthread_mutex_lock(&victim->lock);
+    int left = victim->end - victim->next;
+    int start = victim->end - (left + 1) / 2;
+    int end = victim->end;
+    if (left > 0) {
+      victim->end = start;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (left > 0) {
+      pthread_mutex_lock(&thief->lock);
+      thief->next = start;
+      thief->end = end;
+      pthread_mutex_unlock(&thief->lock);
+      return takeOwn(thief, from, to);
+    }
+  }
+  return false;
+}
+
+// runs in a VM of its own, on its own thread or the caller's
+static void *work(void *argument) {
+  Worker *worker = argument;
+  Pool *pool = worker->pool;
+  VM *machine = newVM();
+  machine->jit = pool->jit;
+  machine->worker = true;
+
+  Value roots[2];
+  bool inPlace = pool->elements != NULL;
+  bool ok = unpackValues(&pool->package, roots, inPlace ? 1 : 2);
+  if (!ok) {
+    runtimeError("parallelMap() couldn't set up a worker, does fn use a "
+                 "native the host defined?");
+  }
+  Value *elements =
+      ok && !inPlace ? PAYLOAD_ARRAY(roots[1])->elements.values : pool->elements;
+  Value *results = NULL;
+  int capacity = 0;
+  int from;
+  int to;
+  while (ok && !atomic_load_explicit(&pool->stop, memory_order_relaxed) &&
+         (takeOwn(worker, &from, &to) || steal(worker, &from, &to))) {
+    for (int i = from; i < to && ok; i++) {
+      push(roots[0]);
+      push(elements[i]);
+      ok = callNow(1);
+      if (!ok) {
+        break;
+      }
+      if (worker->count == capacity) {
+        int oldCapacity = capacity;
+        capacity = GROW_CAPACITY(oldCapacity);
+        results = grow_array(sizeof(Value), results, oldCapacity, capacity);
+        worker->indexes =
+            grow_array(sizeof(int), worker->indexes, oldCapacity, capacity);
+      }
+      worker->indexes[worker->count] = i;
+      results[worker->count++] = pop();
+    }
+  }
+  if (ok && !packValues(results, worker->count, true, &worker->results)) {
+    runtimeError("parallelMap() results can only be numbers, booleans, null, "
+                 "strings, arrays and channels.");
+    ok = false;
+  }
+  if (!ok) {
+    worker->failed = true;
+    atomic_store(&pool->stop, true);
+  }
+  free(results);
+  freeVM(machine);
+  return NULL;
+}
+
+static void *help(void *argument) {
+  (void)argument;
+  pthread_mutex_lock(&helpersLock);
+  for (;;) {
+    while (helping == NULL || helping->claimed == helping->workerCount) {
+      pthread_cond_wait(&helpersWake, &helpersLock);
+    }
+    Pool *pool = helping;
+    Worker *worker = &pool->workers[pool->claimed++];
+    pool->running++;
+    pthread_mutex_unlock(&helpersLock);
+    work(worker);
+    pthread_mutex_lock(&helpersLock);
+    if (--pool->running == 0) {
+      pthread_cond_broadcast(&helpersDone);
+    }
+  }
+  return NULL;
+}
+
+// the helpers for a map of wanted workers besides the caller, starting
+// any that don't exist yet. False if they're busy or none could start
+static bool reserveHelpers(int wanted) {
+  pthread_mutex_lock(&helpersLock);
+  bool reserved = !helpersBusy;
+  while (reserved && helperCount < wanted) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, help, NULL) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    helperCount++;
+  }
+  reserved = reserved && helperCount > 0;
+  helpersBusy = reserved;
+  pthread_mutex_unlock(&helpersLock);
+  return reserved;
+}
+
+// hands the caller's map's workers out, the caller has worker 0
+static void startHelpers(Pool *pool) {
+  pthread_mutex_lock(&helpersLock);
+  pool->claimed = 1;
+  pool->running = 0;
+  helping = pool;
+  pthread_cond_broadcast(&helpersWake);
+  pthread_mutex_unlock(&helpersLock);
+}
+
+// once the caller runs out of work: workers nobody claimed yet had their
+// shares stolen, so only the ones running need waiting for
+static void finishHelpers(Pool *pool) {
+  pthread_mutex_lock(&helpersLock);
+  helping = NULL;
+  while (pool->running > 0) {
+    pthread_cond_wait(&helpersDone, &helpersLock);
+  }
+  helpersBusy = false;
+  pthread_mutex_unlock(&helpersLock);
+}
+
+static int workersFor(int length) {
+  // a worker's own parallelMap() calls run on its one thread, there's
+  // already one of them per core
+  int count = PARALLEL_WORKERS > 0 ? PARALLEL_WORKERS
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (vm->worker || count < 1) {
+    count = 1;
+  }
+  return count < length ? count : length;
+}
+
+// every worker's results into one array, in the caller's VM
+static bool merge(Pool *pool, ObjArray *array, int length) {
+  for (int i = 0; i < length; i++) {
+    writeValueArray(&array->elements, NULL_VAL);
+  }
+  for (int w = 0; w < pool->workerCount; w++) {
+    Worker *worker = &pool->workers[w];
+    if (worker->count == 0) {
+      continue; // it never got to anything, nothing got packed
+    }
+    Value *values = malloc(sizeof(Value) * (worker->count + 1));
+    bool ok = unpackValues(&worker->results, values, worker->count);
+    for (int i = 0; ok && i < worker->count; i++) {
+      array->elements.values[worker->indexes[i]] = values[i];
+    }
+    free(values);
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static Value parallelMapNative(int argCount, Value *args) {
+  if (argCount != 2 || !IS_ARRAY(args[0]) || !IS_CLOSURE(args[1])) {
+    runtimeError("parallelMap expects an array and a function.");
+    return NULL_VAL;
+  }
+  ValueArray *elements = &PAYLOAD_ARRAY(args[0])->elements;
+  int length = elements->count;
+  bool inPlace = true;
+  for (int i = 0; i < length && inPlace; i++) {
+    inPlace = !IS_OBJ(elements->values[i]);
+  }
+
+  Pool pool = {0};
+  Value roots[2] = {args[1], args[0]};
+  if (!packValues(roots, inPlace ? 1 : 2, false, &pool.package)) {
+    runtimeError("parallelMap() can't copy fn into its workers, it reaches "
+                 "a native holding state (a bound method, an open file).");
+    return NULL_VAL;
+  }
+  pool.elements = inPlace ? elements->values : NULL;
+  pool.jit = vm->jit;
+  pool.workerCount = length > 0 ? workersFor(length) : 0;
+  bool helped =
+      pool.workerCount > 1 && reserveHelpers(pool.workerCount - 1);
+  if (!helped && pool.workerCount > 1) {
+    pool.workerCount = 1;
+  }
+  pool.grain = length / (pool.workerCount * CHUNKS_PER_WORKER + 1) + 1;
+  atomic_init(&pool.stop, false);
+  pool.workers = calloc(pool.workerCount + 1, sizeof(Worker));
+  for (int w = 0; w < pool.workerCount; w++) {
+    Worker *worker = &pool.workers[w];
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->id = w;
+    worker->pool = &pool;
+    worker->next = (int)((long)length * w / pool.workerCount);
+    worker->end = (int)((long)length * (w + 1) / pool.workerCount);
+  }
+
+  // the caller's thread does the first share itself
+  VM *caller = vm;
+  if (helped) {
+    startHelpers(&pool);
+  }
+  if (pool.workerCount > 0) {
+    work(&pool.workers[0]);
+  }
+  if (helped) {
+    finishHelpers(&pool);
+  }
+  useVM(caller);
+
+  // a share no helper claimed got stolen by the others
+  bool failed = false;
+  for (int w = 0; w < pool.workerCount; w++) {
+    failed = failed || pool.workers[w].failed;
+  }
+  ObjArray *result = newArray();
+  bool ok = !failed && merge(&pool, result, length);
+  if (!ok) {
+    runtimeError("parallelMap() failed.");
+  }
+
+  for (int w = 0; w < pool.workerCount; w++) {
+    Worker *worker = &pool.workers[w];
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->indexes);
+    freeProgram(&worker->results);
+  }
+  free(pool.workers);
+  freeProgram(&pool.package);
+  return ok ? OBJ_VAL(result) : NULL_VAL;
+}
+
+void defineParallelNatives() {
+  defineNative("parallelMap", parallelMapNative);
+}
@@ -1,37 +1,59 @@
 #include "../../include/vm/vm.h"
+#include "../../include/aot/aot.h"
 #include "../../include/bytecode/object.h"
+#include "../../include/bytecode/verify.h"
 #include "../../include/common.h"
 #include "../../include/compiler/compiler.h"
 #include "../../include/debug.h"
+#include "../../include/io/files.h"
+#include "../../include/jit/jit.h"
+#include "../../include/jit/trace.h"
 #include "../../include/memory.h"
+#include "../../include/output.h"
+#include "../../include/vm/decode.h"
+#include "../../include/vm/isolates.h"
+#include "../../include/vm/natives.h"
+#include "../../include/vm/parallel.h"
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
-VM vm;
+_Thread_local VM *vm;
+
+// run() jumps from one instruction's handler straight to the next one's with
+// gcc's labels as values, anything else gets the plain switch
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION)
+#define THREADED_DISPATCH
+#endif
 
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+// flush(), pushes out whatever leverage() has buffered so far
+static Value flushNative(int argCount, Value *args) {
+  flushOutput();
+  return NULL_VAL;
+}
+static Value peek(int distance) { return vm->stackTop[-1 - distance]; }
 
 static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
 }
-static void runtimeError(const char *format, ...) {
+void runtimeError(const char *format, ...) {
+  flushOutput(); // so what got printed before shows up before the error
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame *frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in", getLine(&function->chunk, instruction));
     if (function->name == NULL) {
       fprintf(stderr, "<script> \n");
 
@@ -41,27 +63,58 @@ static void runtimeError(const char *format, ...) {
   }
   resetStack();
 }
-static void defineNative(const char *name, NativeFunction function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  set(&vm.globals, vm.stack[1], PAYLOAD_STRING(vm.stack[0]));
+ObjNative *defineNative(const char *name, NativeFunction function) {
+  StringObj *global = copyString(name, (int)strlen(name));
+  push(OBJ_VAL(global));
+  ObjNative *native = newNative(function);
+  push(OBJ_VAL(native));
+  native->name = global;
+  set(&vm->globals, OBJ_VAL(native), global);
   pop();
   pop();
+  return native;
+}
+// functions from a .saasc image haven't been verified until their first
+// call (see loadImage()), and with --lazy a function's body doesn't even get
+// compiled until then
+static bool prepareCall(ObjFunction *function) {
+  if (function->lazy != NULL) {
+    if (!compileLazy(function)) {
+      runtimeError("Couldn't compile %s()", function->name->chars);
+      return false;
+    }
+    return true; // compiling verified it
+  }
+  const char *problem = verifyFunction(function);
+  if (problem != NULL) {
+    runtimeError("Bad bytecode in %s: %s",
+                 function->name == NULL ? "<script>" : function->name->chars,
+                 problem);
+    return false;
+  }
+  return true;
 }
 static bool call(ObjClosure *closure, int argCount) {
+  if (closure->function->maxStack == 0 && !prepareCall(closure->function)) {
+    return false;
+  }
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d", closure->function->arity,
                  argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
+  // the verifier worked out how deep the callee can go, so this is the only
+  // place the stack needs checking
+  if (vm->frameCount == FRAMES_MAX ||
+      vm->stackTop - argCount - 1 + closure->function->maxStack >
+          vm->stack + STACK_MAX) {
     runtimeError("Stack Overflow");
     return false;
   }
-  CallFrame *frame = &vm.frames[vm.frameCount++];
+  CallFrame *frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = vm->stackTop - argCount - 1;
   return true;
 }
 static bool callValue(Value callee, int argCount) {
@@ -74,8 +127,13 @@ static bool callValue(Value callee, int argCount) {
       return call(PAYLOAD_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
       NativeFunction native = PAYLOAD_NATIVE(callee);
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount + 1;
+      Value result = native(argCount, vm->stackTop - argCount);
+      // the callee is always on the stack, unless it called runtimeError()
+      // and that reset it. frameCount can't tell when the host called it
+      if (vm->stackTop == vm->stack) {
+        return false;
+      }
+      vm->stackTop -= argCount + 1;
       push(result);
       return true;
     }
@@ -87,40 +145,33 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-// Forward declarations - these are in object.c
+// the array a method got looked up on, getProperty() leaves it in the bound
+// native's state. args[-1] is the callee, same as readLines()' reader
+static Value receiverOf(Value *args) {
+  return OBJ_VAL((Obj *)((ObjNative *)PAYLOAD_OBJ(args[-1]))->state);
+}
 
 static Value arrayPushNative(int argCount, Value *args) {
-  // args[0] is the array (receiver), args[1] is the element to push
-  if (argCount != 2) {
-    runtimeError("push expects 1 argument, got %d", argCount - 1);
-    return NULL_VAL;
-  }
-  Value arrayVal = args[0];
-  Value element = args[1];
-  if (!IS_ARRAY(arrayVal)) {
-    runtimeError("push called on non-array");
+  // args[0] is the element to push
+  if (argCount != 1) {
+    runtimeError("push expects 1 argument, got %d", argCount);
     return NULL_VAL;
   }
-  arrayPush(arrayVal, element);
+  Value arrayVal = receiverOf(args);
+  arrayPush(arrayVal, args[0]);
   return arrayVal;
 }
 
 static Value arrayPopNative(int argCount, Value *args) {
-  // args[0] is the array (receiver)
-  if (argCount != 1) {
-    runtimeError("pop expects 0 arguments, got %d", argCount - 1);
+  if (argCount != 0) {
+    runtimeError("pop expects 0 arguments, got %d", argCount);
     return NULL_VAL;
   }
-  Value arrayVal = args[0];
-  if (!IS_ARRAY(arrayVal)) {
-    runtimeError("pop called on non-array");
-    return NULL_VAL;
-  }
-  return arrayPop(arrayVal);
+  return arrayPop(receiverOf(args));
 }
 static ObjUpvalue *captureUpvalue(Value *local) {
   ObjUpvalue *prev = NULL;
-  ObjUpvalue *current = vm.openUpvalues;
+  ObjUpvalue *current = vm->openUpvalues;
   while (current != NULL && current->location > local) {
     prev = current;
     current = current->next;
@@ -131,52 +182,376 @@ static ObjUpvalue *captureUpvalue(Value *local) {
   ObjUpvalue *createdUpvalue = newUpvalue(local);
   createdUpvalue->next = current;
   if (prev == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    vm->openUpvalues = createdUpvalue;
   } else {
     prev->next = createdUpvalue;
   }
   return createdUpvalue;
 }
 static void closeUpvalues(Value *last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.openUpvalues;
+  while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+    ObjUpvalue *upvalue = vm->openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    vm->openUpvalues = upvalue->next;
+  }
+}
+static InterpretResult run(int baseFrame);
+
+// OP_CALL, shared with the jit. The callee and its arguments get replaced
+// by the result, array methods included since their array is bound into the
+// native (see getProperty())
+bool callOperand(int argCount) { return callValue(peek(argCount), argCount); }
+
+// runs the frame on top of vm->frames until it returns, through the jit if the
+// function is hot enough. Used by native code calling back into script code
+bool runFrame() {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  if (frame->closure->function->aotCode != NULL) {
+    return ((AotFunction)frame->closure->function->aotCode)(frame);
+  }
+  if (vm->jit && jitHot(frame->closure->function)) {
+    return jitEnter(frame);
+  }
+  return run(vm->frameCount - 1) == INTERPRET_OK;
+}
+
+bool callNow(int argCount) {
+  int frameCount = vm->frameCount;
+  return callOperand(argCount) && (vm->frameCount == frameCount || runFrame());
+}
+
+// finishes the top frame in the interpreter from wherever its ip is, for
+// native code that has to hand over mid function
+bool resumeFrame() { return run(vm->frameCount - 1) == INTERPRET_OK; }
+
+// pops the top frame and leaves its return value on the caller's stack
+void returnFrame() {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm->frameCount--;
+  vm->stackTop = frame->slots;
+  push(result);
+}
+
+// reads the (isLocal, index) pairs that follow OP_CLOSURE
+void makeClosure(CallFrame *frame, ObjFunction *function, uint8_t *operands) {
+  ObjClosure *closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *operands++;
+    uint8_t index = *operands++;
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(frame->slots + index);
+
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+}
+
+void closeTopUpvalue() {
+  closeUpvalues(vm->stackTop - 1);
+  pop();
+}
+
+bool getGlobal(StringObj *name) {
+  Entry *lookup = lookUp(&vm->globals, name->chars, name->hash, name->length);
+  if (lookup == NULL) {
+
+    runtimeError("Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  push(lookup->value);
+  return true;
+}
+
+bool setGlobal(StringObj *name) {
+  Entry *lookup = lookUp(&vm->globals, name->chars, name->hash, name->length);
+  if (lookup == NULL) {
+    runtimeError("Undefined variable %s", name->chars);
+    return false;
+  }
+  lookup->value = peek(0);
+  return true;
+}
+
+void makeArray(int elementCount) {
+  ObjArray *array = newArray();
+  // Pop elements from stack and store them temporarily
+  // Stack has elements in order: [elem0, elem1, elem2, ...]
+  // We need to reverse them when popping, then add in correct order
+  Value *tempElements = malloc(sizeof(Value) * elementCount);
+  for (int i = elementCount - 1; i >= 0; i--) {
+    tempElements[i] = pop();
+  }
+  // Now add them to array in correct order
+  for (int i = 0; i < elementCount; i++) {
+    arrayPush(OBJ_VAL(array), tempElements[i]);
+  }
+  free(tempElements);
+  push(OBJ_VAL(array));
+}
+
+bool getIndex() {
+  Value indexVal = pop();
+  Value arrayVal = pop();
+  if (!IS_ARRAY(arrayVal)) {
+    runtimeError("Index operation on non-array");
+    return false;
   }
+  if (!IS_NUMBER(indexVal)) {
+    runtimeError("Array index must be a number");
+    return false;
+  }
+  int index = (int)PAYLOAD_NUMBER(indexVal);
+  Value element = arrayGet(arrayVal, index);
+  push(element);
+  return true;
 }
+
+bool setIndex() {
+  Value value = pop();
+  Value indexVal = pop();
+  Value arrayVal = pop();
+  if (!IS_ARRAY(arrayVal)) {
+    runtimeError("Index assignment on non-array");
+    return false;
+  }
+  if (!IS_NUMBER(indexVal)) {
+    runtimeError("Array index must be a number");
+    return false;
+  }
+  int index = (int)PAYLOAD_NUMBER(indexVal);
+  arraySet(arrayVal, index, value);
+  push(value);
+  return true;
+}
+
+bool getProperty(StringObj *name) {
+  Value object = peek(0);
+  if (!IS_ARRAY(object)) {
+    runtimeError("Property access on non-array");
+    return false;
+  }
+  // array methods come back as natives bound to the array, so the array
+  // gets swapped for the method like any other property
+  if (strncmp(name->chars, "fund", name->length) == 0 && name->length == 4) {
+    ObjNative *native = newNative(arrayPushNative);
+    native->state = PAYLOAD_OBJ(object);
+    vm->stackTop[-1] = OBJ_VAL(native);
+  } else if (strncmp(name->chars, "churn", name->length) == 0 &&
+             name->length == 5) {
+    ObjNative *native = newNative(arrayPopNative);
+    native->state = PAYLOAD_OBJ(object);
+    vm->stackTop[-1] = OBJ_VAL(native);
+  } else if (strncmp(name->chars, "arr", name->length) == 0 &&
+             name->length == 3) {
+    Value length = arrayLength(object);
+    pop(); // Remove array from stack
+    push(length);
+  } else {
+    runtimeError("Unknown property '%.*s'", name->length, name->chars);
+    return false;
+  }
+  return true;
+}
+
 static bool isFalsey(Value value) {
   return IS_NULL(value) || (IS_BOOL(value) && !PAYLOAD_BOOL(value));
 }
 
-static void concatenate() {
-  StringObj *last = PAYLOAD_STRING(pop());
-  StringObj *second_last = PAYLOAD_STRING(pop());
-  int new_len = last->length + second_last->length;
-  char *concat = malloc(sizeof(char) * new_len + 1);
-  strcpy(concat, second_last->chars);
-  strcat(concat, last->chars);
-  concat[new_len] = '\0';
-
-  StringObj *result = makeObjWithString(concat, new_len);
+// the two strings on top of the stack, joined. Long results are ropes so
+// building a string up in a loop doesn't copy it over and over
+void concatenate() {
+  StringObj *last = PAYLOAD_STRING(peek(0));
+  StringObj *second_last = PAYLOAD_STRING(peek(1));
+  StringObj *result = concatStrings(second_last, last);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE()                                                            \
-  (*frame->ip++) // dereferences vm.ip (index pointer) and moves the pointer
-                 // more
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() PAYLOAD_STRING(READ_CONSTANT())
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-  // reads the two bytes for the jump operation
+// the register instructions' general case, same results and errors as the
+// stack versions of the opcode
+bool binaryOp(uint8_t op, Value a, Value b, Value *result) {
+  if (op == OP_EQUAL_R) {
+    *result = BOOL_VAL(isEqual(a, b));
+    return true;
+  }
+  if (op == OP_ADD_R && IS_STRING(a) && IS_STRING(b)) {
+    push(a);
+    push(b);
+    concatenate();
+    *result = pop();
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    runtimeError(op == OP_ADD_R
+                     ? "Operands must be two numbers (addition) or two "
+                       "strings (concatenation)"
+                     : "Operands have to be numbers.");
+    return false;
+  }
+  double x = PAYLOAD_NUMBER(a);
+  double y = PAYLOAD_NUMBER(b);
+  switch (op) {
+  case OP_ADD_R:
+    *result = NUMBER_VAL(x + y);
+    break;
+  case OP_SUBSTRACT_R:
+    *result = NUMBER_VAL(x - y);
+    break;
+  case OP_MULITPLY_R:
+    *result = NUMBER_VAL(x * y);
+    break;
+  case OP_DIVIDE_R:
+    *result = NUMBER_VAL(x / y);
+    break;
+  case OP_GREATER_R:
+    *result = BOOL_VAL(x > y);
+    break;
+  default:
+    *result = BOOL_VAL(x < y);
+    break;
+  }
+  return true;
+}
+
+// OP_GET_GLOBAL/OP_SET_GLOBAL's slot in vm->globals, only looked up again after
+// the table grew or lost an entry. NULL if the global isn't defined
+static inline Entry *cachedGlobal(Instruction *instruction, StringObj *name) {
+  if (instruction->generation != vm->globals.generation) {
+    Entry *entry = lookUp(&vm->globals, name->chars, name->hash, name->length);
+    if (entry == NULL) {
+      return NULL;
+    }
+    instruction->as.entry = entry;
+    instruction->generation = vm->globals.generation;
+  }
+  return instruction->as.entry;
+}
+
+// runs until the frame at baseFrame returns, 0 runs the whole script. It runs
+// the decoded chunk (vm/decode.h): `pc` is the instruction being run and
+// frame->ip only gets written back with SYNC() before something that looks at
+// it, so calls, runtime errors, the jit and the trace recorder still see a
+// bytecode position
+static InterpretResult run(int baseFrame) {
+#ifdef THREADED_DISPATCH
+  static const void *const handlers[] = {
+      [OP_CONSTANT] = &&L_OP_CONSTANT,
+      [OP_NULL] = &&L_OP_NULL,
+      [OP_TRUE] = &&L_OP_TRUE,
+      [OP_FALSE] = &&L_OP_FALSE,
+      [OP_POP] = &&L_OP_POP,
+      [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+      [OP_EQUAL] = &&L_OP_EQUAL,
+      [OP_GREATER] = &&L_OP_GREATER,
+      [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+      [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+      [OP_LESS] = &&L_OP_LESS,
+      [OP_ADD] = &&L_OP_ADD,
+      [OP_SUBSTRACT] = &&L_OP_SUBSTRACT,
+      [OP_MULITPLY] = &&L_OP_MULITPLY,
+      [OP_DIVIDE] = &&L_OP_DIVIDE,
+      [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+      [OP_NEGATE] = &&L_OP_NEGATE,
+      [OP_NOT] = &&L_OP_NOT,
+      [OP_PRINT] = &&L_OP_PRINT,
+      [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+      [OP_JUMP] = &&L_OP_JUMP,
+      [OP_LOOP] = &&L_OP_LOOP,
+      [OP_CALL] = &&L_OP_CALL,
+      [OP_CLOSURE] = &&L_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&L_OP_RETURN,
+      [OP_GET_INDEX] = &&L_OP_GET_INDEX,
+      [OP_SET_INDEX] = &&L_OP_SET_INDEX,
+      [OP_ARRAY] = &&L_OP_ARRAY,
+      [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+      [OP_ADD_R] = &&L_OP_ADD_R,
+      [OP_SUBSTRACT_R] = &&L_OP_SUBSTRACT_R,
+      [OP_MULITPLY_R] = &&L_OP_MULITPLY_R,
+      [OP_DIVIDE_R] = &&L_OP_DIVIDE_R,
+      [OP_EQUAL_R] = &&L_OP_EQUAL_R,
+      [OP_GREATER_R] = &&L_OP_GREATER_R,
+      [OP_LESS_R] = &&L_OP_LESS_R,
+      [OP_MOVE_R] = &&L_OP_MOVE_R,
+  };
+  // every handler ends by jumping straight to the next one's label
+#define CASE(op) L_##op:
+#define DISPATCH()                                                             \
+  if (tracing)                                                                 \
+    goto record;                                                               \
+  else                                                                         \
+    goto *pc->handler
+#else
+  static const void *const *handlers = NULL;
+#define CASE(op) case op:
+#define DISPATCH() continue
+#endif
+  CallFrame *frame;
+  uint8_t *code;
+  Instruction *decoded;
+  uint32_t *decodedIndex;
+  Instruction *pc;
+  Value *constants;
+  // vm->tracing, which only changes in traceLoop(), traceRecord() and
+  // whatever a call runs, so it doesn't get loaded for every instruction
+  bool tracing;
+  // picks up whatever frame is on top now, from its ip
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frameCount - 1];                                     \
+    Chunk *chunk = &frame->closure->function->chunk;                           \
+    if (chunk->decoded == NULL)                                                \
+      decodeChunk(chunk, handlers);                                            \
+    code = chunk->code;                                                        \
+    decoded = chunk->decoded;                                                  \
+    decodedIndex = chunk->decodedIndex;                                        \
+    constants = chunk->constants.values;                                       \
+    pc = decoded + decodedIndex[frame->ip - code];                             \
+    tracing = vm->tracing;                                                     \
+  } while (false)
+  // frame->ip just past the current instruction, where reading it byte by
+  // byte would have left it
+#define SYNC() (frame->ip = code + pc[1].offset)
+#define NEXT()                                                                 \
+  pc++;                                                                        \
+  DISPATCH()
+#define READ_REGISTER(isConstant, index)                                       \
+  ((isConstant) ? constants[index] : frame->slots[index])
+  // op kinds dst a b, numbers inline and the rest through binaryOp()
+#define REGISTER_OP(valueType, symbol)                                             \
+  do {                                                                         \
+    uint8_t kinds = pc->operands[0];                                           \
+    Value a = READ_REGISTER(kinds & REG_A_CONSTANT, pc->operands[2]);          \
+    Value b = READ_REGISTER(kinds & REG_B_CONSTANT, pc->operands[3]);          \
+    Value result;                                                              \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      result = valueType(PAYLOAD_NUMBER(a) symbol PAYLOAD_NUMBER(b));          \
+    } else {                                                                   \
+      SYNC();                                                                  \
+      if (!binaryOp(pc->op, a, b, &result))                                    \
+        return INTERPRET_RUNTIME_ERROR;                                        \
+    }                                                                          \
+    if (kinds & REG_PUSH) {                                                    \
+      push(result);                                                            \
+    } else {                                                                   \
+      frame->slots[pc->operands[1]] = result;                                  \
+    }                                                                          \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+      SYNC();                                                                  \
       runtimeError("Operands have to be numbers.");                            \
+      return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
     double a = PAYLOAD_NUMBER(pop());                                          \
     double b = PAYLOAD_NUMBER(pop());                                          \
@@ -186,22 +561,54 @@ static InterpretResult run() {
 #ifdef DEBUG_PRINT_CODE
   printf("\n-----INTERPRETING-----\n\n");
 #endif
+  LOAD_FRAME();
+#ifdef THREADED_DISPATCH
+  DISPATCH();
+record:
+  frame->ip = code + pc->offset;
+  traceRecord(frame);
+  tracing = vm->tracing;
+  goto *pc->handler;
+#else
   for (;;) {
+    if (tracing) {
+      frame->ip = code + pc->offset;
+      traceRecord(frame);
+      tracing = vm->tracing;
+    }
 
 #ifdef DEBUG_TRACE_EXECUTION // only for debugging
-    printf("vm.ip: %p\n", frame->ip);
-    printf("vm.chunk->code: %p, offset: %ld\n",
-           &frame->closure->function->chunk.code,
-           frame->ip - frame->closure->function->chunk.code);
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-
+    printf("\n         ");
+    printf("VM stack:");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+      printf("[ ");
+      // printValue(*slot);
+      printf(" ]");
+    }
+    printf("\n\n");
+    printf("VM table: ");
+    if ((&vm->strings)->entries == NULL || (&vm->strings)->capacity == 0) {
+      printf("Table is empty\n");
+    } else {
+      Entry **entries = vm->strings.entries;
+      for (int i = 0; i < vm->strings.capacity; i++) {
+        if (entries[i] != NULL && entries[i]->key != NULL) {
+          printf("[ ");
+          printf("%s %p %p", entries[i]->key->chars, entries[i]->key,
+                 entries[i]);
+          printf(" ]");
+        }
+      }
+      printf("\n");
+    }
+    printf("vm.ip: %p\n", code + pc->offset);
+    printf("vm.chunk->code: %p, offset: %u\n", code, pc->offset);
+    disassembleInstruction(&frame->closure->function->chunk, (int)pc->offset);
+#endif
+    switch (pc->op) {
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
+    CASE(OP_CONSTANT) {
+      Value constant = constants[pc->operands[0]];
 #ifdef DEBUG_PRINT_CODE
       printf("PUSHED: ");
       printValue(constant);
@@ -211,18 +618,21 @@ static InterpretResult run() {
 #ifdef DEBUG_PRINT_CODE
       printf("\n");
 #endif
-      break;
+      NEXT();
     }
-    case OP_GREATER:
+    CASE(OP_GREATER) {
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      NEXT();
+    }
+    CASE(OP_LESS) {
       BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_POP:
+      NEXT();
+    }
+    CASE(OP_POP) {
       pop();
-      break;
-    case OP_ADD: {
+      NEXT();
+    }
+    CASE(OP_ADD) {
       if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
         concatenate();
 
@@ -232,361 +642,325 @@ static InterpretResult run() {
         push(NUMBER_VAL(last + second_last));
 
       } else {
+        SYNC();
         runtimeError("Operands must be two numbers (addition) or two strings "
                      "(concatenation)");
         return INTERPRET_RUNTIME_ERROR;
       }
       // BINARY_OP(NUMBER_VAL, +);
-      break;
+      NEXT();
     }
-    case OP_SUBSTRACT: {
+    CASE(OP_SUBSTRACT) {
       BINARY_OP(NUMBER_VAL, -);
-      break;
+      NEXT();
     }
-    case OP_MULITPLY: {
+    CASE(OP_MULITPLY) {
       BINARY_OP(NUMBER_VAL, *);
-      break;
+      NEXT();
     }
-    case OP_DIVIDE: {
+    CASE(OP_DIVIDE) {
 
       BINARY_OP(NUMBER_VAL, /);
-      break;
+      NEXT();
     }
-    case OP_NEGATE: {
+    CASE(OP_NEGATE) {
 
       // push(-pop());]
       if (!IS_NUMBER(peek(0))) {
+        SYNC();
         runtimeError("Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
       // stackTop = pointer to a value
-      (*(vm.stackTop - 1)).payload.number *= -1; // goofy aaah shit
-      break;
+      (*(vm->stackTop - 1)).payload.number *= -1; // goofy aaah shit
+      NEXT();
     }
-    case OP_NULL: {
+    CASE(OP_NULL) {
       push(NULL_VAL);
-      break;
+      NEXT();
     }
-    case OP_FALSE: {
+    CASE(OP_FALSE) {
       push(BOOL_VAL(false));
-      break;
+      NEXT();
     }
-    case OP_TRUE: {
+    CASE(OP_TRUE) {
       push(BOOL_VAL(true));
-      break;
+      NEXT();
     }
-    case OP_EQUAL: {
+    CASE(OP_EQUAL) {
       Value b = pop();
       Value a = pop();
       push(BOOL_VAL(isEqual(a, b)));
-      break;
+      NEXT();
     }
-    case OP_NOT: {
+    CASE(OP_NOT) {
       Value last = pop();
       Value new = BOOL_VAL(MAKE_NOT(last));
       push(new);
-      break;
+      NEXT();
     }
-    case OP_PRINT: {
+    CASE(OP_PRINT) {
       // printf(">> ");
       printValue(pop());
-      printf("\n");
-      break;
+      writeOutputChar('\n');
+      NEXT();
     }
-    case OP_DEFINE_GLOBAL: {
-      StringObj *name = READ_STRING();
-      set(&vm.globals, peek(0), name);
+    CASE(OP_DEFINE_GLOBAL) {
+      StringObj *name = PAYLOAD_STRING(constants[pc->operands[0]]);
+      set(&vm->globals, peek(0), name);
       pop();
-      break;
-    }
-    case OP_SET_GLOBAL: {
-      StringObj *name = READ_STRING();
-      Entry *lookup =
-          lookUp(&vm.globals, name->chars, name->hash, name->length);
-      if (lookup != NULL) {
-        set(&vm.globals, peek(0), name);
-      } else {
-        runtimeError("Undefined variable %s", name->chars);
+      NEXT();
+    }
+    CASE(OP_SET_GLOBAL) {
+      StringObj *name = PAYLOAD_STRING(constants[pc->operands[0]]);
+      Entry *entry = cachedGlobal(pc, name);
+      if (entry == NULL) {
+        SYNC();
+        setGlobal(name); // reports it
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
-    }
-    case OP_GET_GLOBAL: {
-      StringObj *name = READ_STRING();
-      Entry *lookup =
-          lookUp(&vm.globals, name->chars, name->hash, name->length);
-      if (lookup == NULL) {
-
-        runtimeError("Undefined variable '%s'.", name->chars);
+      entry->value = peek(0);
+      NEXT();
+    }
+    CASE(OP_GET_GLOBAL) {
+      StringObj *name = PAYLOAD_STRING(constants[pc->operands[0]]);
+      Entry *entry = cachedGlobal(pc, name);
+      if (entry == NULL) {
+        SYNC();
+        getGlobal(name); // reports it
         return INTERPRET_RUNTIME_ERROR;
       }
-      push(lookup->value);
-      break;
+      push(entry->value);
+      NEXT();
     }
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL) {
       // duplicates the existing slot in the VM stack to the top of the stack
       // for later use
-      uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      push(frame->slots[pc->operands[0]]);
+      NEXT();
     }
-    case OP_GET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+    CASE(OP_GET_UPVALUE) {
+      push(*frame->closure->upvalues[pc->operands[0]]->location);
+      NEXT();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+    CASE(OP_SET_UPVALUE) {
+      *frame->closure->upvalues[pc->operands[0]]->location = peek(0);
+      NEXT();
     }
-    case OP_CLOSE_UPVALUE: {
-      closeUpvalues(vm.stackTop - 1);
-      pop();
-      break;
+    CASE(OP_CLOSE_UPVALUE) {
+      closeTopUpvalue();
+      NEXT();
     }
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL) {
       // sets the slot to the top of the stack
-      uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
-    }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
-      break;
+      frame->slots[pc->operands[0]] = peek(0);
+      NEXT();
     }
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
-    }
-    case OP_LOOP: {
-      u_int16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+    CASE(OP_JUMP_IF_FALSE) {
+      if (isFalsey(peek(0))) {
+        pc = pc->as.target;
+        DISPATCH();
+      }
+      NEXT();
+    }
+    CASE(OP_JUMP) {
+      pc = pc->as.target;
+      DISPATCH();
+    }
+    CASE(OP_LOOP) {
+      pc = pc->as.target;
+      if (vm->jit) {
+        // may run a trace and move the ip to where it left
+        frame->ip = code + pc->offset;
+        traceLoop(frame);
+        pc = decoded + decodedIndex[frame->ip - code];
+        tracing = vm->tracing;
+      }
+      DISPATCH();
     }
-    case OP_CALL: {
-      int argCount = READ_BYTE();
-      Value callee = peek(argCount);
-      // For method calls on arrays: stack is [array, native_function, ...args]
-      // We need to rearrange to [native_function, array, ...args] before
-      // calling
-      if (IS_NATIVE(callee) && argCount >= 0) {
-        // Check if the value before the callee is an array (the receiver)
-        Value *stackBeforeCallee = vm.stackTop - argCount - 2;
-        if (stackBeforeCallee >= vm.stack && IS_ARRAY(*stackBeforeCallee)) {
-          // Rearrange stack: move array to be first argument
-          Value array = *stackBeforeCallee;
-          // Shift everything down
-          for (Value *p = stackBeforeCallee; p < vm.stackTop - 1; p++) {
-            *p = *(p + 1);
-          }
-          // Put array as first argument (right before callee)
-          vm.stackTop[-argCount - 1] = array;
-          // Now call with array as first arg
-          if (!callValue(callee, argCount + 1)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-        } else {
-          if (!callValue(callee, argCount)) {
-            return INTERPRET_RUNTIME_ERROR;
-          }
-        }
-      } else {
-        if (!callValue(callee, argCount)) {
+    CASE(OP_CALL) {
+      int frameCount = vm->frameCount;
+      SYNC();
+      if (!callOperand(pc->operands[0])) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      frame = &vm->frames[vm->frameCount - 1];
+      // a new frame means a script function, hand it to the jit once hot
+      if (vm->jit && vm->frameCount > frameCount &&
+          jitHot(frame->closure->function)) {
+        if (!jitEnter(frame)) {
           return INTERPRET_RUNTIME_ERROR;
         }
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
-      ObjFunction *function = PAYLOAD_FUNCTION(READ_CONSTANT());
-      ObjClosure *closure = newClosure(function);
-      push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
-
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
-      }
-      break;
+    CASE(OP_CLOSURE) {
+      ObjFunction *function = PAYLOAD_FUNCTION(constants[pc->operands[0]]);
+      makeClosure(frame, function, code + pc->offset + 2);
+      NEXT();
     }
-    case OP_RETURN: {
+    CASE(OP_RETURN) {
       // printValue(pop());
       // printf("\n");
-      Value result = pop();
-      closeUpvalues(frame->slots);
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
-        pop();
+      // the script's frame too, its null stays behind for interpretFunction()
+      // to pop, and a function the host called leaves its result there
+      returnFrame();
+      if (vm->frameCount == baseFrame) {
         return INTERPRET_OK;
       }
-      vm.stackTop = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_ARRAY: {
-      int elementCount = READ_BYTE();
-      ObjArray *array = newArray();
-      // Pop elements from stack and store them temporarily
-      // Stack has elements in order: [elem0, elem1, elem2, ...]
-      // We need to reverse them when popping, then add in correct order
-      Value *tempElements = malloc(sizeof(Value) * elementCount);
-      for (int i = elementCount - 1; i >= 0; i--) {
-        tempElements[i] = pop();
-      }
-      // Now add them to array in correct order
-      for (int i = 0; i < elementCount; i++) {
-        arrayPush(OBJ_VAL(array), tempElements[i]);
-      }
-      free(tempElements);
-      push(OBJ_VAL(array));
-      break;
+    CASE(OP_ARRAY) {
+      makeArray(pc->operands[0]);
+      NEXT();
     }
-    case OP_GET_INDEX: {
-      Value indexVal = pop();
-      Value arrayVal = pop();
-      if (!IS_ARRAY(arrayVal)) {
-        runtimeError("Index operation on non-array");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      if (!IS_NUMBER(indexVal)) {
-        runtimeError("Array index must be a number");
+    CASE(OP_GET_INDEX) {
+      SYNC();
+      if (!getIndex()) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      int index = (int)PAYLOAD_NUMBER(indexVal);
-      Value element = arrayGet(arrayVal, index);
-      push(element);
-      break;
+      NEXT();
     }
-    case OP_SET_INDEX: {
-      Value value = pop();
-      Value indexVal = pop();
-      Value arrayVal = pop();
-      if (!IS_ARRAY(arrayVal)) {
-        runtimeError("Index assignment on non-array");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      if (!IS_NUMBER(indexVal)) {
-        runtimeError("Array index must be a number");
+    CASE(OP_SET_INDEX) {
+      SYNC();
+      if (!setIndex()) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      int index = (int)PAYLOAD_NUMBER(indexVal);
-      arraySet(arrayVal, index, value);
-      push(value);
-      break;
+      NEXT();
     }
-    case OP_GET_PROPERTY: {
-      StringObj *name = READ_STRING();
-      Value object = peek(0);
-      if (!IS_ARRAY(object)) {
-        runtimeError("Property access on non-array");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-      // Handle array methods - create bound native functions
-      if (strncmp(name->chars, "fund", name->length) == 0 &&
-          name->length == 4) {
-        // For method calls, we need to bind the array to the native function
-        // Store array on stack, then replace with native function
-        // When called, the native will receive the array as first argument
-        ObjNative *native = newNative(arrayPushNative);
-        // Keep array on stack, push native function
-        push(OBJ_VAL(native));
-      } else if (strncmp(name->chars, "churn", name->length) == 0 &&
-                 name->length == 5) {
-        ObjNative *native = newNative(arrayPopNative);
-        push(OBJ_VAL(native));
-      } else if (strncmp(name->chars, "arr", name->length) == 0 &&
-                 name->length == 3) {
-        Value length = arrayLength(object);
-        pop(); // Remove array from stack
-        push(length);
-      } else {
-        runtimeError("Unknown property '%.*s'", name->length, name->chars);
+    CASE(OP_GET_PROPERTY) {
+      SYNC();
+      if (!getProperty(PAYLOAD_STRING(constants[pc->operands[0]]))) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      break;
+      NEXT();
     }
+    CASE(OP_ADD_R) {
+      REGISTER_OP(NUMBER_VAL, +);
+      NEXT();
     }
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("\n         ");
-    printf("VM stack:");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      // printValue(*slot);
-      printf(" ]");
+    CASE(OP_SUBSTRACT_R) {
+      REGISTER_OP(NUMBER_VAL, -);
+      NEXT();
     }
-    printf("\n\n");
-    printf("VM table: ");
-    if ((&vm.strings)->entries == NULL || (&vm.strings)->capacity == 0) {
-      printf("Table is empty\n");
-      continue;
+    CASE(OP_MULITPLY_R) {
+      REGISTER_OP(NUMBER_VAL, *);
+      NEXT();
     }
-
-    Entry **entries = vm.strings.entries;
-    for (int i = 0; i < vm.strings.capacity; i++) {
-      if (entries[i] != NULL && entries[i]->key != NULL) {
-        printf("[ ");
-        printf("%s %p %p", entries[i]->key->chars, entries[i]->key, entries[i]);
-        printf(" ]");
-      }
+    CASE(OP_DIVIDE_R) {
+      REGISTER_OP(NUMBER_VAL, /);
+      NEXT();
+    }
+    CASE(OP_EQUAL_R) {
+      REGISTER_OP(BOOL_VAL, ==);
+      NEXT();
+    }
+    CASE(OP_GREATER_R) {
+      REGISTER_OP(BOOL_VAL, >);
+      NEXT();
+    }
+    CASE(OP_LESS_R) {
+      REGISTER_OP(BOOL_VAL, <);
+      NEXT();
+    }
+    CASE(OP_MOVE_R) {
+      uint8_t kinds = pc->operands[0];
+      frame->slots[pc->operands[1]] =
+          READ_REGISTER(kinds & REG_A_CONSTANT, pc->operands[2]);
+      NEXT();
+    }
+#ifndef THREADED_DISPATCH
     }
-    printf("\n");
-#endif
   }
-#undef READ_BYTE
-#undef READ_STRING
-#undef READ_CONSTANT
+#endif
+#undef CASE
+#undef DISPATCH
+#undef LOAD_FRAME
+#undef SYNC
+#undef NEXT
 #undef BINARY_OP
-#undef READ_SHORT
+#undef READ_REGISTER
+#undef REGISTER_OP
+}
+// what newVM() sets up and freeVM() takes down, the repl also starts over
+// with it after a line that doesn't compile
+static void initVM() {
+  initOutput();
+  vm->objectsHead = NULL;
+  vm->tracer = NULL;
+  resetStack();
+  initTable(&vm->strings);
+  initTable(&vm->globals);
+  defineNative("clock", clockNative);
+  defineNative("flush", flushNative);
+  defineStringNatives();
+  defineFileNatives();
+  defineParallelNatives();
+  defineIsolateNatives();
+}
+static void clearVM() {
+  flushOutput();
+  freeTraces();
+  freeObjects();
+  freeTable(&vm->strings);
+  freeTable(&vm->globals);
 }
-InterpretResult interpret(const char *source) {
+
+VM *newVM() {
+  // calloc so the flags all start off
+  VM *machine = calloc(1, sizeof(VM));
+  useVM(machine);
+  initVM();
+  return machine;
+}
+void freeVM(VM *machine) {
+  useVM(machine);
+  clearVM();
+  free(machine);
+  vm = NULL;
+}
+void useVM(VM *machine) { vm = machine; }
+
+InterpretResult interpret(VM *machine, const char *source) {
+  useVM(machine);
   ObjFunction *function = compile(source);
   if (function == NULL) {
-    if (vm.repl) {
-      freeVM();
+    if (vm->repl) {
+      clearVM();
       initVM();
     }
     return INTERPRET_COMPILE_ERROR;
   }
+  return interpretFunction(machine, function);
+}
+
+// runs an already compiled script, for interpret() and --emit-c programs
+InterpretResult interpretFunction(VM *machine, ObjFunction *function) {
+  useVM(machine);
   push(OBJ_VAL(function));
   ObjClosure *closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
 
-  call(closure, 0);
-  return run();
-}
-void initVM() {
-  vm.objectsHead = NULL;
-  resetStack();
-  initTable(&vm.strings);
-  initTable(&vm.globals);
-  defineNative("clock", clockNative);
+  // call() has already reported why it couldn't (bad bytecode, no room on
+  // the stack), there's no frame for runFrame() to run
+  if (!call(closure, 0) || !runFrame()) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  pop(); // what the script returned
+  return INTERPRET_OK;
 }
-
 void push(Value value) {
-  *(vm.stackTop) = value;
-  vm.stackTop++;
+  *(vm->stackTop) = value;
+  vm->stackTop++;
 }
 Value pop() {
-  vm.stackTop--; // never explicitly removes the last element
-  Value value = *(vm.stackTop);
+  vm->stackTop--; // never explicitly removes the last element
+  Value value = *(vm->stackTop);
   return value;
 }
-void freeVM() {
-  freeObjects();
-  freeTable(&vm.strings);
-  freeTable(&vm.globals);
-}
 // typedef struct{
 //     Chunk*chunk;
 //     uint8_t* ip;
@@ -0,0 +1,268 @@
+// damaged .saasc images and snapshots, each one with a correct size and
+// checksum so it gets past stamped() and into the readers. Every one of them
+// has to be turned down (NULL/false, nothing run) without crashing, the
+// untouched ones have to load. Run with a scratch path: build/crafted
+// build/crafted.bin (make test does)
+#include "../include/bytecode/image.h"
+#include "../include/compiler/compiler.h"
+#include "../include/datastructures/hash.h"
+#include "../include/vm/vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *SOURCE =
+    "bootstrap greeting = \"hello\";\n"
+    "mvp twice(x) { saas x + x; }\n"
+    "leverage(twice(greeting));\n";
+
+static const char *PRELUDE = "bootstrap name = \"prelude\";\n"
+                             "bootstrap list = [1, \"two\", unicorn];\n"
+                             "mvp shout(x) { saas x + \"!\"; }\n";
+
+static const char *path;
+static int failures = 0;
+
+static char *readAll(size_t *size) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "crafted: can't read %s\n", path);
+    exit(2);
+  }
+  fseek(file, 0, SEEK_END);
+  *size = (size_t)ftell(file);
+  rewind(file);
+  char *bytes = malloc(*size);
+  if (fread(bytes, 1, *size, file) != *size) {
+    fprintf(stderr, "crafted: short read of %s\n", path);
+    exit(2);
+  }
+  fclose(file);
+  return bytes;
+}
+
+// writes bytes out with the size and checksum it would have had if it had
+// been written like that
+static void writeSealed(char *bytes, size_t size, size_t headerSize) {
+  ImageStamp *stamp = (ImageStamp *)bytes;
+  stamp->size = (uint32_t)size;
+  stamp->checksum =
+      hashString(bytes + headerSize, (int)(size - headerSize));
+  FILE *file = fopen(path, "wb");
+  fwrite(bytes, 1, size, file);
+  fclose(file);
+}
+
+static void expect(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "crafted: %s\n", what);
+    failures++;
+  }
+}
+
+static uint32_t *word(char *bytes, size_t offset) {
+  return (uint32_t *)(bytes + offset);
+}
+
+static size_t padded(size_t size) { return (size + 3) & ~(size_t)3; }
+
+// past the strings, which start right after the header
+static size_t skipStrings(char *bytes, size_t offset, uint32_t count,
+                          bool withInterned) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t length = *word(bytes, offset);
+    offset += 4 + (withInterned ? 4 : 0) + padded(length + 1);
+  }
+  return offset;
+}
+
+// the image's script function, offset of its ImageFunction record
+static size_t scriptRecord(char *bytes) {
+  const ImageHeader *header = (const ImageHeader *)bytes;
+  return skipStrings(bytes, sizeof(ImageHeader), header->stringCount, false);
+}
+
+static bool loads(char *bytes, size_t size) {
+  writeSealed(bytes, size, sizeof(ImageHeader));
+  VM *machine = newVM();
+  Image image;
+  ObjFunction *script = loadImage(&image, path, SOURCE, strlen(SOURCE));
+  freeVM(machine);
+  closeImage(&image);
+  return script != NULL;
+}
+
+static void rejects(const char *name, char *original, size_t size,
+                    void (*damage)(char *bytes, size_t *size)) {
+  char *bytes = malloc(size);
+  memcpy(bytes, original, size);
+  damage(bytes, &size);
+  if (loads(bytes, size)) {
+    fprintf(stderr, "crafted: image with %s got loaded\n", name);
+    failures++;
+  }
+  free(bytes);
+}
+
+static void longestString(char *bytes, size_t *size) {
+  (void)size;
+  *word(bytes, sizeof(ImageHeader)) = UINT32_MAX;
+}
+
+static void stringPastIntMax(char *bytes, size_t *size) {
+  (void)size;
+  *word(bytes, sizeof(ImageHeader)) = 0x80000000u;
+}
+
+static void stringPastTheEnd(char *bytes, size_t *size) {
+  *word(bytes, sizeof(ImageHeader)) = (uint32_t)*size;
+}
+
+static void manyStrings(char *bytes, size_t *size) {
+  (void)size;
+  ((ImageHeader *)bytes)->stringCount = UINT32_MAX;
+}
+
+static void manyFunctions(char *bytes, size_t *size) {
+  (void)size;
+  ((ImageHeader *)bytes)->functionCount = UINT32_MAX;
+}
+
+static void truncated(char *bytes, size_t *size) {
+  (void)bytes;
+  *size -= 4;
+}
+
+static void longCode(char *bytes, size_t *size) {
+  (void)size;
+  ((ImageFunction *)(bytes + scriptRecord(bytes)))->codeCount = INT32_MAX;
+}
+
+static void negativeConstants(char *bytes, size_t *size) {
+  (void)size;
+  ((ImageFunction *)(bytes + scriptRecord(bytes)))->constantCount = -1;
+}
+
+static void badOpcode(char *bytes, size_t *size) {
+  (void)size;
+  bytes[scriptRecord(bytes) + sizeof(ImageFunction)] = (char)0xff;
+}
+
+// the script's first constant pointing past the strings
+static void badConstant(char *bytes, size_t *size) {
+  (void)size;
+  size_t record = scriptRecord(bytes);
+  const ImageFunction *function = (const ImageFunction *)(bytes + record);
+  size_t constants = record + sizeof(ImageFunction) +
+                     padded(function->codeCount) + padded(function->lineCount);
+  ImageConstant *constant = (ImageConstant *)(bytes + constants);
+  constant->type = IMAGE_STRING;
+  constant->index = UINT32_MAX;
+}
+
+static void images() {
+  VM *machine = newVM();
+  ObjFunction *script = compile(SOURCE);
+  bool written =
+      script != NULL && writeImage(script, SOURCE, strlen(SOURCE), path);
+  freeVM(machine);
+  if (!written) {
+    fprintf(stderr, "crafted: couldn't write an image to %s\n", path);
+    exit(2);
+  }
+  size_t size;
+  char *bytes = readAll(&size);
+  expect(loads(bytes, size), "the untouched image didn't load");
+
+  rejects("a string of length UINT32_MAX", bytes, size, longestString);
+  rejects("a string longer than INT_MAX", bytes, size, stringPastIntMax);
+  rejects("a string running past the end", bytes, size, stringPastTheEnd);
+  rejects("UINT32_MAX strings", bytes, size, manyStrings);
+  rejects("UINT32_MAX functions", bytes, size, manyFunctions);
+  rejects("its last word cut off", bytes, size, truncated);
+  rejects("code running past the end", bytes, size, longCode);
+  rejects("a negative constant count", bytes, size, negativeConstants);
+  rejects("an unknown opcode", bytes, size, badOpcode);
+  rejects("a constant past the strings", bytes, size, badConstant);
+
+  // without resealing, so it's stamped() that has to catch it
+  bytes[size - 1] ^= 1;
+  FILE *file = fopen(path, "wb");
+  fwrite(bytes, 1, size, file);
+  fclose(file);
+  machine = newVM();
+  Image image;
+  expect(loadImage(&image, path, SOURCE, strlen(SOURCE)) == NULL,
+         "an image with a bad checksum got loaded");
+  freeVM(machine);
+  closeImage(&image);
+  free(bytes);
+}
+
+static bool loadsSnapshot(char *bytes, size_t size) {
+  writeSealed(bytes, size, sizeof(SnapshotHeader));
+  VM *machine = newVM();
+  Image snapshot;
+  bool ok = loadSnapshot(&snapshot, path);
+  freeVM(machine);
+  closeImage(&snapshot);
+  return ok;
+}
+
+static void snapshots() {
+  VM *machine = newVM();
+  bool written =
+      interpret(machine, PRELUDE) == INTERPRET_OK && writeSnapshot(path);
+  freeVM(machine);
+  if (!written) {
+    fprintf(stderr, "crafted: couldn't write a snapshot to %s\n", path);
+    exit(2);
+  }
+  size_t size;
+  char *bytes = readAll(&size);
+  expect(loadsSnapshot(bytes, size), "the untouched snapshot didn't load");
+
+  SnapshotHeader *header = (SnapshotHeader *)bytes;
+  uint32_t *length = word(bytes, sizeof(SnapshotHeader));
+  uint32_t original = *length;
+  *length = UINT32_MAX;
+  expect(!loadsSnapshot(bytes, size),
+         "a snapshot with a string of length UINT32_MAX got loaded");
+  *length = 0x80000000u;
+  expect(!loadsSnapshot(bytes, size),
+         "a snapshot with a string longer than INT_MAX got loaded");
+  *length = original;
+
+  uint32_t arrays = header->arrayCount;
+  header->arrayCount = UINT32_MAX;
+  expect(!loadsSnapshot(bytes, size),
+         "a snapshot with UINT32_MAX arrays got loaded");
+  header->arrayCount = arrays;
+
+  uint32_t globals = header->globalCount;
+  header->globalCount = globals + 1;
+  expect(!loadsSnapshot(bytes, size),
+         "a snapshot with a global missing got loaded");
+  header->globalCount = globals;
+
+  expect(!loadsSnapshot(bytes, size - 4),
+         "a snapshot with its last word cut off got loaded");
+  free(bytes);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: crafted [scratch file]\n");
+    return 2;
+  }
+  path = argv[1];
+  images();
+  snapshots();
+  remove(path);
+  if (failures > 0) {
+    fprintf(stderr, "crafted: %d failed\n", failures);
+    return 1;
+  }
+  printf("crafted: every damaged image was turned down\n");
+  return 0;
+}
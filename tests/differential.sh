@@ -0,0 +1,69 @@
+#!/bin/bash
+# every script (example_files/*.saas unless some are given) under each
+# engine, against the plain interpreter: stdout, stderr and the exit code all
+# have to match. `make test` builds what it needs and runs it from the repo
+# root
+SAAS=build/saas
+JIT1=build/saas-jit1 # -DJIT_THRESHOLD=1, everything gets compiled on its first call
+REG=build/saas-reg   # -DREGISTER_VM
+
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+failed=0
+
+# run <engine> <command...>, what it printed goes in $scratch/<engine>.*
+# (the functions below put the timeout on the program they end up running)
+run() {
+  local engine=$1
+  shift
+  if declare -F "$1" >/dev/null; then
+    "$@" >"$scratch/$engine.out" 2>"$scratch/$engine.err"
+  else
+    timeout 60 "$@" >"$scratch/$engine.out" 2>"$scratch/$engine.err"
+  fi
+  echo "exit $?" >"$scratch/$engine.code"
+}
+
+# the script as a cached .saasc: compiled once, then run from the cache
+cached() {
+  mkdir -p "$scratch/cache"
+  cp "$1" "$scratch/cache/script.saas"
+  rm -f "$scratch/cache/script.saasc"
+  $SAAS --compile-only "$scratch/cache/script.saas" >/dev/null 2>&1 &&
+    [ -f "$scratch/cache/script.saasc" ] &&
+    timeout 60 $SAAS "$scratch/cache/script.saas"
+}
+
+# the script through --emit-c and a C compiler
+emitted() {
+  $SAAS --emit-c "$1" >"$scratch/program.c" &&
+    gcc -O1 -I include "$scratch/program.c" build/libsaas.a -lm -lpthread \
+      -o "$scratch/program" &&
+    timeout 60 "$scratch/program"
+}
+
+if [ $# = 0 ]; then
+  set -- example_files/*.saas
+fi
+for file in "$@"; do
+  run plain $SAAS "$file"
+  run jit $SAAS --jit "$file"
+  run jit1 $JIT1 --jit "$file"
+  run lazy $SAAS --lazy "$file"
+  run lex-thread $SAAS --lex-thread "$file"
+  run register $REG "$file"
+  run cache cached "$file"
+  run emit-c emitted "$file"
+  for engine in jit jit1 lazy lex-thread register cache emit-c; do
+    for part in out err code; do
+      if ! cmp -s "$scratch/plain.$part" "$scratch/$engine.$part"; then
+        echo "FAIL $file: $engine differs from the interpreter ($part)"
+        diff "$scratch/plain.$part" "$scratch/$engine.$part" | head -10
+        failed=1
+      fi
+    done
+  done
+done
+
+[ $failed = 0 ] && echo "differential: all engines agree"
+exit $failed